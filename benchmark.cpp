@@ -0,0 +1,818 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "buffer_pool.h"
+#include "compression.h"
+#include "grayscale.h"
+#include "intensity.h"
+#include "luma.h"
+#include "protocol.h"
+#include "shared_memory.h"
+
+using namespace std;
+
+// Benchmarks for the server. Every result is printed to stdout as one JSON object per line, so runs can be
+// stored and compared by scripts; progress and errors go to stderr.
+//
+//   ./benchmark kernels [--sizes WxH,...] [--seconds S]
+//       Grayscale kernels (every kernel the CPU supports), the bucket partitioning, the intensity bucketing
+//       (histogram, prefix sums and index scatter on one thread) and the wire compression, per image size.
+//       Compression is measured on noise and on a photo-like image, for the RGB upload and the gray download; the
+//       break-even bandwidth is the link speed below which the bytes saved take longer to send than the CPU time
+//       spent compressing and decoding them (one thread each, no overlap with the transfer).
+//   ./benchmark load [--host IP] [--port N] [--clients N] [--requests N] [--warmup N] [--size WxH] [--buckets N] [--stream]
+//                    [--pipeline N] [--no-verify] [--image noise|photo] [--compress] [--bandwidth MBIT] [--local SOCKET]
+//       N concurrent synthetic clients against a running server, with end-to-end latency percentiles. With --pipeline,
+//       every client keeps one connection open and has up to N requests in flight on it. --bandwidth paces every
+//       client to that many Mbit/s in each direction, like a device on its own link, so loopback runs show what
+//       --compress gains on a slower network; the client compresses every request anew, so its CPU cost is included.
+//       --local connects to the server's Unix domain socket instead and passes the frames in shared memory: every
+//       client writes its frame into a memory file once, like a capture buffer, and gets one output file per request
+//       in flight, so only headers cross the socket.
+
+const int CHANNELS = 3;                                    // Bytes per RGB pixel.
+const char *DEFAULT_SIZES = "640x480,1920x1080,3840x2160,8192x8192"; // Image sizes measured by default.
+const double DEFAULT_SECONDS = 0.25;                       // Minimum measuring time per kernel and size.
+const uint32_t PARTITION_BUCKETS[] = {8, 256, 4096};       // Bucket counts measured for the partitioning.
+const uint32_t INTENSITY_BUCKETS[] = {4, 16, 256};         // Range counts measured for the intensity bucketing.
+
+// Settings of the load generator.
+struct LoadConfig
+{
+    string host = "127.0.0.1";      // Server address (IPv4).
+    int port = DEFAULT_PORT;        // Server port.
+    int clients = 8;                // Concurrent connections.
+    int requests = 100;             // Measured requests per client.
+    int warmup = 2;                 // Unmeasured requests per client before that.
+    uint32_t width = 1920;          // Size of the synthetic image.
+    uint32_t height = 1080;
+    uint32_t buckets = DEFAULT_BUCKETS; // Buckets asked for.
+    bool stream = false;            // Use REQUEST_FLAG_STREAMING.
+    int pipeline = 0;               // Requests in flight on one persistent connection (0 opens a connection per request).
+    bool verify = true;             // Compare every response with the expected grayscale image.
+    bool photo = false;             // Use the photo-like image instead of noise.
+    bool compress = false;          // Send compressed pixels and accept compressed responses.
+    double bandwidthMbit = 0;       // Simulated link speed per client and direction (0: unlimited).
+    string localSocket;             // Unix domain socket of a same-host server: requests use shared memory.
+};
+
+// What one load client measured.
+struct LoadResult
+{
+    vector<double> latenciesMs;     // End-to-end time of every successful measured request.
+    size_t errors = 0;              // Failed or wrong responses.
+    uint64_t wireBytes = 0;         // Bytes sent and received, headers included.
+};
+
+// A simulated link of fixed bandwidth for one direction of one client: after every transfer the caller waits until
+// the bytes could have crossed the link. Idle time earns no credit, so there are no bursts above the rate.
+struct Pacer
+{
+    double bytesPerSecond = 0;      // 0: unlimited.
+    chrono::steady_clock::time_point next = chrono::steady_clock::now(); // When the link is free again.
+    uint64_t bytes = 0;             // Bytes moved so far.
+
+    explicit Pacer(double mbit = 0) : bytesPerSecond(mbit * 1e6 / 8) {}
+
+    // Function to account for 'moved' bytes and wait until they have passed the link
+    void pace(size_t moved)
+    {
+        bytes += moved;
+        if (bytesPerSecond <= 0)
+            return;
+        next = max(next, chrono::steady_clock::now()) +
+               chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(moved / bytesPerSecond));
+        this_thread::sleep_until(next);
+    }
+};
+
+const size_t PACED_TRANSFER_BYTES = 64 << 10; // Largest single send() or recv() on a paced link, so pacing stays smooth.
+
+// Function to return the time elapsed since 'start' in seconds
+double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Function to fill a buffer with reproducible pseudo-random bytes
+vector<unsigned char> randomBytes(size_t length, unsigned seed)
+{
+    vector<unsigned char> bytes(length);
+    mt19937 generator(seed);
+    for (size_t i = 0; i < length; i += 4)
+    {
+        uint32_t value = generator(); // Four bytes per draw.
+        memcpy(bytes.data() + i, &value, min<size_t>(4, length - i));
+    }
+    return bytes;
+}
+
+// Function to build a reproducible photo-like RGB image: smooth gradients, flat areas and a little sensor noise,
+// so neighbouring pixels are similar the way they are in camera frames (random bytes are the worst case instead)
+vector<unsigned char> photoBytes(uint32_t width, uint32_t height, unsigned seed)
+{
+    vector<unsigned char> bytes(size_t(width) * height * CHANNELS);
+    mt19937 generator(seed);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width; x++)
+        {
+            unsigned char *pixel = bytes.data() + (size_t(y) * width + x) * CHANNELS;
+            uint32_t noise = generator(); // Three small offsets per draw.
+            bool flat = (x / 160 + y / 160) % 5 == 0; // Walls, sky, paper.
+            double base[CHANNELS] = {128 + 60 * sin(x / 90.0) + 40 * cos(y / 70.0), 120 + 50 * sin((x + y) / 120.0),
+                                     100 + 70 * cos(x / 150.0 - y / 200.0)};
+            for (int c = 0; c < CHANNELS; c++)
+            {
+                int value = flat ? 200 : int(base[c]) + int((noise >> (8 * c)) % 7) - 3;
+                pixel[c] = static_cast<unsigned char>(min(255, max(0, value)));
+            }
+        }
+    }
+    return bytes;
+}
+
+// Function to parse "WxH" into its two numbers
+bool parseSize(const string &text, uint32_t &width, uint32_t &height)
+{
+    return sscanf(text.c_str(), "%ux%u", &width, &height) == 2 && width > 0 && height > 0;
+}
+
+// Function to return the value at quantile 'q' (0..1) of sorted samples, using the nearest-rank method
+double percentile(const vector<double> &sorted, double q)
+{
+    if (sorted.empty())
+        return 0;
+    size_t rank = static_cast<size_t>(q * sorted.size() + 0.999999); // ceil(q * n), at least 1.
+    return sorted[min(sorted.size(), max<size_t>(rank, 1)) - 1];
+}
+
+// Function to measure every supported grayscale kernel and the bucket partitioning for each image size
+void runKernelBenchmarks(const vector<pair<uint32_t, uint32_t>> &sizes, double seconds)
+{
+    size_t count = 0;
+    const GrayscaleKernelInfo *kernels = grayscaleKernels(count);
+    for (const auto &size : sizes)
+    {
+        size_t pixels = size_t(size.first) * size.second;
+        vector<unsigned char> rgb = randomBytes(pixels * CHANNELS, 1);
+        vector<unsigned char> gray(pixels);
+        for (size_t k = 0; k < count; k++)
+        {
+            if (!kernels[k].supported)
+                continue;
+            kernels[k].kernel(rgb.data(), gray.data(), pixels); // Warm up caches and page tables.
+            size_t iterations = 0;
+            auto start = chrono::steady_clock::now();
+            double elapsed = 0;
+            do
+            {
+                kernels[k].kernel(rgb.data(), gray.data(), pixels);
+                iterations++;
+                elapsed = secondsSince(start);
+            } while (elapsed < seconds);
+            double pixelsPerSecond = double(pixels) * iterations / elapsed;
+            printf("{\"benchmark\":\"grayscale\",\"kernel\":\"%s\",\"width\":%u,\"height\":%u,\"pixels\":%zu,"
+                   "\"iterations\":%zu,\"seconds\":%.6f,\"pixels_per_s\":%.0f,\"gb_per_s\":%.3f}\n",
+                   kernels[k].name, size.first, size.second, pixels, iterations, elapsed, pixelsPerSecond,
+                   pixelsPerSecond * (CHANNELS + 1) / 1e9); // Bytes moved: RGB read plus gray written.
+        }
+        const char *weightings[LUMA_WEIGHTINGS] = {"average", "bt601", "bt709"};
+        vector<unsigned char> wide = randomBytes(pixels * bytesPerPixel(PIXEL_FORMAT_RGBA16), 3); // Enough for any format.
+        for (uint16_t format = PIXEL_FORMAT_RGB8; pixelFormatName(format); format++)
+        {
+            for (int w = 0; w < LUMA_WEIGHTINGS; w++)
+            {
+                GrayscaleKernel kernel = lumaKernel(format, LumaWeighting(w)); // Picked once, as per request on the server.
+                kernel(wide.data(), gray.data(), pixels);
+                size_t iterations = 0;
+                auto start = chrono::steady_clock::now();
+                double elapsed = 0;
+                do
+                {
+                    kernel(wide.data(), gray.data(), pixels);
+                    iterations++;
+                    elapsed = secondsSince(start);
+                } while (elapsed < seconds);
+                double pixelsPerSecond = double(pixels) * iterations / elapsed;
+                printf("{\"benchmark\":\"luma\",\"format\":\"%s\",\"weighting\":\"%s\",\"width\":%u,\"height\":%u,"
+                       "\"pixels\":%zu,\"iterations\":%zu,\"seconds\":%.6f,\"pixels_per_s\":%.0f,\"gb_per_s\":%.3f}\n",
+                       pixelFormatName(format), weightings[w], size.first, size.second, pixels, iterations, elapsed,
+                       pixelsPerSecond, pixelsPerSecond * (bytesPerPixel(format) + 1) / 1e9); // Pixels read plus gray written.
+            }
+        }
+        for (uint32_t buckets : PARTITION_BUCKETS)
+        {
+            if (buckets > pixels)
+                continue;
+            size_t iterations = 0, checksum = 0;
+            auto start = chrono::steady_clock::now();
+            double elapsed = 0;
+            do
+            {
+                vector<BucketView> views = partitionIntoBuckets(pixels, buckets);
+                checksum += views.back().offset; // Keeps the call from being optimized away.
+                iterations++;
+                elapsed = secondsSince(start);
+            } while (elapsed < seconds);
+            double pixelsPerSecond = double(pixels) * iterations / elapsed;
+            printf("{\"benchmark\":\"partition\",\"buckets\":%u,\"width\":%u,\"height\":%u,\"pixels\":%zu,"
+                   "\"iterations\":%zu,\"seconds\":%.6f,\"ns_per_call\":%.1f,\"pixels_per_s\":%.0f,\"gb_per_s\":%.3f,\"checksum\":%zu}\n",
+                   buckets, size.first, size.second, pixels, iterations, elapsed, elapsed * 1e9 / iterations,
+                   pixelsPerSecond, pixelsPerSecond / 1e9, checksum); // One gray byte per pixel is partitioned.
+        }
+        for (uint32_t buckets : INTENSITY_BUCKETS)
+        {
+            vector<unsigned char> thresholds(buckets - 1);
+            defaultIntensityThresholds(buckets, thresholds.data());
+            size_t iterations = 0, checksum = 0;
+            auto start = chrono::steady_clock::now();
+            double elapsed = 0;
+            do
+            {
+                PooledBuffer result(intensityResultSize(pixels, buckets)); // Recycled, like on the server.
+                bucketByIntensity(gray.data(), pixels, thresholds.data(), buckets, result.data());
+                checksum += result[result.size() - 1]; // Keeps the call from being optimized away.
+                iterations++;
+                elapsed = secondsSince(start);
+            } while (elapsed < seconds);
+            double pixelsPerSecond = double(pixels) * iterations / elapsed;
+            printf("{\"benchmark\":\"intensity\",\"buckets\":%u,\"width\":%u,\"height\":%u,\"pixels\":%zu,"
+                   "\"iterations\":%zu,\"seconds\":%.6f,\"pixels_per_s\":%.0f,\"gb_per_s\":%.3f,\"checksum\":%zu}\n",
+                   buckets, size.first, size.second, pixels, iterations, elapsed, pixelsPerSecond,
+                   pixelsPerSecond * 6 / 1e9, checksum); // Bytes moved: gray read twice plus a 4-byte index written.
+        }
+        vector<unsigned char> photo = photoBytes(size.first, size.second, 1), photoGray(pixels);
+        convertGrayscaleScalar(photo.data(), photoGray.data(), pixels);
+        const struct { const char *image, *payload; const unsigned char *data; size_t bytes; int stride; } payloads[] = {
+            {"noise", "rgb", rgb.data(), rgb.size(), CHANNELS}, {"noise", "gray", gray.data(), pixels, 1},
+            {"photo", "rgb", photo.data(), photo.size(), CHANNELS}, {"photo", "gray", photoGray.data(), pixels, 1}};
+        for (const auto &payload : payloads)
+        {
+            vector<unsigned char> packed(compressedBound(payload.bytes, payload.stride)), decoded(payload.bytes);
+            size_t packedBytes = 0, encodes = 0, decodes = 0;
+            auto start = chrono::steady_clock::now();
+            double encodeSeconds = 0, decodeSeconds = 0;
+            do
+            {
+                packedBytes = compressPayload(payload.data, payload.bytes, payload.stride, packed.data());
+                encodes++;
+                encodeSeconds = secondsSince(start);
+            } while (encodeSeconds < seconds);
+            bool decodedOk = true;
+            start = chrono::steady_clock::now();
+            do
+            {
+                decodedOk = decompressPayload(packed.data(), packedBytes, payload.stride, decoded.data(), payload.bytes) && decodedOk;
+                decodes++;
+                decodeSeconds = secondsSince(start);
+            } while (decodeSeconds < seconds);
+            decodedOk = decodedOk && memcmp(decoded.data(), payload.data, payload.bytes) == 0;
+            double ratio = double(packedBytes) / payload.bytes;
+            double encodeRate = double(payload.bytes) * encodes / encodeSeconds; // Raw bytes per second.
+            double decodeRate = double(payload.bytes) * decodes / decodeSeconds;
+            // Sending raw takes bytes / B; compressed takes ratio * bytes / B plus the CPU time. Solved for B:
+            double breakEven = ratio < 1 ? (1 - ratio) / (1 / encodeRate + 1 / decodeRate) * 8 / 1e6 : 0;
+            printf("{\"benchmark\":\"compression\",\"image\":\"%s\",\"payload\":\"%s\",\"width\":%u,\"height\":%u,"
+                   "\"raw_bytes\":%zu,\"packed_bytes\":%zu,\"ratio\":%.3f,\"encode_gb_per_s\":%.3f,\"decode_gb_per_s\":%.3f,"
+                   "\"break_even_mbit_per_s\":%.0f,\"verified\":%s}\n",
+                   payload.image, payload.payload, size.first, size.second, payload.bytes, packedBytes, ratio,
+                   encodeRate / 1e9, decodeRate / 1e9, breakEven, decodedOk ? "true" : "false");
+        }
+        fflush(stdout);
+    }
+}
+
+// Function to send 'length' bytes, looping over short writes, at the pace of the simulated link
+bool sendAll(int sock, const unsigned char *data, size_t length, Pacer &pacer)
+{
+    while (length > 0)
+    {
+        size_t chunk = pacer.bytesPerSecond > 0 ? min(length, PACED_TRANSFER_BYTES) : length;
+        ssize_t sent = send(sock, data, chunk, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return false;
+        pacer.pace(sent);
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+// Function to receive exactly 'length' bytes, looping over short reads, at the pace of the simulated link
+bool recvAll(int sock, unsigned char *data, size_t length, Pacer &pacer)
+{
+    while (length > 0)
+    {
+        size_t chunk = pacer.bytesPerSecond > 0 ? min(length, PACED_TRANSFER_BYTES) : length;
+        ssize_t received = recv(sock, data, chunk, 0);
+        if (received <= 0)
+            return false;
+        pacer.pace(received);
+        data += received;
+        length -= received;
+    }
+    return true;
+}
+
+// Function to build the request header for one synthetic image and point 'payload' at the bytes to upload.
+// With --compress the pixels are compressed into 'packed' on every call, so the client's CPU cost is measured too.
+RequestHeader buildRequest(const LoadConfig &config, const vector<unsigned char> &rgb, uint32_t flags, vector<unsigned char> &packed,
+                           const unsigned char *&payload)
+{
+    RequestHeader request;
+    request.width = config.width;
+    request.height = config.height;
+    request.buckets = config.buckets;
+    request.bucketCount = config.buckets;
+    request.flags = flags;
+    request.payloadLength = rgb.size();
+    payload = rgb.data();
+    if (config.compress)
+    {
+        packed.resize(compressedBound(rgb.size(), CHANNELS));
+        request.payloadLength = compressPayload(rgb.data(), rgb.size(), CHANNELS, packed.data());
+        request.flags |= REQUEST_FLAG_COMPRESSED | REQUEST_FLAG_ACCEPT_COMPRESSED;
+        payload = packed.data();
+    }
+    return request;
+}
+
+// Function to receive the gray bytes announced by 'response' into 'gray', decoding each chunk as soon as it has
+// arrived if they come compressed
+bool receiveGray(int sock, const ResponseHeader &response, vector<unsigned char> &gray, Pacer &pacer, vector<unsigned char> &chunk)
+{
+    if (!(response.flags & RESPONSE_FLAG_COMPRESSED))
+        return response.payloadLength == gray.size() && recvAll(sock, gray.data(), gray.size(), pacer);
+    uint64_t left = response.payloadLength;
+    for (size_t c = 0, chunks = compressionChunkCount(gray.size(), 1); c < chunks; c++)
+    {
+        size_t length = compressionChunkBytes(gray.size(), 1, c);
+        unsigned char prefix[4];
+        if (left < 4 || !recvAll(sock, prefix, 4, pacer))
+            return false;
+        size_t coded = compressedChunkLength(prefix);
+        if (coded + 4 > compressedChunkBound(length) || left - 4 < coded)
+            return false;
+        chunk.resize(coded);
+        if (!recvAll(sock, chunk.data(), coded, pacer) ||
+            !decompressChunk(chunk.data(), coded, 1, gray.data() + c * COMPRESSION_CHUNK_PIXELS, length))
+            return false;
+        left -= 4 + coded;
+    }
+    return left == 0;
+}
+
+// Memory files of one load client in --local mode: the frame, written once, and an output file per request in flight.
+struct SharedFrames
+{
+    int input = -1;                 // Memory file holding the frame.
+    vector<int> outputs;            // Memory files the server writes the gray bytes into.
+    vector<SharedRegion> gray;      // Mappings of 'outputs', for verification.
+    vector<size_t> free;            // Output files not used by a request in flight.
+
+    ~SharedFrames()
+    {
+        if (input >= 0)
+            close(input);
+        for (int fd : outputs)
+            close(fd);
+    }
+};
+
+// Function to create the memory files of a load client and write the frame into the input file
+bool createSharedFrames(const vector<unsigned char> &rgb, size_t grayBytes, size_t slots, SharedFrames &frames)
+{
+    SharedRegion pixels;
+    frames.input = createSharedMemory("load-input", rgb.size());
+    if (frames.input < 0 || !pixels.map(frames.input, rgb.size(), true))
+        return false;
+    memcpy(pixels.data(), rgb.data(), rgb.size());
+    for (size_t slot = 0; slot < slots; slot++)
+    {
+        frames.outputs.push_back(createSharedMemory("load-output", grayBytes));
+        frames.gray.emplace_back();
+        if (frames.outputs.back() < 0 || !frames.gray.back().map(frames.outputs.back(), grayBytes, true))
+            return false;
+        frames.free.push_back(slot);
+    }
+    return true;
+}
+
+// Function to send a request whose pixels are in 'frames' and whose gray bytes go to output file 'slot'
+bool sendSharedRequest(int sock, RequestHeader request, const SharedFrames &frames, size_t slot)
+{
+    request.flags |= REQUEST_FLAG_SHARED_MEMORY;
+    unsigned char header[HEADER_SIZE];
+    encodeRequestHeader(request, header);
+    int files[2] = {frames.input, frames.outputs[slot]};
+    ssize_t sent = sendWithDescriptors(sock, header, HEADER_SIZE, files, 2); // The files travel with the first byte.
+    Pacer unpaced;
+    return sent > 0 && sendAll(sock, header + sent, HEADER_SIZE - sent, unpaced);
+}
+
+// Function to check the output file of 'slot' against the expected gray image, and clear it for the next request
+bool verifySharedGray(SharedFrames &frames, size_t slot, const vector<unsigned char> &expected)
+{
+    bool ok = memcmp(frames.gray[slot].data(), expected.data(), expected.size()) == 0;
+    memset(frames.gray[slot].data(), 0, expected.size()); // A request the server skipped cannot pass on stale bytes.
+    return ok;
+}
+
+// Function to open a connection to the server under test (its Unix domain socket with --local)
+int connectToServer(const LoadConfig &config)
+{
+    if (!config.localSocket.empty())
+    {
+        sockaddr_un address {};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, config.localSocket.c_str(), sizeof(address.sun_path) - 1);
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock >= 0 && connect(sock, (sockaddr *)&address, sizeof(address)) < 0)
+        {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host.c_str(), &address.sin_addr) <= 0 || connect(sock, (sockaddr *)&address, sizeof(address)) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    int one = 1; // The header is small; do not let Nagle hold it back.
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+// Function to run one request on a fresh connection and receive the whole response into 'gray'
+bool runRequest(const LoadConfig &config, const vector<unsigned char> &rgb, vector<unsigned char> &gray, vector<unsigned char> &packed,
+                LoadResult &result)
+{
+    const unsigned char *payload;
+    RequestHeader request = buildRequest(config, rgb, config.stream ? uint32_t(REQUEST_FLAG_STREAMING) : 0u, packed, payload);
+    unsigned char header[HEADER_SIZE];
+    encodeRequestHeader(request, header);
+    int sock = connectToServer(config);
+    if (sock < 0)
+        return false;
+    Pacer uplink(config.bandwidthMbit), downlink(config.bandwidthMbit);
+    bool sent = true;
+    thread sender; // Streaming requests must be sent while the response is read.
+    if (config.stream)
+        sender = thread([&]() { sent = sendAll(sock, header, HEADER_SIZE, uplink) && sendAll(sock, payload, request.payloadLength, uplink); });
+    else
+        sent = sendAll(sock, header, HEADER_SIZE, uplink) && sendAll(sock, payload, request.payloadLength, uplink);
+    unsigned char responseBytes[HEADER_SIZE];
+    bool received = sent && recvAll(sock, responseBytes, HEADER_SIZE, downlink);
+    if (received)
+    {
+        ResponseHeader response = decodeResponseHeader(responseBytes);
+        received = response.magic == PROTOCOL_MAGIC && response.status == STATUS_OK &&
+                   receiveGray(sock, response, gray, downlink, packed);
+    }
+    if (config.stream)
+    {
+        if (!received)
+            shutdown(sock, SHUT_RDWR); // Unblock the sender.
+        sender.join();
+    }
+    close(sock);
+    result.wireBytes += uplink.bytes + downlink.bytes;
+    return sent && received;
+}
+
+// Function to run one --local request on a fresh connection: the gray bytes land in the output file, only the
+// headers cross the socket
+bool runSharedRequest(const LoadConfig &config, const vector<unsigned char> &rgb, const SharedFrames &frames, size_t grayBytes,
+                      LoadResult &result)
+{
+    const unsigned char *payload;
+    vector<unsigned char> unused;
+    RequestHeader request = buildRequest(config, rgb, 0, unused, payload); // Pixels in shared memory: never compressed.
+    int sock = connectToServer(config);
+    if (sock < 0)
+        return false;
+    Pacer unpaced;
+    unsigned char responseBytes[HEADER_SIZE];
+    bool ok = sendSharedRequest(sock, request, frames, 0) && recvAll(sock, responseBytes, HEADER_SIZE, unpaced);
+    if (ok)
+    {
+        ResponseHeader response = decodeResponseHeader(responseBytes);
+        ok = response.magic == PROTOCOL_MAGIC && response.status == STATUS_OK &&
+             (response.flags & RESPONSE_FLAG_SHARED_MEMORY) && response.payloadLength == grayBytes;
+    }
+    close(sock);
+    result.wireBytes += 2 * HEADER_SIZE;
+    return ok;
+}
+
+// Function run by every load client: warm-up requests, then the measured ones
+void runLoadClient(const LoadConfig &config, const vector<unsigned char> &rgb, const vector<unsigned char> &expected, LoadResult &result)
+{
+    vector<unsigned char> gray(expected.size()), packed;
+    SharedFrames frames; // --local only.
+    if (!config.localSocket.empty() && !createSharedFrames(rgb, expected.size(), 1, frames))
+    {
+        result.errors += config.requests;
+        return;
+    }
+    result.latenciesMs.reserve(config.requests);
+    for (int i = 0; i < config.warmup + config.requests; i++)
+    {
+        auto start = chrono::steady_clock::now();
+        bool ok = frames.input >= 0 ? runSharedRequest(config, rgb, frames, expected.size(), result)
+                                    : runRequest(config, rgb, gray, packed, result);
+        double elapsedMs = secondsSince(start) * 1000;
+        if (ok && config.verify)
+            ok = frames.input >= 0 ? verifySharedGray(frames, 0, expected) : gray == expected; // Checked outside the timed part.
+        if (i < config.warmup)
+            continue;
+        if (ok)
+            result.latenciesMs.push_back(elapsedMs);
+        else
+            result.errors++;
+    }
+}
+
+// Function run by every load client in pipelined mode: all requests go over one connection, up to
+// 'config.pipeline' at a time, and each latency runs from sending the request to receiving its response
+void runSessionClient(const LoadConfig &config, const vector<unsigned char> &rgb, const vector<unsigned char> &expected, LoadResult &result)
+{
+    int total = config.warmup + config.requests;
+    SharedFrames frames; // --local only: one output file per request in flight.
+    int sock = config.localSocket.empty() || createSharedFrames(rgb, expected.size(), config.pipeline, frames)
+        ? connectToServer(config) : -1;
+    if (sock < 0)
+    {
+        result.errors += config.requests;
+        return;
+    }
+    vector<size_t> slotOf(total); // --local: output file of every request, by request ID.
+    mutex lock;
+    condition_variable changed;
+    int inFlight = 0; // Requests sent and not yet answered.
+    bool failed = false;
+    vector<chrono::steady_clock::time_point> sentAt(total); // Indexed by request ID.
+    Pacer uplink(config.bandwidthMbit), downlink(config.bandwidthMbit);
+    thread sender([&]()
+    {
+        vector<unsigned char> packed;
+        unsigned char header[HEADER_SIZE];
+        for (int i = 0; i < total; i++)
+        {
+            {
+                unique_lock<mutex> guard(lock);
+                changed.wait(guard, [&]() { return inFlight < config.pipeline || failed; });
+                if (failed)
+                    break;
+                inFlight++;
+                sentAt[i] = chrono::steady_clock::now();
+                if (frames.input >= 0)
+                {
+                    slotOf[i] = frames.free.back(); // There is one per request in flight.
+                    frames.free.pop_back();
+                }
+            }
+            const unsigned char *payload;
+            RequestHeader request = buildRequest(config, rgb, REQUEST_FLAG_KEEP_ALIVE, packed, payload);
+            request.requestId = i;
+            if (frames.input >= 0)
+            {
+                if (!sendSharedRequest(sock, request, frames, slotOf[i]))
+                    break;
+                uplink.bytes += HEADER_SIZE;
+                continue;
+            }
+            encodeRequestHeader(request, header);
+            if (!sendAll(sock, header, HEADER_SIZE, uplink) || !sendAll(sock, payload, request.payloadLength, uplink))
+                break;
+        }
+        shutdown(sock, SHUT_WR); // The server closes the connection once everything is answered.
+    });
+
+    vector<unsigned char> gray(expected.size()), chunk;
+    int answered = 0;
+    for (; answered < total; answered++)
+    {
+        unsigned char responseBytes[HEADER_SIZE];
+        if (!recvAll(sock, responseBytes, HEADER_SIZE, downlink))
+            break;
+        ResponseHeader response = decodeResponseHeader(responseBytes);
+        if (response.magic != PROTOCOL_MAGIC || response.status != STATUS_OK || response.requestId >= uint64_t(total))
+            break;
+        bool shared = (response.flags & RESPONSE_FLAG_SHARED_MEMORY) != 0;
+        if (shared != (frames.input >= 0) || (!shared && !receiveGray(sock, response, gray, downlink, chunk)))
+            break;
+        double elapsedMs;
+        {
+            lock_guard<mutex> guard(lock);
+            elapsedMs = secondsSince(sentAt[response.requestId]) * 1000;
+        }
+        bool ok = !config.verify || (shared ? verifySharedGray(frames, slotOf[response.requestId], expected) : gray == expected);
+        {
+            lock_guard<mutex> guard(lock);
+            inFlight--;
+            if (shared)
+                frames.free.push_back(slotOf[response.requestId]); // Checked and cleared: it can take the next request.
+        }
+        changed.notify_one();
+        if (response.requestId < uint64_t(config.warmup))
+            continue;
+        if (ok)
+            result.latenciesMs.push_back(elapsedMs);
+        else
+            result.errors++;
+    }
+    {
+        lock_guard<mutex> guard(lock);
+        failed = true; // Stops the sender if the receiving side gave up.
+    }
+    changed.notify_one();
+    shutdown(sock, SHUT_RDWR);
+    sender.join();
+    close(sock);
+    result.wireBytes += uplink.bytes + downlink.bytes;
+    result.errors += total - answered; // Requests that never got a response.
+}
+
+// Function to drive the server with concurrent clients and print one JSON line with throughput and latency
+bool runLoadBenchmark(const LoadConfig &config)
+{
+    size_t pixels = size_t(config.width) * config.height;
+    vector<unsigned char> rgb = config.photo ? photoBytes(config.width, config.height, 2) // One synthetic image shared by all clients.
+                                             : randomBytes(pixels * CHANNELS, 2);
+    vector<unsigned char> expected(pixels);
+    convertGrayscaleScalar(rgb.data(), expected.data(), pixels); // Reference answer.
+    cerr << "Load: " << config.clients << " clients x " << config.requests << " requests of " << config.width << "x"
+         << config.height << " against "
+         << (config.localSocket.empty() ? config.host + ":" + to_string(config.port) : config.localSocket + " (shared memory)") << endl;
+
+    vector<LoadResult> results(config.clients);
+    vector<thread> clients;
+    auto start = chrono::steady_clock::now();
+    for (int c = 0; c < config.clients; c++)
+        clients.emplace_back(config.pipeline > 0 ? runSessionClient : runLoadClient, cref(config), cref(rgb), cref(expected),
+                             ref(results[c]));
+    for (thread &t : clients)
+        t.join();
+    double elapsed = secondsSince(start); // Includes the warm-up requests, which are counted below as well.
+
+    vector<double> latencies;
+    size_t errors = 0;
+    uint64_t wireBytes = 0;
+    for (const LoadResult &result : results)
+    {
+        latencies.insert(latencies.end(), result.latenciesMs.begin(), result.latenciesMs.end());
+        errors += result.errors;
+        wireBytes += result.wireBytes;
+    }
+    sort(latencies.begin(), latencies.end());
+    size_t total = size_t(config.clients) * (config.warmup + config.requests); // Every request that was sent.
+    double bytesPerRequest = HEADER_SIZE * 2 + rgb.size() + pixels;
+    printf("{\"benchmark\":\"load\",\"host\":\"%s\",\"port\":%d,\"clients\":%d,\"requests\":%zu,\"errors\":%zu,"
+           "\"width\":%u,\"height\":%u,\"buckets\":%u,\"stream\":%s,\"pipeline\":%d,\"image\":\"%s\",\"compress\":%s,"
+           "\"bandwidth_mbit\":%.0f,\"transport\":\"%s\",\"seconds\":%.6f,\"requests_per_s\":%.1f,\"mb_per_s\":%.1f,\"wire_mb_per_s\":%.1f,"
+           "\"latency_ms\":{\"min\":%.3f,\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}}\n",
+           config.host.c_str(), config.port, config.clients, latencies.size(), errors, config.width, config.height,
+           config.buckets, config.stream ? "true" : "false", config.pipeline, config.photo ? "photo" : "noise",
+           config.compress ? "true" : "false", config.bandwidthMbit, config.localSocket.empty() ? "tcp" : "shared-memory", elapsed, total / elapsed,
+           total * bytesPerRequest / elapsed / 1e6, wireBytes / elapsed / 1e6, // Uncompressed bytes, then bytes on the wire.
+           latencies.empty() ? 0 : latencies.front(), percentile(latencies, 0.50), percentile(latencies, 0.99),
+           percentile(latencies, 0.999), latencies.empty() ? 0 : latencies.back());
+    fflush(stdout);
+    return errors == 0;
+}
+
+// Function to print the command line options
+void printUsage(const char *program)
+{
+    cerr << "Usage: " << program << " kernels [--sizes WxH,...] [--seconds S]" << endl
+         << "       " << program << " load [--host IP] [--port N] [--clients N] [--requests N] [--warmup N]"
+         << " [--size WxH] [--buckets N] [--stream] [--pipeline N] [--no-verify] [--image noise|photo] [--compress]"
+         << " [--bandwidth MBIT] [--local SOCKET]" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printUsage(argv[0]);
+        return -1;
+    }
+    string mode = argv[1];
+    string sizeList = DEFAULT_SIZES;
+    double seconds = DEFAULT_SECONDS;
+    LoadConfig config;
+    for (int i = 2; i < argc; i++)
+    {
+        string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (option == "--stream")
+            config.stream = true;
+        else if (option == "--no-verify")
+            config.verify = false;
+        else if (option == "--compress")
+            config.compress = true;
+        else if (option == "--bandwidth" && hasValue)
+            config.bandwidthMbit = max(0.0, atof(argv[++i]));
+        else if (option == "--image" && hasValue && (string(argv[i + 1]) == "noise" || string(argv[i + 1]) == "photo"))
+            config.photo = string(argv[++i]) == "photo";
+        else if (option == "--sizes" && hasValue)
+            sizeList = argv[++i];
+        else if (option == "--seconds" && hasValue)
+            seconds = atof(argv[++i]);
+        else if (option == "--local" && hasValue)
+            config.localSocket = argv[++i];
+        else if (option == "--host" && hasValue)
+            config.host = argv[++i];
+        else if (option == "--port" && hasValue)
+            config.port = atoi(argv[++i]);
+        else if (option == "--clients" && hasValue)
+            config.clients = max(1, atoi(argv[++i]));
+        else if (option == "--requests" && hasValue)
+            config.requests = max(1, atoi(argv[++i]));
+        else if (option == "--warmup" && hasValue)
+            config.warmup = max(0, atoi(argv[++i]));
+        else if (option == "--pipeline" && hasValue)
+            config.pipeline = max(0, atoi(argv[++i]));
+        else if (option == "--buckets" && hasValue)
+            config.buckets = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        else if (option == "--size" && hasValue)
+        {
+            if (!parseSize(argv[++i], config.width, config.height))
+            {
+                cerr << "Invalid size: " << argv[i] << endl;
+                return -1;
+            }
+        }
+        else
+        {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (mode == "kernels")
+    {
+        vector<pair<uint32_t, uint32_t>> sizes;
+        for (size_t start = 0; start < sizeList.size();)
+        {
+            size_t comma = min(sizeList.find(',', start), sizeList.size());
+            uint32_t width, height;
+            if (!parseSize(sizeList.substr(start, comma - start), width, height))
+            {
+                cerr << "Invalid size in --sizes: " << sizeList.substr(start, comma - start) << endl;
+                return -1;
+            }
+            sizes.push_back({width, height});
+            start = comma + 1;
+        }
+        runKernelBenchmarks(sizes, seconds);
+        return 0;
+    }
+    if (mode == "load")
+    {
+        if (config.stream && config.pipeline > 0)
+        {
+            cerr << "--stream cannot be combined with --pipeline." << endl;
+            return -1;
+        }
+        if (config.stream && config.compress)
+        {
+            cerr << "--stream cannot be combined with --compress." << endl;
+            return -1;
+        }
+        if (!config.localSocket.empty() && (config.stream || config.compress || config.bandwidthMbit > 0))
+        {
+            cerr << "--local cannot be combined with --stream, --compress or --bandwidth." << endl;
+            return -1;
+        }
+        return runLoadBenchmark(config) ? 0 : 1;
+    }
+    printUsage(argv[0]);
+    return -1;
+}
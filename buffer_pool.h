@@ -0,0 +1,258 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <sys/mman.h>
+
+// Recycled storage for the per-request image, gray and result buffers.
+//
+// A std::vector allocates fresh memory for every request and zero-fills it, and a fresh multi-megabyte block comes
+// straight from mmap(), so every one of its pages faults on first touch. The pool instead keeps released buffers
+// in free lists, one per size class, and hands them out again without clearing them: in steady state a request
+// reuses buffers that are already mapped and faulted in, and no large allocation happens at all.
+//
+// Size classes are four steps per power of two (4, 5, 6, 7 KiB, 8, 10, 12, 14 KiB, ...), so a buffer wastes at most
+// 25% of its class. Buffers of 1 MiB and more are mapped as whole 2 MiB pages, aligned and marked for transparent
+// huge pages, so a 1.5 MB frame is a single TLB entry instead of several hundred. The free lists hold at most 'cacheLimit' bytes;
+// buffers released beyond that go back to the kernel.
+class BufferPool
+{
+public:
+    static const size_t MIN_CLASS_BYTES = 4096;         // Smallest buffer handed out (one page).
+    static const size_t HUGE_PAGE_BYTES = 2u << 20;     // Transparent huge page size on x86-64.
+    static const size_t DEFAULT_CACHE_LIMIT = 256u << 20;
+
+    explicit BufferPool(size_t cacheLimitBytes = DEFAULT_CACHE_LIMIT) : cacheLimit(cacheLimitBytes)
+    {
+        for (std::vector<void *> &list : freeLists)
+            list.reserve(MAX_FREE_PER_CLASS); // Releasing a buffer must not allocate.
+    }
+
+    ~BufferPool()
+    {
+        for (int c = 0; c < CLASSES; c++)
+            for (void *block : freeLists[c])
+                unmap(block, classBytes(c));
+    }
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    // Sets how many bytes of released buffers are kept for reuse (0 returns every buffer to the kernel).
+    void setCacheLimit(size_t bytes)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        cacheLimit = bytes;
+    }
+
+    // Function to take a buffer of at least 'bytes' bytes; 'capacity' receives its real size. Its contents are
+    // whatever the previous user left in it. Throws std::bad_alloc if the memory cannot be mapped.
+    unsigned char *acquire(size_t bytes, size_t &capacity)
+    {
+        int sizeClass = classOf(bytes);
+        capacity = classBytes(sizeClass);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::vector<void *> &list = freeLists[sizeClass];
+            if (!list.empty())
+            {
+                void *block = list.back(); // Most recently released: the most likely to still be in the cache.
+                list.pop_back();
+                cached -= capacity;
+                reused.fetch_add(1, std::memory_order_relaxed);
+                return static_cast<unsigned char *>(block);
+            }
+        }
+        mapped.fetch_add(1, std::memory_order_relaxed);
+        return static_cast<unsigned char *>(map(capacity));
+    }
+
+    // Function to give back a buffer obtained from acquire() with the capacity it reported
+    void release(unsigned char *block, size_t capacity)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (cached + capacity <= cacheLimit)
+            {
+                std::vector<void *> &list = freeLists[classOf(capacity)];
+                if (list.size() < MAX_FREE_PER_CLASS)
+                {
+                    list.push_back(block); // Within the reserved slots.
+                    cached += capacity;
+                    return;
+                }
+            }
+        }
+        unmap(block, capacity); // Over the limit: the kernel gets it back.
+    }
+
+    // Buffers that had to be mapped because no free one of their class was available.
+    uint64_t mappedBuffers() const { return mapped.load(std::memory_order_relaxed); }
+
+    // Buffers handed out again from a free list.
+    uint64_t reusedBuffers() const { return reused.load(std::memory_order_relaxed); }
+
+    // Bytes currently held in the free lists.
+    size_t cachedBytes()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return cached;
+    }
+
+    // Function to return the size of a class: 4 KiB times a power of two, plus 0 to 3 quarters of that
+    static size_t classBytes(int sizeClass)
+    {
+        size_t base = MIN_CLASS_BYTES << (sizeClass / STEPS);
+        return base + base / STEPS * (sizeClass % STEPS);
+    }
+
+    // Function to find the smallest size class holding 'bytes' bytes
+    static int classOf(size_t bytes)
+    {
+        if (bytes <= MIN_CLASS_BYTES)
+            return 0;
+        int power = 63 - __builtin_clzll(bytes - 1) - 12;    // 4 KiB << power < bytes <= 4 KiB << (power + 1).
+        size_t base = MIN_CLASS_BYTES << power, quarter = base / STEPS;
+        return power * STEPS + static_cast<int>((bytes - base + quarter - 1) / quarter); // 1..4 quarters above 'base'.
+    }
+
+    // Function to return how much is really mapped for a buffer of 'bytes' bytes
+    static size_t mappedLength(size_t bytes)
+    {
+        if (bytes < HUGE_PAGE_BYTES / 2)
+            return bytes;
+        return (bytes + HUGE_PAGE_BYTES - 1) & ~(HUGE_PAGE_BYTES - 1); // Whole huge pages.
+    }
+
+private:
+    static const int STEPS = 4;                                          // Size classes per power of two.
+    static const int CLASSES = (64 - 12) * STEPS;                        // From 4 KiB up to any 64-bit size.
+    static const size_t MAX_FREE_PER_CLASS = 64;                         // Free-list slots reserved per class.
+
+    std::mutex lock;                       // Protects the free lists, 'cached' and 'cacheLimit'.
+    std::vector<void *> freeLists[CLASSES]; // Released buffers by size class.
+    size_t cached = 0;                     // Bytes in the free lists.
+    size_t cacheLimit;                     // Most bytes kept in the free lists.
+    std::atomic<uint64_t> mapped{0};       // Buffers mapped from the kernel.
+    std::atomic<uint64_t> reused{0};       // Buffers taken from a free list.
+
+    // Function to map a buffer of 'bytes' bytes of anonymous memory; large buffers are aligned to and backed by huge pages
+    static void *map(size_t bytes)
+    {
+        bytes = mappedLength(bytes);
+        if (bytes < HUGE_PAGE_BYTES)
+        {
+            void *block = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (block == MAP_FAILED)
+                throw std::bad_alloc();
+            return block;
+        }
+        size_t span = bytes + HUGE_PAGE_BYTES; // Map extra, then trim both ends to a 2 MiB boundary.
+        void *raw = mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED)
+            throw std::bad_alloc();
+        uintptr_t start = (reinterpret_cast<uintptr_t>(raw) + HUGE_PAGE_BYTES - 1) & ~uintptr_t(HUGE_PAGE_BYTES - 1);
+        size_t head = start - reinterpret_cast<uintptr_t>(raw);
+        if (head > 0)
+            munmap(raw, head);
+        if (span - head > bytes)
+            munmap(reinterpret_cast<void *>(start + bytes), span - head - bytes);
+#ifdef MADV_HUGEPAGE
+        madvise(reinterpret_cast<void *>(start), bytes, MADV_HUGEPAGE); // A hint: without THP the pages stay small.
+#endif
+        return reinterpret_cast<void *>(start);
+    }
+
+    // Function to unmap a buffer of 'bytes' bytes obtained from map()
+    static void unmap(void *block, size_t bytes) { munmap(block, mappedLength(bytes)); }
+};
+
+// Function to return the pool shared by everything in the process
+inline BufferPool &sharedBufferPool()
+{
+    static BufferPool pool;
+    return pool;
+}
+
+// A byte buffer whose storage comes from a BufferPool and goes back to it when the buffer is destroyed.
+// Unlike std::vector it never initializes its bytes: resize() only guarantees that the old contents survive.
+class PooledBuffer
+{
+public:
+    PooledBuffer() = default;
+    explicit PooledBuffer(size_t bytes) { resize(bytes); }
+    ~PooledBuffer() { release(); }
+
+    PooledBuffer(PooledBuffer &&other) noexcept { swap(other); }
+    PooledBuffer &operator=(PooledBuffer &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            swap(other);
+        }
+        return *this;
+    }
+    PooledBuffer(const PooledBuffer &) = delete;
+    PooledBuffer &operator=(const PooledBuffer &) = delete;
+
+    unsigned char *data() { return bytes; }
+    const unsigned char *data() const { return bytes; }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    unsigned char &operator[](size_t i) { return bytes[i]; }
+    const unsigned char &operator[](size_t i) const { return bytes[i]; }
+    unsigned char *begin() { return bytes; }
+    unsigned char *end() { return bytes + length; }
+    const unsigned char *begin() const { return bytes; }
+    const unsigned char *end() const { return bytes + length; }
+
+    // Function to change the size; growing beyond the capacity moves to a larger pooled buffer.
+    // New bytes are left uninitialized.
+    void resize(size_t size)
+    {
+        if (size > capacity)
+        {
+            size_t newCapacity;
+            unsigned char *grown = sharedBufferPool().acquire(size, newCapacity);
+            if (length > 0)
+                memcpy(grown, bytes, length);
+            release();
+            bytes = grown;
+            capacity = newCapacity;
+        }
+        length = size;
+    }
+
+    // Function to empty the buffer but keep its storage for the next resize()
+    void clear() { length = 0; }
+
+    // Function to give the storage back to the pool
+    void release()
+    {
+        if (bytes)
+            sharedBufferPool().release(bytes, capacity);
+        bytes = nullptr;
+        length = capacity = 0;
+    }
+
+    void swap(PooledBuffer &other) noexcept
+    {
+        std::swap(bytes, other.bytes);
+        std::swap(length, other.length);
+        std::swap(capacity, other.capacity);
+    }
+
+private:
+    unsigned char *bytes = nullptr; // Storage from the pool (null while empty).
+    size_t length = 0;              // Bytes in use.
+    size_t capacity = 0;            // Size of the storage.
+};
+
+#endif // BUFFER_POOL_H
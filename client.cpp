@@ -1,237 +1,1085 @@
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <string>
 #include <cstdlib>
 #include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <dirent.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 
+#include "compression.h"
+#include "content_hash.h"
+#include "image_io.h"
+#include "intensity.h"
+#include "protocol.h"
+#include "shared_memory.h"
+
 using namespace std;
 
 // Server configuration
-const char* SERVER_IP = "192.168.100.XX";  // Hard-coded server IP address to connect to our server.
-const int PORT = 55000;                    // Network port for communication.
-
-// Image constants
-const int WIDTH = 800;                     // Fixed width of the input image in pixels.
-const int HEIGHT = 600;                    // Fixed height of the input image in pixels.
-const int CHANNELS = 3;                    // Number of color channels in the image (RGB).
-const int TOTAL_PIXELS = WIDTH * HEIGHT;   // Total number of pixels in the image (800 * 600 = 480,000).
-const int IMAGE_SIZE = TOTAL_PIXELS * CHANNELS; // Total size of the raw RGB image (480,000 * 3 = 1,440,000 bytes).
-const int GRAY_SIZE = TOTAL_PIXELS;        // Total size of the grayscale image (one byte per pixel: 480,000 bytes).
-const int BUCKETS = 8;                     // Number of equal partitions (buckets) to split the grayscale image.
-const int BUCKET_SIZE = GRAY_SIZE / BUCKETS; // Size of each bucket (480,000 / 8 = 60,000 bytes).
-
-// Function to convert the input image (jpg/png/etc.) to raw RGB binary using ImageMagick.
-// This function uses ImageMagick's 'magick' command to convert the image and outputs "temp_input.bin".
-bool convertImageToRaw(const string &inputImagePath) {
-    // Build the command string to convert the image.
-    string command = "magick " + inputImagePath + " -resize 800x600 -depth 8 -colorspace RGB RGB:temp_input.bin";
-    cout << "Converting input image to raw binary format using ImageMagick..." << endl;
-    // Execute the command using the system call.
-    int ret = system(command.c_str());
-    if (ret != 0) { // If the command fails, print an error message.
-        cerr << "Image conversion failed. Ensure ImageMagick is installed on Termux." << endl;
-        return false; // Return false to indicate failure.
-    }
-    return true; // Conversion succeeded.
-}
-
-// Function to load the raw image from a file into a vector.
-// This function expects the file size to match IMAGE_SIZE.
-bool loadRawImage(const string &filename, vector<unsigned char> &image) {
-    // Open the file in binary mode and position the pointer at the end (ios::ate) to get the file size.
-    ifstream file(filename, ios::binary | ios::ate);
-    if (!file.is_open()) { // Check if the file was opened successfully.
-        cerr << "Failed to open the raw image file (" << filename << ")." << endl;
+const char* SERVER_IP = "192.168.100.XX";  // Default server IP address (override with --server).
+const int PORT = DEFAULT_PORT;             // Network port for communication.
+
+// Coordinator mode constants (--servers)
+const int SHARDS_PER_BACKEND = 4;          // Default number of shards per backend, so fast backends can take over work from slow ones.
+const int DEFAULT_SHARD_TIMEOUT_MS = 5000; // A backend that sends or receives nothing for this long is treated as stalled.
+const int DEFAULT_SHARD_ATTEMPTS = 3;      // Attempts per shard (on any backend) before the whole image fails.
+const int MAX_BACKEND_FAILURES = 3;        // Consecutive failures after which a backend gets no more shards.
+
+// Session settings (frame sequences sent over one connection)
+const int DEFAULT_PIPELINE = 8;            // Frames sent ahead of the responses that have arrived.
+
+// Pixel encoding of every request (the image size is read from the input and announced in the request header), set
+// once from the command line: decoded images are sent as 8-bit RGB, raw input
+// may be sent as it is in any format the server converts (--raw-format), and the gray weighting is chosen by --luma.
+uint16_t pixelFormat = PIXEL_FORMAT_RGB8;  // PixelFormat of the payloads.
+uint32_t lumaFlags = 0;                    // REQUEST_FLAG_LUMA_BT601 or REQUEST_FLAG_LUMA_BT709 (0 is the plain average).
+
+// Function to load the input image as RGB, entirely in memory. PPM/PGM (and raw pixels with 'rawWidth' x 'rawHeight',
+// in the format set by --raw-format) are decoded in-process; other formats go through ImageMagick via a pipe unless
+// 'allowMagick' is false.
+// The image keeps its own size unless 'resize' (e.g. "800x600", or "800x600!" for an exact size) is given.
+bool loadInputImage(const string &path, const string &resize, uint32_t rawWidth, uint32_t rawHeight, bool allowMagick,
+                    vector<unsigned char> &image, uint32_t &width, uint32_t &height) {
+    Image decoded;
+    bool read = pixelFormat == PIXEL_FORMAT_RGB8
+        ? readImageFile(path, rawWidth, rawHeight, allowMagick, decoded)
+        : readRawFile(path, rawWidth, rawHeight, bytesPerPixel(pixelFormat), decoded); // Sent as it is; the server converts.
+    if (!read) {
+        cerr << "Failed to read the image '" << path << "'";
+        if (allowMagick)
+            cerr << " (formats other than PPM/PGM need ImageMagick; install it on Termux)";
+        cerr << "." << endl;
         return false;
     }
-    // Get the size of the file.
-    streamsize fileSize = file.tellg();
-    file.seekg(0, ios::beg); // Move the pointer back to the beginning for reading.
-    if (fileSize != IMAGE_SIZE) { // Validate the file size against expected IMAGE_SIZE.
-        cerr << "Raw image file size mismatch. Expected " << IMAGE_SIZE
-             << " bytes, but got " << fileSize << " bytes." << endl;
-        return false;
+    convertToRgb(decoded); // The server expects RGB.
+    if (!resize.empty()) {
+        uint32_t newWidth, newHeight;
+        if (!fitGeometry(resize, decoded.width, decoded.height, newWidth, newHeight)) {
+            cerr << "Invalid --resize geometry: " << resize << endl;
+            return false;
+        }
+        if (newWidth != decoded.width || newHeight != decoded.height)
+            decoded = resizeImage(decoded, newWidth, newHeight); // Done in-process, no second decode.
     }
-    image.resize(IMAGE_SIZE); // Resize the vector to hold the image data.
-    // Read the file content into the vector.
-    if (!file.read(reinterpret_cast<char*>(image.data()), IMAGE_SIZE)) {
-        cerr << "Failed to read raw image data from " << filename << endl;
+    if (decoded.width > MAX_IMAGE_DIMENSION || decoded.height > MAX_IMAGE_DIMENSION ||
+        uint64_t(decoded.width) * decoded.height > MAX_IMAGE_PIXELS) {
+        cerr << "Image size " << decoded.width << "x" << decoded.height << " is outside the protocol limits (try --resize)." << endl;
         return false;
     }
-    file.close(); // Close the file after reading.
-    cout << "Loaded raw image from '" << filename << "' (" << IMAGE_SIZE << " bytes)." << endl;
-    return true; // Successfully loaded the raw image.
+    width = decoded.width;
+    height = decoded.height;
+    image = move(decoded.pixels); // Straight from the decoder to the send buffer.
+    cout << "Loaded image '" << path << "' (" << width << "x" << height << ", " << image.size() << " bytes of "
+         << pixelFormatName(pixelFormat) << ")." << endl;
+    return true;
 }
 
 // Function to create a socket and connect to the server.
-int connectToServer(const char* serverIP, int port) {
+// With 'timeoutMs' > 0, connecting and every later send/recv on the socket give up after that long without progress.
+int connectToServer(const char* serverIP, int port, int timeoutMs = 0) {
     // Create a TCP socket using IPv4.
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) { // Check if socket creation failed.
         cerr << "Socket creation error." << endl;
         return -1;
     }
+    if (timeoutMs > 0) {
+        timeval timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000};
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)); // Also bounds connect() on Linux.
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
     sockaddr_in serv_addr;             // Structure to hold the server's address.
     serv_addr.sin_family = AF_INET;    // Set the address family to IPv4.
     serv_addr.sin_port = htons(port);  // Convert port number to network byte order.
     // Convert the server IP from text to binary form.
     if (inet_pton(AF_INET, serverIP, &serv_addr.sin_addr) <= 0) {
-        cerr << "Invalid server address." << endl;
+        cerr << "Invalid server address: " << serverIP << endl;
+        close(sock);
         return -1;
     }
     // Attempt to connect to the server using the specified IP and port.
     if (connect(sock, (sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        cerr << "Connection to server failed." << endl;
+        cerr << "Connection to server " << serverIP << ":" << port << " failed." << endl;
+        close(sock);
         return -1;
     }
-    cout << "Connected to server " << serverIP << " on port " << port << endl;
     return sock; // Return the connected socket descriptor.
 }
 
-// Function to send the raw image data over the socket.
-bool sendImageData(int sock, const vector<unsigned char>& image) {
-    int total_sent = 0; // Counter for the total number of bytes sent.
-    // Loop until the entire image data is sent.
-    while (total_sent < IMAGE_SIZE) {
-        int bytes = send(sock, image.data() + total_sent, IMAGE_SIZE - total_sent, 0);
-        if (bytes < 0) { // If send fails, print an error and return false.
-            cerr << "Failed to send image data." << endl;
+// Function to connect to the server's Unix domain socket at 'path' (--local).
+int connectToLocalServer(const string &path) {
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        cerr << "Local socket path too long: " << path << endl;
+        return -1;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (sockaddr *)&address, sizeof(address)) < 0) {
+        cerr << "Connection to local server " << path << " failed." << endl;
+        if (sock >= 0)
+            close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Function to split "host[:port]" into its parts; the port defaults to PORT.
+bool parseServerAddress(const string &address, string &host, int &port) {
+    size_t colon = address.rfind(':');
+    host = address.substr(0, colon);
+    port = PORT;
+    if (colon != string::npos) {
+        port = atoi(address.c_str() + colon + 1);
+        if (port <= 0 || port > 65535)
+            return false;
+    }
+    return !host.empty();
+}
+
+// Function to send 'length' bytes, looping over short writes.
+bool sendAll(int sock, const unsigned char* data, size_t length) {
+    size_t total_sent = 0; // Counter for the total number of bytes sent.
+    while (total_sent < length) {
+        ssize_t bytes = send(sock, data + total_sent, length - total_sent, 0);
+        if (bytes < 0) // If send fails, report it to the caller.
             return false;
-        }
         total_sent += bytes; // Update total bytes sent.
     }
-    cout << "Sent raw image (" << total_sent << " bytes) to server." << endl;
+    return true;
+}
+
+// Function to receive exactly 'length' bytes, looping over short reads.
+bool recvAll(int sock, unsigned char* data, size_t length) {
+    size_t total_received = 0; // Counter for the total number of bytes received.
+    while (total_received < length) {
+        ssize_t bytes = recv(sock, data + total_received, length - total_received, 0);
+        if (bytes <= 0) // The server closed the connection or an error occurred.
+            return false;
+        total_received += bytes; // Update total bytes received.
+    }
+    return true;
+}
+
+// Function to build the request header for the buckets [firstBucket, firstBucket + bucketCount) of an image.
+RequestHeader makeRequest(uint32_t width, uint32_t height, uint32_t buckets, uint32_t firstBucket, uint32_t bucketCount, uint32_t flags) {
+    RequestHeader request;                  // Header describing the image to the server.
+    request.pixelFormat = pixelFormat;
+    request.width = width;
+    request.height = height;
+    request.buckets = buckets;
+    request.firstBucket = firstBucket;
+    request.bucketCount = bucketCount;
+    request.flags = flags | lumaFlags;
+    request.payloadLength = requestPayloadLength(request); // Pixels of the shard (all of them for a whole image).
+    return request;
+}
+
+// Function to send a request header followed by its pixel data ('payload' points at the first pixel of the shard).
+bool sendRequest(int sock, const RequestHeader &request, const unsigned char* payload) {
+    unsigned char header[HEADER_SIZE];
+    encodeRequestHeader(request, header);   // Serialize it in network byte order.
+    return sendAll(sock, header, HEADER_SIZE) && sendAll(sock, payload, request.payloadLength);
+}
+
+// Function to compress the pixels of a request, turning it into a compressed upload that also accepts a compressed
+// response; 'packed' receives the payload to send.
+void compressRequest(RequestHeader &request, const unsigned char* pixels, vector<unsigned char> &packed) {
+    uint64_t raw = requestPayloadLength(request);
+    int stride = bytesPerPixel(request.pixelFormat); // Deltas are taken against the same channel of the previous pixel.
+    packed.resize(compressedBound(raw, stride));
+    packed.resize(compressPayload(pixels, raw, stride, packed.data()));
+    request.flags |= REQUEST_FLAG_COMPRESSED | REQUEST_FLAG_ACCEPT_COMPRESSED;
+    request.payloadLength = packed.size();
+}
+
+// Function to ask the server for the cached result of 'request' by sending only the content hash of its payload
+// ('payload' holds the 'length' bytes the request would upload, compressed or not).
+bool sendHashProbe(int sock, RequestHeader request, const unsigned char* payload, size_t length) {
+    unsigned char hash[CONTENT_HASH_SIZE];
+    putBigEndian(hash, contentHash(payload, length), CONTENT_HASH_SIZE);
+    request.flags |= REQUEST_FLAG_HASH_ONLY;
+    request.payloadLength = CONTENT_HASH_SIZE; // The hash stands in for the pixels.
+    return sendRequest(sock, request, hash);
+}
+
+// Function to send the request header followed by the image data over the socket.
+// The request may carry REQUEST_FLAG_STREAMING to have the server return buckets while the image is still arriving.
+bool sendImageData(int sock, const RequestHeader &request, const unsigned char* payload) {
+    if (!sendRequest(sock, request, payload)) {
+        cerr << "Failed to send image data." << endl;
+        return false;
+    }
+    if (request.flags & REQUEST_FLAG_COMPRESSED)
+        cout << "Sent compressed image (" << HEADER_SIZE + request.payloadLength << " bytes, "
+             << requestPayloadLength(request) << " uncompressed) to server." << endl;
+    else
+        cout << "Sent raw image (" << HEADER_SIZE + request.payloadLength << " bytes) to server." << endl;
     return true; // Successfully sent all image data.
 }
 
-// Function to receive 8 buckets of processed (grayscale) data from the server.
-bool receiveBuckets(int sock, vector<vector<unsigned char>> &buckets) {
-    // Resize the buckets vector to hold 8 buckets, each of BUCKET_SIZE bytes.
-    buckets.resize(BUCKETS, vector<unsigned char>(BUCKET_SIZE));
-    // Loop over each bucket to receive its data.
-    for (int i = 0; i < BUCKETS; i++) {
-        int total_received = 0; // Counter for bytes received per bucket.
-        // Continue receiving until the entire bucket is filled.
-        while (total_received < BUCKET_SIZE) {
-            int bytes = recv(sock, buckets[i].data() + total_received, BUCKET_SIZE - total_received, 0);
-            if (bytes <= 0) { // If recv fails, print an error message for the specific bucket.
-                cerr << "Failed to receive data for bucket " << i + 1 << endl;
-                return false;
-            }
-            total_received += bytes; // Update total received bytes for current bucket.
+// Function to receive and check the response header for 'request'; the gray bytes of the shard follow it.
+// If 'notCached' is given, a STATUS_NOT_CACHED answer to a hash probe sets it instead of being reported as an error.
+// If the gray bytes come compressed, 'packedLength' receives their compressed size (and is 0 otherwise).
+bool receiveResponseHeader(int sock, const RequestHeader &request, bool* notCached = nullptr, uint64_t* packedLength = nullptr) {
+    unsigned char header[HEADER_SIZE];
+    if (!recvAll(sock, header, HEADER_SIZE)) {
+        cerr << "Failed to receive the response header." << endl;
+        return false;
+    }
+    ResponseHeader response = decodeResponseHeader(header);
+    if (response.magic != PROTOCOL_MAGIC || response.version != PROTOCOL_VERSION) {
+        cerr << "Unexpected response from server (not protocol version " << PROTOCOL_VERSION << ")." << endl;
+        return false;
+    }
+    if (response.status == STATUS_NOT_CACHED && notCached) {
+        *notCached = true; // Not an error: the pixels have to be uploaded.
+        return false;
+    }
+    if (response.status != STATUS_OK) {
+        cerr << "Server rejected the image: " << statusMessage(response.status) << endl;
+        return false;
+    }
+    bool shared = (response.flags & RESPONSE_FLAG_SHARED_MEMORY) != 0; // Nothing follows; the gray bytes are in our file.
+    bool packed = (response.flags & RESPONSE_FLAG_COMPRESSED) != 0; // Only if the request offered to take it.
+    bool lengthValid = packed ? packedLength && (request.flags & REQUEST_FLAG_ACCEPT_COMPRESSED) &&
+                                    response.payloadLength <= compressedBound(responsePayloadLength(request), 1)
+                              : response.payloadLength == responsePayloadLength(request);
+    if (response.width != request.width || response.height != request.height || response.buckets != request.buckets ||
+        response.firstBucket != request.firstBucket || response.bucketCount != request.bucketCount ||
+        !lengthValid || response.requestId != request.requestId || shared != ((request.flags & REQUEST_FLAG_SHARED_MEMORY) != 0)) {
+        cerr << "Response does not match the image that was sent." << endl;
+        return false;
+    }
+    if (packedLength)
+        *packedLength = packed ? response.payloadLength : 0;
+    return true;
+}
+
+// Function to receive a compressed payload of 'packedLength' bytes and decode it into 'rawBytes' bytes at 'raw'
+// ('stride' bytes per pixel). Each chunk is decoded as soon as it has arrived, while later ones are still on the way.
+bool receiveCompressed(int sock, uint64_t packedLength, unsigned char* raw, size_t rawBytes, int stride) {
+    vector<unsigned char> chunk; // Coded bytes of the current chunk.
+    uint64_t received = 0;
+    for (size_t c = 0, chunks = compressionChunkCount(rawBytes, stride); c < chunks; c++) {
+        size_t length = compressionChunkBytes(rawBytes, stride, c);
+        unsigned char prefix[4];
+        if (packedLength - received < 4 || !recvAll(sock, prefix, 4))
+            return false;
+        size_t coded = compressedChunkLength(prefix);
+        if (coded + 4 > compressedChunkBound(length) || packedLength - received - 4 < coded)
+            return false;
+        chunk.resize(coded);
+        if (!recvAll(sock, chunk.data(), coded) ||
+            !decompressChunk(chunk.data(), coded, stride, raw + c * COMPRESSION_CHUNK_PIXELS * stride, length))
+            return false;
+        received += 4 + coded;
+    }
+    return received == packedLength;
+}
+
+// Function to receive the buckets of processed (grayscale) data that follow a response header.
+// Each bucket is received straight into its final place in one contiguous grayscale image.
+// A non-zero 'packedLength' means the buckets arrive as one compressed stream of that many bytes.
+bool receiveBucketData(int sock, vector<unsigned char> &grayscaleImage, vector<BucketView> &buckets, uint32_t width, uint32_t height,
+                       uint32_t bucketCount, uint64_t packedLength = 0) {
+    uint64_t pixels = uint64_t(width) * height; // One grayscale byte per pixel.
+    grayscaleImage.resize(pixels); // The whole image; buckets are views into it.
+    buckets = partitionIntoBuckets(pixels, bucketCount); // Computed the same way as on the server.
+    if (packedLength > 0) {
+        if (!receiveCompressed(sock, packedLength, grayscaleImage.data(), pixels, 1)) {
+            cerr << "Failed to receive or decode the compressed buckets." << endl;
+            return false;
         }
-        cout << "Received bucket " << i + 1 << " (" << total_received << " bytes)." << endl;
+        cout << "Received " << buckets.size() << " buckets (" << packedLength << " compressed bytes for " << pixels << ")." << endl;
+        return true;
+    }
+    // Loop over each bucket to receive its data directly into its slot.
+    for (size_t i = 0; i < buckets.size(); i++) {
+        if (!recvAll(sock, grayscaleImage.data() + buckets[i].offset, buckets[i].length)) { // If recv fails, print an error message for the specific bucket.
+            cerr << "Failed to receive data for bucket " << i + 1 << endl;
+            return false;
+        }
+        cout << "Received bucket " << i + 1 << " (" << buckets[i].length << " bytes)." << endl;
     }
     return true; // All buckets received successfully.
 }
 
+// Function to receive the response header and the buckets of processed (grayscale) data from the server.
+bool receiveBuckets(int sock, const RequestHeader &request, vector<unsigned char> &grayscaleImage, vector<BucketView> &buckets) {
+    uint64_t packedLength = 0;
+    return receiveResponseHeader(sock, request, nullptr, &packedLength) &&
+           receiveBucketData(sock, grayscaleImage, buckets, request.width, request.height, request.bucketCount, packedLength);
+}
+
+// Function to process the whole image on a single server over one connection.
+// With 'hashFirst' only the content hash is sent at first, and the pixels follow only if the server has no cached result.
+// With 'compress' the pixels are sent compressed and the server may compress the gray bytes too.
+bool processOnServer(const string &host, int port, const vector<unsigned char> &image, uint32_t width, uint32_t height,
+                     uint32_t bucketCount, bool stream, bool hashFirst, bool compress, vector<unsigned char> &grayscaleImage,
+                     vector<BucketView> &buckets) {
+    RequestHeader upload = makeRequest(width, height, bucketCount, 0, bucketCount, stream ? uint32_t(REQUEST_FLAG_STREAMING) : 0u);
+    vector<unsigned char> packed; // Compressed pixels, if they are sent compressed.
+    if (compress)
+        compressRequest(upload, image.data(), packed);
+    const unsigned char* payload = compress ? packed.data() : image.data();
+
+    // Step 3: Connect to the server (SERVER_IP and PORT unless --server is given).
+    int sock = connectToServer(host.c_str(), port);
+    if (sock < 0)
+        return false;
+    cout << "Connected to server " << host << " on port " << port << endl;
+    if (hashFirst) {
+        RequestHeader request = upload; // The same request, offered by the hash of its payload.
+        request.flags |= REQUEST_FLAG_KEEP_ALIVE;
+        bool notCached = false;
+        uint64_t packedLength = 0;
+        if (!sendHashProbe(sock, request, payload, upload.payloadLength)) {
+            cerr << "Failed to send the content hash." << endl;
+            close(sock);
+            return false;
+        }
+        if (receiveResponseHeader(sock, request, &notCached, &packedLength)) {
+            cout << "Server had the result cached; the image was not uploaded." << endl;
+            bool received = receiveBucketData(sock, grayscaleImage, buckets, width, height, bucketCount, packedLength);
+            close(sock);
+            return received;
+        }
+        if (!notCached) {
+            close(sock);
+            return false;
+        }
+        cout << "Result not cached on the server; uploading the image." << endl; // Same session, so no new connection.
+    }
+    
+    // Step 4: Send the request header and the raw image data over the established socket connection.
+    // In streaming mode this happens on a second thread, so the buckets can be received while the image is still being sent.
+    bool sent = true;
+    thread sender;
+    if (stream)
+        sender = thread([&]() { sent = sendImageData(sock, upload, payload); });
+    else
+        sent = sendImageData(sock, upload, payload);
+    
+    // Step 5: Receive the buckets of processed grayscale data straight into the grayscale image.
+    bool received = sent && receiveBuckets(sock, upload, grayscaleImage, buckets);
+    if (stream) {
+        if (!received)
+            shutdown(sock, SHUT_RDWR); // Unblock the sender if the server gave up early.
+        sender.join();
+    }
+    close(sock); // Close the socket once data has been received (or the transfer failed).
+    return sent && received;
+}
+
+// Function to process the whole image on a server on this host, through its Unix domain socket (--local).
+// The pixels are written once into a memory file, which the server reads in place; it writes the gray bytes into a
+// second memory file, which 'gray' maps once the server has answered. Only the two headers go through the socket.
+bool processLocally(const string &path, const vector<unsigned char> &image, uint32_t width, uint32_t height,
+                    uint32_t bucketCount, SharedRegion &gray, vector<BucketView> &buckets) {
+    RequestHeader request = makeRequest(width, height, bucketCount, 0, bucketCount, REQUEST_FLAG_SHARED_MEMORY);
+    size_t grayBytes = responsePayloadLength(request);
+    int files[2] = {createSharedMemory("gray-input", image.size()), createSharedMemory("gray-output", grayBytes)};
+    SharedRegion pixels;
+    bool ok = files[0] >= 0 && files[1] >= 0 && pixels.map(files[0], image.size(), true);
+    if (!ok)
+        perror("Shared memory setup failed");
+    else
+        memcpy(pixels.data(), image.data(), image.size()); // The server reads them from here.
+    int sock = ok ? connectToLocalServer(path) : -1;
+    ok = sock >= 0;
+    if (ok) {
+        cout << "Connected to local server " << path << " (shared memory)" << endl;
+        unsigned char header[HEADER_SIZE];
+        encodeRequestHeader(request, header);
+        ssize_t sent = sendWithDescriptors(sock, header, HEADER_SIZE, files, 2); // The files travel with the first byte.
+        ok = sent > 0 && sendAll(sock, header + sent, HEADER_SIZE - sent);
+        if (!ok)
+            cerr << "Failed to send the request." << endl;
+    }
+    ok = ok && receiveResponseHeader(sock, request) && gray.map(files[1], grayBytes, false);
+    if (ok) {
+        buckets = partitionIntoBuckets(grayBytes, bucketCount); // Computed the same way as on the server.
+        cout << "Server wrote " << buckets.size() << " buckets (" << grayBytes << " bytes) into shared memory." << endl;
+    }
+    if (sock >= 0)
+        close(sock);
+    for (int fd : files) {
+        if (fd >= 0)
+            close(fd); // The mapping of the gray bytes stays valid.
+    }
+    return ok;
+}
+
+// Function to bucket the image by intensity on a single server: 'payload' holds the pixels followed by the
+// bucketCount - 1 thresholds, and 'result' receives the histogram, bucket table and index list (see protocol.h).
+bool processIntensityOnServer(const string &host, int port, const vector<unsigned char> &payload, uint32_t width, uint32_t height,
+                              uint32_t bucketCount, vector<unsigned char> &result) {
+    int sock = connectToServer(host.c_str(), port);
+    if (sock < 0)
+        return false;
+    cout << "Connected to server " << host << " on port " << port << endl;
+    RequestHeader request = makeRequest(width, height, bucketCount, 0, bucketCount, REQUEST_FLAG_INTENSITY_BUCKETS);
+    bool ok = sendRequest(sock, request, payload.data());
+    if (!ok)
+        cerr << "Failed to send image data." << endl;
+    else
+        cout << "Sent raw image and " << bucketCount - 1 << " thresholds (" << HEADER_SIZE + payload.size() << " bytes) to server." << endl;
+    ok = ok && receiveResponseHeader(sock, request);
+    if (ok) {
+        result.resize(responsePayloadLength(request));
+        ok = recvAll(sock, result.data(), result.size());
+        if (!ok)
+            cerr << "Failed to receive the intensity buckets." << endl;
+    }
+    close(sock);
+    return ok;
+}
+
+// Function to print the histogram summary and, for each intensity bucket, its range, pixel count and first pixel indices.
+void printIntensitySummary(const vector<unsigned char> &result, const vector<unsigned char> &thresholds, uint32_t bucketCount) {
+    int peak = 0;                       // Most frequent gray level.
+    for (int level = 1; level < INTENSITY_LEVELS; level++)
+        if (getBigEndian(result.data() + 4 * level, 4) > getBigEndian(result.data() + 4 * peak, 4))
+            peak = level;
+    cout << "Histogram: most frequent gray level " << peak << " (" << getBigEndian(result.data() + 4 * peak, 4) << " pixels)." << endl;
+    const unsigned char* table = result.data() + 4 * INTENSITY_LEVELS;
+    const unsigned char* indices = result.data() + intensityIndexOffset(bucketCount);
+    for (uint32_t b = 0; b < bucketCount; b++) {
+        uint64_t count = getBigEndian(table + 8 * b, 4), offset = getBigEndian(table + 8 * b + 4, 4);
+        int low = b ? thresholds[b - 1] : 0, high = b + 1 < bucketCount ? thresholds[b] - 1 : INTENSITY_LEVELS - 1;
+        cout << "Bucket " << b + 1 << " [" << low << ", " << high << "]: " << count << " pixels, first indices ";
+        for (uint64_t j = 0; j < 10 && j < count; j++)
+            cout << getBigEndian(indices + 4 * (offset + j), 4) << " ";
+        cout << "..." << endl;
+    }
+}
+
+// Function to draw an intensity result as an image: every pixel takes the lowest gray level of its bucket.
+vector<unsigned char> intensityLabelImage(const vector<unsigned char> &result, const vector<unsigned char> &thresholds,
+                                          uint32_t bucketCount, size_t pixels) {
+    vector<unsigned char> labels(pixels);
+    const unsigned char* table = result.data() + 4 * INTENSITY_LEVELS;
+    const unsigned char* indices = result.data() + intensityIndexOffset(bucketCount);
+    for (uint32_t b = 0; b < bucketCount; b++) {
+        uint64_t count = getBigEndian(table + 8 * b, 4), offset = getBigEndian(table + 8 * b + 4, 4);
+        for (uint64_t j = 0; j < count; j++)
+            labels[getBigEndian(indices + 4 * (offset + j), 4)] = b ? thresholds[b - 1] : 0;
+    }
+    return labels;
+}
+
+// A backend server used in coordinator mode.
+struct Backend {
+    string host;                  // IPv4 address.
+    int port = PORT;              // TCP port.
+    size_t shardsDone = 0;        // Shards it returned successfully.
+    size_t failures = 0;          // Attempts that failed or stalled on it.
+};
+
+// A range of consecutive buckets sent to one backend as a single request.
+struct Shard {
+    uint32_t firstBucket = 0;     // First bucket of the range.
+    uint32_t bucketCount = 0;     // Number of buckets in the range.
+    int attempts = 0;             // Failed attempts so far.
+};
+
+// Work shared by the backend threads of the coordinator.
+struct ShardQueue {
+    mutex lock;                   // Protects everything below (and the Backend counters).
+    condition_variable changed;   // Signalled when a shard is queued or the work ends.
+    deque<size_t> pending;        // Shards waiting for a backend, by index.
+    size_t remaining = 0;         // Shards not yet received.
+    size_t liveBackends = 0;      // Backends still taking shards.
+    bool failed = false;          // Set when a shard has run out of attempts or no backend is left.
+    vector<double> latenciesMs;   // Time per successful shard, for the summary.
+};
+
+// Settings and buffers of one coordinated image.
+struct CoordinatorJob {
+    const vector<unsigned char>* image;  // RGB input.
+    vector<unsigned char>* gray;         // Grayscale output; every shard lands at its own offset.
+    uint32_t width, height, buckets;     // Image geometry and total bucket count.
+    int timeoutMs;                       // Stall timeout per socket operation.
+    int maxAttempts;                     // Attempts per shard.
+};
+
+// Function to send one shard to a backend and receive its gray bytes straight into place.
+bool processShard(const Backend &backend, const CoordinatorJob &job, const Shard &shard) {
+    int sock = connectToServer(backend.host.c_str(), backend.port, job.timeoutMs);
+    if (sock < 0)
+        return false;
+    RequestHeader request = makeRequest(job.width, job.height, job.buckets, shard.firstBucket, shard.bucketCount, 0);
+    uint64_t offset, pixels; // Where the shard lives in the image.
+    shardRange(uint64_t(job.width) * job.height, job.buckets, shard.firstBucket, shard.bucketCount, offset, pixels);
+    bool ok = sendRequest(sock, request, job.image->data() + offset * bytesPerPixel(pixelFormat)) &&
+              receiveResponseHeader(sock, request) && recvAll(sock, job.gray->data() + offset, pixels);
+    close(sock);
+    return ok;
+}
+
+// Function run by one thread per backend: take shards from the queue until none are left.
+// A failed or stalled shard goes back to the front of the queue, so another backend picks it up while this one backs off.
+void runBackend(Backend &backend, ShardQueue &queue, vector<Shard> &shards, const CoordinatorJob &job) {
+    int consecutiveFailures = 0;
+    while (true) {
+        size_t index;
+        {
+            unique_lock<mutex> guard(queue.lock);
+            queue.changed.wait(guard, [&]() { return !queue.pending.empty() || queue.remaining == 0 || queue.failed; });
+            if (queue.remaining == 0 || queue.failed)
+                return; // All shards are in, or the image cannot be completed.
+            index = queue.pending.front();
+            queue.pending.pop_front();
+        }
+        auto start = chrono::steady_clock::now();
+        bool ok = processShard(backend, job, shards[index]);
+        double elapsedMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        {
+            lock_guard<mutex> guard(queue.lock);
+            Shard &shard = shards[index];
+            if (ok) {
+                backend.shardsDone++;
+                queue.remaining--;
+                queue.latenciesMs.push_back(elapsedMs);
+                consecutiveFailures = 0;
+                cout << "Shard " << index + 1 << "/" << shards.size() << " (buckets " << shard.firstBucket + 1 << "-"
+                     << shard.firstBucket + shard.bucketCount << ") from " << backend.host << ":" << backend.port
+                     << " in " << elapsedMs << " ms." << endl;
+            } else {
+                backend.failures++;
+                consecutiveFailures++;
+                cerr << "Shard " << index + 1 << " failed on " << backend.host << ":" << backend.port << " after "
+                     << elapsedMs << " ms; reassigning." << endl;
+                if (++shard.attempts >= job.maxAttempts)
+                    queue.failed = true; // This shard keeps failing everywhere.
+                else
+                    queue.pending.push_front(index); // Next in line for any backend.
+                if (consecutiveFailures >= MAX_BACKEND_FAILURES) {
+                    cerr << "Backend " << backend.host << ":" << backend.port << " removed after " << consecutiveFailures << " failures." << endl;
+                    if (--queue.liveBackends == 0)
+                        queue.failed = true; // Nobody is left to take the queued shards.
+                }
+            }
+        }
+        queue.changed.notify_all(); // Wake idle backends (and let them exit when everything is done).
+        if (consecutiveFailures >= MAX_BACKEND_FAILURES)
+            return;
+        if (consecutiveFailures > 0) // Give the healthy backends a chance to take the shard first.
+            this_thread::sleep_for(chrono::milliseconds(100 * consecutiveFailures));
+    }
+}
+
+// Function to process an image on several backends: split its buckets into shards, send them over parallel
+// connections (one per backend) and receive every shard straight into its place in the grayscale image.
+bool runCoordinator(const vector<unsigned char> &image, uint32_t width, uint32_t height, uint32_t bucketCount,
+                    vector<Backend> &backends, uint32_t shardBuckets, int timeoutMs, int maxAttempts,
+                    vector<unsigned char> &grayscaleImage) {
+    if (shardBuckets == 0) // Default: a few shards per backend, so slow or failing nodes hold back little work.
+        shardBuckets = max<uint32_t>(1, bucketCount / (backends.size() * SHARDS_PER_BACKEND));
+    vector<Shard> shards;
+    for (uint32_t first = 0; first < bucketCount; first += shardBuckets) {
+        Shard shard;
+        shard.firstBucket = first;
+        shard.bucketCount = min(shardBuckets, bucketCount - first);
+        shards.push_back(shard);
+    }
+    grayscaleImage.resize(size_t(width) * height);
+    CoordinatorJob job = {&image, &grayscaleImage, width, height, bucketCount, timeoutMs, maxAttempts};
+    ShardQueue queue;
+    for (size_t i = 0; i < shards.size(); i++)
+        queue.pending.push_back(i);
+    queue.remaining = shards.size();
+    queue.liveBackends = backends.size();
+    cout << "Coordinating " << shards.size() << " shards of up to " << shardBuckets << " buckets over "
+         << backends.size() << " backends." << endl;
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (Backend &backend : backends)
+        threads.emplace_back(runBackend, ref(backend), ref(queue), ref(shards), cref(job));
+    for (thread &t : threads)
+        t.join();
+    double totalMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    // Report how the work was spread and the shard latency distribution.
+    for (const Backend &backend : backends)
+        cout << "Backend " << backend.host << ":" << backend.port << ": " << backend.shardsDone << " shards, "
+             << backend.failures << " failures." << endl;
+    vector<double> &latencies = queue.latenciesMs;
+    sort(latencies.begin(), latencies.end());
+    if (!latencies.empty())
+        cout << "Shard latency: p50 " << latencies[latencies.size() / 2] << " ms, p99 "
+             << latencies[min(latencies.size() - 1, latencies.size() * 99 / 100)] << " ms, max " << latencies.back() << " ms." << endl;
+    cout << "Coordinated image " << (queue.remaining == 0 ? "completed" : "FAILED") << " in " << totalMs << " ms." << endl;
+    return queue.remaining == 0;
+}
+
 // Function to print a summary (first 10 values) of each bucket.
-void printBucketsSummary(const vector<vector<unsigned char>> &buckets) {
+void printBucketsSummary(const unsigned char* grayscaleImage, const vector<BucketView> &buckets) {
     cout << "Received grayscale buckets data:" << endl;
     // Loop through each bucket and print the first 10 grayscale values.
-    for (int i = 0; i < BUCKETS; i++) {
+    for (size_t i = 0; i < buckets.size(); i++) {
         cout << "Bucket " << i + 1 << ": ";
-        for (int j = 0; j < 10 && j < BUCKET_SIZE; j++) {
-            cout << static_cast<int>(buckets[i][j]) << " "; // Cast to int for readable output.
+        for (size_t j = 0; j < 10 && j < buckets[i].length; j++) {
+            cout << static_cast<int>(grayscaleImage[buckets[i].offset + j]) << " "; // Cast to int for readable output.
         }
         cout << "..." << endl; // Indicate more data exists in the bucket.
     }
 }
 
-// Function to merge the 8 buckets into one contiguous grayscale image.
-void mergeBuckets(const vector<vector<unsigned char>> &buckets, vector<unsigned char> &grayscaleImage) {
-    grayscaleImage.clear(); // Clear any existing data in the grayscale image vector.
-    // Concatenate each bucket's data into the grayscale image vector.
-    for (int i = 0; i < BUCKETS; i++) {
-        grayscaleImage.insert(grayscaleImage.end(), buckets[i].begin(), buckets[i].end());
+// Function to save the grayscale image. PGM and raw files (".pgm", ".bin", ".gray", ".raw") are written directly;
+// other formats (e.g. ".jpg") are encoded by ImageMagick from a pipe unless 'allowMagick' is false.
+bool saveGrayscaleImage(const unsigned char* grayscaleImage, uint32_t width, uint32_t height, const string &filename,
+                        bool allowMagick) {
+    if (!writeImageFile(filename, grayscaleImage, width, height, 1, allowMagick)) {
+        cerr << "Failed to write the grayscale image to '" << filename << "'." << endl;
+        return false;
+    }
+    cout << "Saved grayscale image to '" << filename << "'." << endl;
+    return true; // Successfully saved the file.
+}
+
+// Function to list the frames of a sequence: every file of a directory, sorted by name, or the files matching a
+// printf-style pattern such as "frames/%05d.ppm", numbered from 0 or 1 until the first missing one.
+bool listFrames(const string &source, vector<string> &frames) {
+    struct stat info;
+    if (stat(source.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+        DIR* dir = opendir(source.c_str());
+        if (!dir)
+            return false;
+        while (dirent* entry = readdir(dir)) {
+            string path = source + "/" + entry->d_name;
+            if (entry->d_name[0] != '.' && stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+                frames.push_back(path);
+        }
+        closedir(dir);
+        sort(frames.begin(), frames.end());
+    } else if (source.find('%') != string::npos) {
+        char path[4096];
+        snprintf(path, sizeof(path), source.c_str(), 0);
+        for (int i = stat(path, &info) == 0 ? 0 : 1;; i++) {
+            snprintf(path, sizeof(path), source.c_str(), i);
+            if (stat(path, &info) != 0)
+                break;
+            frames.push_back(path);
+        }
     }
-    cout << "Merged grayscale image data (" << grayscaleImage.size() << " bytes)." << endl;
+    return !frames.empty();
 }
 
-// Function to save the merged grayscale image as a raw binary file.
-bool saveGrayscaleRawImage(const vector<unsigned char> &grayscaleImage, const string &filename) {
-    // Open an output file stream in binary mode.
-    ofstream outFile(filename, ios::binary);
-    if (!outFile.is_open()) { // Check if the file opened successfully.
-        cerr << "Failed to open file for writing grayscale data." << endl;
-        return false;
+// A session: frames sent one after another over a single connection, with up to 'limit' of them waiting for
+// their responses. The sender and the receiver run on their own threads and meet here.
+struct Session {
+    mutex lock;
+    condition_variable changed;              // Signalled when a response arrives or the sender finishes.
+    size_t limit = DEFAULT_PIPELINE;         // Most requests in flight at once.
+    unordered_map<uint64_t, RequestHeader> inFlight; // Requests sent and not yet answered, by request ID.
+    bool hashFirst = false;                  // Frames are offered by content hash before their pixels are sent.
+    bool compress = false;                   // Frames are sent compressed, and compressed results are accepted.
+    unordered_map<uint64_t, vector<unsigned char>> images; // Hash-first: pixels of the frames still in flight.
+    deque<uint64_t> uploads;                 // Hash-first: frames the server did not have cached, to be uploaded.
+    size_t uploaded = 0;                     // Hash-first: frames whose pixels had to be sent.
+    bool sendDone = false;                   // No more requests will be sent.
+    bool failed = false;                     // Either side gave up.
+};
+
+// Function run by the sending side of a session: decode each frame and pipeline it behind the earlier ones.
+// In hash-first mode it also uploads the frames the server answered STATUS_NOT_CACHED for, so it only finishes
+// once every frame has been answered.
+void sendFrames(int sock, Session &session, const vector<string> &frames, const string &resize, uint32_t rawWidth,
+                uint32_t rawHeight, bool allowMagick, uint32_t bucketCount) {
+    for (size_t i = 0; i < frames.size() || session.hashFirst;) {
+        vector<unsigned char> image;
+        RequestHeader request;
+        bool upload = false; // Pixels of a frame that was already offered by hash.
+        {
+            unique_lock<mutex> guard(session.lock);
+            session.changed.wait(guard, [&]() {
+                return session.failed || !session.uploads.empty() ||
+                       (i < frames.size() ? session.inFlight.size() < session.limit : session.inFlight.empty());
+            });
+            if (session.failed)
+                break;
+            if (!session.uploads.empty()) {
+                request = session.inFlight[session.uploads.front()];
+                image.swap(session.images[request.requestId]);
+                session.images.erase(request.requestId);
+                session.uploads.pop_front();
+                session.uploaded++;
+                upload = true;
+            } else if (i == frames.size()) {
+                break; // Everything has been answered.
+            }
+        }
+        if (!upload) {
+            uint32_t width = 0, height = 0;
+            if (!loadInputImage(frames[i], resize, rawWidth, rawHeight, allowMagick, image, width, height)) {
+                i++;
+                continue; // Skip frames that cannot be decoded; the rest of the sequence still goes out.
+            }
+            request = makeRequest(width, height, bucketCount, 0, bucketCount, REQUEST_FLAG_KEEP_ALIVE);
+            request.requestId = i++; // The frame index; responses may come back in any order.
+            if (session.compress) {
+                vector<unsigned char> packed;
+                compressRequest(request, image.data(), packed);
+                image.swap(packed); // From here on the frame's payload is its compressed pixels.
+            }
+            lock_guard<mutex> guard(session.lock);
+            session.inFlight[request.requestId] = request; // Registered before sending, so the response always finds it.
+            if (session.hashFirst)
+                session.images[request.requestId] = image; // Kept until the server says whether it needs the pixels.
+        }
+        session.changed.notify_all(); // The receiver may be waiting for the first request.
+        bool sent = session.hashFirst && !upload ? sendHashProbe(sock, request, image.data(), image.size())
+                                                 : sendRequest(sock, request, image.data());
+        if (!sent) {
+            cerr << "Failed to send frame '" << frames[request.requestId] << "'." << endl;
+            lock_guard<mutex> guard(session.lock);
+            session.failed = true;
+            break;
+        }
     }
-    // Write the grayscale image data to the file.
-    outFile.write(reinterpret_cast<const char*>(grayscaleImage.data()), grayscaleImage.size());
-    outFile.close(); // Close the file after writing.
-    cout << "Saved merged grayscale data to '" << filename << "'." << endl;
-    return true; // Successfully saved the file.
+    lock_guard<mutex> guard(session.lock);
+    session.sendDone = true;
+    session.changed.notify_all();
+    shutdown(sock, SHUT_WR); // Ends the session once the server has answered everything.
 }
 
-// Function to convert the raw grayscale file to a JPG image using ImageMagick.
-bool convertRawToJPG(const string &rawFilename, const string &jpgFilename) {
-    // Construct the ImageMagick command to convert the raw grayscale file to a JPG.
-    string command = "magick -size 800x600 -depth 8 gray:" + rawFilename + " " + jpgFilename;
-    cout << "Converting raw grayscale binary to JPG using ImageMagick..." << endl;
-    int ret = system(command.c_str());
-    if (ret != 0) { // If the conversion fails, notify the user.
-        cerr << "Conversion to JPG failed. Ensure ImageMagick is installed on Termux." << endl;
-        return false;
+// Function to send a sequence of frames over one connection, pipelining up to 'pipeline' of them, and write each
+// grayscale result to 'outputDir' under the frame's name with a ".pgm" extension. Returns the number of frames done.
+// With 'hashFirst' each frame is offered by content hash first, so repeated frames are never uploaded.
+// With 'compress' the frames travel compressed in both directions.
+size_t processFrames(const string &host, int port, const vector<string> &frames, const string &resize, uint32_t rawWidth,
+                     uint32_t rawHeight, bool allowMagick, uint32_t bucketCount, int pipeline, bool hashFirst,
+                     bool compress, const string &outputDir) {
+    int sock = connectToServer(host.c_str(), port);
+    if (sock < 0)
+        return 0;
+    cout << "Connected to server " << host << " on port " << port << " (" << frames.size() << " frames, up to "
+         << pipeline << " in flight)." << endl;
+    mkdir(outputDir.c_str(), 0777); // May already exist.
+
+    Session session;
+    session.limit = pipeline;
+    session.hashFirst = hashFirst;
+    session.compress = compress;
+    auto start = chrono::steady_clock::now();
+    thread sender(sendFrames, sock, ref(session), cref(frames), cref(resize), rawWidth, rawHeight, allowMagick, bucketCount);
+    size_t done = 0;
+    vector<unsigned char> grayscaleImage;
+    while (true) {
+        {
+            unique_lock<mutex> guard(session.lock);
+            session.changed.wait(guard, [&]() { return !session.inFlight.empty() || session.sendDone; });
+            if (session.inFlight.empty() || session.failed)
+                break; // Everything sent has been answered (or the session failed).
+        }
+        unsigned char header[HEADER_SIZE];
+        if (!recvAll(sock, header, HEADER_SIZE)) {
+            cerr << "Failed to receive a response header." << endl;
+            break;
+        }
+        ResponseHeader response = decodeResponseHeader(header);
+        RequestHeader request;
+        {
+            lock_guard<mutex> guard(session.lock);
+            auto it = session.inFlight.find(response.requestId);
+            if (it == session.inFlight.end()) {
+                cerr << "Response for unknown request " << response.requestId << "." << endl;
+                break;
+            }
+            request = it->second;
+            if (response.status == STATUS_NOT_CACHED && hashFirst) {
+                session.uploads.push_back(response.requestId); // The sender uploads the pixels on the same session.
+                session.changed.notify_all();
+                continue;
+            }
+        }
+        if (response.status != STATUS_OK) {
+            cerr << "Server rejected frame '" << frames[request.requestId] << "': " << statusMessage(response.status) << endl;
+            break; // The server closes the connection after an error.
+        }
+        uint64_t pixels = responsePayloadLength(request);
+        bool packed = (response.flags & RESPONSE_FLAG_COMPRESSED) != 0;
+        if (response.magic != PROTOCOL_MAGIC || response.width != request.width || response.height != request.height ||
+            (packed ? !compress || response.payloadLength > compressedBound(pixels, 1) : response.payloadLength != pixels)) {
+            cerr << "Response does not match frame '" << frames[request.requestId] << "'." << endl;
+            break;
+        }
+        grayscaleImage.resize(pixels); // Buckets arrive back to back, so the image is one read.
+        if (packed ? !receiveCompressed(sock, response.payloadLength, grayscaleImage.data(), pixels, 1)
+                   : !recvAll(sock, grayscaleImage.data(), grayscaleImage.size())) {
+            cerr << "Failed to receive frame '" << frames[request.requestId] << "'." << endl;
+            break;
+        }
+        {
+            lock_guard<mutex> guard(session.lock);
+            session.inFlight.erase(response.requestId);
+            session.changed.notify_all(); // Room for the next frame.
+        }
+        string name = frames[request.requestId].substr(frames[request.requestId].rfind('/') + 1);
+        name = outputDir + "/" + name.substr(0, name.rfind('.')) + ".pgm";
+        if (saveGrayscaleImage(grayscaleImage.data(), request.width, request.height, name, false))
+            done++;
+    }
+    {
+        lock_guard<mutex> guard(session.lock);
+        session.failed = session.failed || !session.inFlight.empty() || !session.sendDone; // Stopped early.
+        session.changed.notify_all();
     }
-    cout << "Grayscale image converted to '" << jpgFilename << "'." << endl;
-    return true; // Conversion successful.
+    shutdown(sock, SHUT_RDWR); // Unblocks the sender if it is stuck in send().
+    sender.join();
+    close(sock);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Processed " << done << " of " << frames.size() << " frames in " << seconds << " s ("
+         << done / max(seconds, 1e-9) << " frames/s)." << endl;
+    if (hashFirst)
+        cout << "Uploaded " << session.uploaded << " frames; the rest were answered from the server's cache." << endl;
+    return done;
+}
+
+// Function to print the command line options.
+void printUsage(const char* program) {
+    cout << "Usage: " << program << " [image] [--buckets N] [--resize WxH] [--stream] [--server HOST[:PORT]]" << endl
+         << "       " << program << " [image] [--buckets N] [--resize WxH] --servers HOST[:PORT],HOST[:PORT],..."
+         << " [--shard-buckets N] [--shard-timeout MS] [--shard-attempts N]" << endl
+         << "       " << program << " --frames DIR|PATTERN [--buckets N] [--resize WxH] [--server HOST[:PORT]]"
+         << " [--pipeline N] [--output-dir DIR]" << endl
+         << "       " << program << " [image] --intensity K | --thresholds T1,T2,... [--resize WxH] [--server HOST[:PORT]]" << endl
+         << "Image options: [--output FILE] [--raw-size WxH] [--raw-format rgb8|bgr8|rgba8|bgra8|rgb16|rgba16] [--no-magick]"
+         << " [--luma average|bt601|bt709] [--hash-first] [--compress] [--local SOCKET]" << endl;
 }
 
 int main(int argc, char* argv[]) {
     // If an image path is provided as an argument, use it; otherwise, use a default path.
-    string inputImagePath;
-    if (argc == 2) {
-        inputImagePath = argv[1];
-    } else {
-        inputImagePath = "/storage/emulated/0/Download/input.jpg";
-        cout << "No image path provided. Using default: " << inputImagePath << endl;
+    string inputImagePath = "/storage/emulated/0/Download/input.jpg";
+    string resize;                      // Optional "WxH" downscale; empty keeps the original size.
+    uint32_t bucketCount = DEFAULT_BUCKETS; // Number of buckets to ask the server for.
+    bool stream = false;                // Overlap sending the image with receiving the buckets.
+    string serverHost = SERVER_IP;      // Server used without --servers.
+    int serverPort = PORT;
+    vector<Backend> backends;           // Coordinator mode: the servers sharing the image.
+    uint32_t shardBuckets = 0;          // Buckets per shard (0 picks a default).
+    int shardTimeoutMs = DEFAULT_SHARD_TIMEOUT_MS;
+    int shardAttempts = DEFAULT_SHARD_ATTEMPTS;
+    string outputPath = "gray_output.pgm"; // Written in-process; other extensions use ImageMagick.
+    uint32_t rawWidth = 0, rawHeight = 0; // Size of a headerless raw input (--raw-size, in the --raw-format encoding).
+    bool allowMagick = true;            // Fall back to ImageMagick for formats that are not built in.
+    string framesSource;                // Session mode: a directory or printf-style pattern of frames.
+    int pipeline = DEFAULT_PIPELINE;    // Session mode: frames in flight at once.
+    string outputDir = "gray_frames";   // Session mode: where the grayscale frames are written.
+    bool hashFirst = false;             // Offer the content hash before uploading the pixels (needs a server cache).
+    bool compress = false;              // Send the pixels compressed and accept compressed results.
+    string localSocket;                 // Same-host server: pass the frame in shared memory over this Unix domain socket.
+    uint32_t intensityBuckets = 0;      // Intensity mode: number of intensity ranges (0 uses positional buckets).
+    vector<unsigned char> thresholds;   // Intensity mode: lower bounds of ranges 2..K (equal widths unless --thresholds).
+    bool havePath = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            printUsage(argv[0]);
+            return 0;
+        } else if (arg == "--buckets" && i + 1 < argc) {
+            bucketCount = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+            if (bucketCount == 0 || bucketCount > MAX_BUCKETS) {
+                cerr << "Bucket count must be between 1 and " << MAX_BUCKETS << "." << endl;
+                return -1;
+            }
+        } else if (arg == "--stream") {
+            stream = true;
+        } else if (arg == "--server" && i + 1 < argc) {
+            if (!parseServerAddress(argv[++i], serverHost, serverPort)) {
+                cerr << "Invalid server address: " << argv[i] << endl;
+                return -1;
+            }
+        } else if (arg == "--servers" && i + 1 < argc) {
+            string list = argv[++i];
+            for (size_t start = 0; start <= list.size();) {
+                size_t comma = min(list.find(',', start), list.size());
+                Backend backend;
+                if (!parseServerAddress(list.substr(start, comma - start), backend.host, backend.port)) {
+                    cerr << "Invalid server address in --servers: " << list.substr(start, comma - start) << endl;
+                    return -1;
+                }
+                backends.push_back(backend);
+                start = comma + 1;
+            }
+        } else if (arg == "--shard-buckets" && i + 1 < argc) {
+            shardBuckets = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--shard-timeout" && i + 1 < argc) {
+            shardTimeoutMs = atoi(argv[++i]);
+        } else if (arg == "--shard-attempts" && i + 1 < argc) {
+            shardAttempts = max(1, atoi(argv[++i]));
+        } else if (arg == "--resize" && i + 1 < argc) {
+            resize = argv[++i];
+        } else if (arg == "--output" && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if (arg == "--raw-size" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%ux%u", &rawWidth, &rawHeight) != 2 || rawWidth == 0 || rawHeight == 0) {
+                cerr << "Invalid --raw-size: " << argv[i] << endl;
+                return -1;
+            }
+        } else if (arg == "--raw-format" && i + 1 < argc) {
+            if (!parsePixelFormat(argv[++i], pixelFormat)) {
+                cerr << "Unknown --raw-format: " << argv[i] << " (rgb8, bgr8, rgba8, bgra8, rgb16 or rgba16)." << endl;
+                return -1;
+            }
+        } else if (arg == "--luma" && i + 1 < argc) {
+            string weighting = argv[++i];
+            if (weighting == "average") {
+                lumaFlags = 0;
+            } else if (weighting == "bt601") {
+                lumaFlags = REQUEST_FLAG_LUMA_BT601;
+            } else if (weighting == "bt709") {
+                lumaFlags = REQUEST_FLAG_LUMA_BT709;
+            } else {
+                cerr << "Unknown --luma weighting: " << weighting << " (average, bt601 or bt709)." << endl;
+                return -1;
+            }
+        } else if (arg == "--no-magick") {
+            allowMagick = false;
+        } else if (arg == "--frames" && i + 1 < argc) {
+            framesSource = argv[++i];
+        } else if (arg == "--pipeline" && i + 1 < argc) {
+            pipeline = atoi(argv[++i]);
+            if (pipeline < 1) {
+                cerr << "--pipeline must be at least 1." << endl;
+                return -1;
+            }
+        } else if (arg == "--intensity" && i + 1 < argc) {
+            intensityBuckets = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+            if (intensityBuckets == 0 || intensityBuckets > MAX_INTENSITY_BUCKETS) {
+                cerr << "Intensity bucket count must be between 1 and " << MAX_INTENSITY_BUCKETS << "." << endl;
+                return -1;
+            }
+            thresholds.assign(intensityBuckets - 1, 0);
+            defaultIntensityThresholds(intensityBuckets, thresholds.data());
+        } else if (arg == "--thresholds" && i + 1 < argc) {
+            thresholds.clear();
+            bool parsed = true;
+            for (char* p = argv[++i]; *p && parsed;) {
+                char* end;
+                unsigned long value = strtoul(p, &end, 10);
+                parsed = end != p && value <= 255 && (*end == '\0' || *end == ',');
+                thresholds.push_back(static_cast<unsigned char>(value));
+                p = *end ? end + 1 : end;
+            }
+            intensityBuckets = thresholds.size() + 1;
+            if (!parsed || intensityBuckets > MAX_INTENSITY_BUCKETS || !validIntensityThresholds(thresholds.data(), intensityBuckets)) {
+                cerr << "--thresholds must be strictly increasing gray levels between 1 and 255: " << argv[i] << endl;
+                return -1;
+            }
+        } else if (arg == "--hash-first") {
+            hashFirst = true;
+        } else if (arg == "--compress") {
+            compress = true;
+        } else if (arg == "--local" && i + 1 < argc) {
+            localSocket = argv[++i];
+        } else if (arg == "--output-dir" && i + 1 < argc) {
+            outputDir = argv[++i];
+        } else if (arg[0] != '-' && !havePath) {
+            inputImagePath = arg;
+            havePath = true;
+        } else {
+            printUsage(argv[0]);
+            return -1;
+        }
     }
-    
-    // Step 1: Convert the input image to raw binary format.
-    if (!convertImageToRaw(inputImagePath))
+    if (pixelFormat != PIXEL_FORMAT_RGB8 && (rawWidth == 0 || !resize.empty())) {
+        cerr << "--raw-format needs --raw-size and cannot be combined with --resize." << endl;
         return -1;
-    
-    // Step 2: Load the raw image from the generated file ("temp_input.bin").
-    vector<unsigned char> image;
-    if (!loadRawImage("temp_input.bin", image))
+    }
+    if (stream && !backends.empty()) {
+        cerr << "--stream cannot be combined with --servers." << endl;
         return -1;
-    
-    // Step 3: Connect to the server using the defined SERVER_IP and PORT.
-    int sock = connectToServer(SERVER_IP, PORT);
-    if (sock < 0)
+    }
+    if (hashFirst && (stream || !backends.empty())) {
+        cerr << "--hash-first cannot be combined with --stream or --servers." << endl;
         return -1;
-    
-    // Step 4: Send the raw image data over the established socket connection.
-    if (!sendImageData(sock, image)) {
-        close(sock);
+    }
+    if (compress && (stream || !backends.empty() || intensityBuckets)) {
+        cerr << "--compress cannot be combined with --stream, --servers or intensity buckets." << endl;
         return -1;
     }
-    
-    // Step 5: Receive 8 buckets of processed grayscale data from the server.
-    vector<vector<unsigned char>> buckets;
-    if (!receiveBuckets(sock, buckets)) {
-        close(sock);
+    if (!localSocket.empty() && (stream || hashFirst || compress || !backends.empty() || intensityBuckets || !framesSource.empty())) {
+        cerr << "--local cannot be combined with --stream, --hash-first, --compress, --servers, intensity buckets or --frames." << endl;
         return -1;
     }
-    close(sock); // Close the socket once data has been received.
+    if (intensityBuckets && (stream || hashFirst || !backends.empty() || !framesSource.empty())) {
+        cerr << "Intensity buckets cannot be combined with --stream, --hash-first, --servers or --frames." << endl;
+        return -1;
+    }
+    if (!framesSource.empty()) {
+        // Session mode: the whole sequence goes through one connection.
+        if (stream || !backends.empty()) {
+            cerr << "--frames cannot be combined with --stream or --servers." << endl;
+            return -1;
+        }
+        vector<string> frames;
+        if (!listFrames(framesSource, frames)) {
+            cerr << "No frames found in '" << framesSource << "'." << endl;
+            return -1;
+        }
+        size_t done = processFrames(serverHost, serverPort, frames, resize, rawWidth, rawHeight, allowMagick, bucketCount,
+                                    pipeline, hashFirst, compress, outputDir);
+        return done == frames.size() ? 0 : -1;
+    }
+    if (!havePath)
+        cout << "No image path provided. Using default: " << inputImagePath << endl;
     
-    // Step 6: Print a brief summary of the received grayscale buckets.
-    printBucketsSummary(buckets);
+    // Steps 1-2: Decode (and optionally resize) the input image into an RGB buffer in memory.
+    vector<unsigned char> image;
+    uint32_t width = 0, height = 0;
+    if (!loadInputImage(inputImagePath, resize, rawWidth, rawHeight, allowMagick, image, width, height))
+        return -1;
     
-    // Step 7: Merge the individual buckets into a single grayscale image vector.
-    vector<unsigned char> grayscaleImage;
-    mergeBuckets(buckets, grayscaleImage);
+    if (intensityBuckets) {
+        // Intensity mode: the server returns the histogram and the pixel indices of every intensity range.
+        size_t pixels = image.size() / bytesPerPixel(pixelFormat);
+        image.insert(image.end(), thresholds.begin(), thresholds.end()); // The thresholds follow the pixels.
+        vector<unsigned char> result;
+        if (!processIntensityOnServer(serverHost, serverPort, image, width, height, intensityBuckets, result))
+            return -1;
+        printIntensitySummary(result, thresholds, intensityBuckets);
+        vector<unsigned char> labels = intensityLabelImage(result, thresholds, intensityBuckets, pixels);
+        return saveGrayscaleImage(labels.data(), width, height, outputPath, allowMagick) ? 0 : -1;
+    }
     
-    // Step 8: Save the merged grayscale image as a raw binary file.
-    if (!saveGrayscaleRawImage(grayscaleImage, "gray_output.bin"))
+    // Steps 3-5: Send the image and receive the buckets, from one server or in shards from several (--servers).
+    // With --local the buckets are read straight from the shared memory the server wrote them into.
+    vector<unsigned char> grayscaleImage;
+    SharedRegion sharedGray;
+    vector<BucketView> buckets;
+    bool processed = !localSocket.empty()
+        ? processLocally(localSocket, image, width, height, bucketCount, sharedGray, buckets)
+        : backends.empty()
+        ? processOnServer(serverHost, serverPort, image, width, height, bucketCount, stream, hashFirst, compress, grayscaleImage, buckets)
+        : runCoordinator(image, width, height, bucketCount, backends, shardBuckets, shardTimeoutMs, shardAttempts, grayscaleImage);
+    if (!processed)
         return -1;
+    if (!backends.empty())
+        buckets = partitionIntoBuckets(grayscaleImage.size(), bucketCount); // Same layout the shards were cut from.
+    const unsigned char* gray = sharedGray.mapped() ? sharedGray.data() : grayscaleImage.data();
+    
+    // Step 6: Print a brief summary of the received grayscale buckets.
+    printBucketsSummary(gray, buckets);
     
-    // Step 9: Convert the raw grayscale binary file into a JPG image using ImageMagick.
-    if (!convertRawToJPG("gray_output.bin", "gray_output.jpg"))
+    // Step 7: Save the grayscale image straight from the receive buffer (PGM by default, see --output).
+    if (!saveGrayscaleImage(gray, width, height, outputPath, allowMagick))
         return -1;
     
     return 0; // End the program successfully.
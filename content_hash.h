@@ -0,0 +1,137 @@
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// 64-bit content hash of image payloads (the XXH64 algorithm), used to find repeated frames in the server's result
+// cache. It runs at several GB/s, so hashing a frame costs far less than converting it. The client computes the
+// same hash to ask for a cached result without uploading the image (REQUEST_FLAG_HASH_ONLY).
+//
+// ContentHasher accepts the data in pieces of any size, so the server can hash each chunk right after recv() has
+// written it, while it is still in the cache. The result does not depend on how the data was split.
+
+class ContentHasher
+{
+public:
+    explicit ContentHasher(uint64_t seed = 0) { reset(seed); }
+
+    // Starts over with an empty input.
+    void reset(uint64_t seed = 0)
+    {
+        lanes[0] = seed + PRIME1 + PRIME2;
+        lanes[1] = seed + PRIME2;
+        lanes[2] = seed;
+        lanes[3] = seed - PRIME1;
+        this->seed = seed;
+        total = 0;
+        buffered = 0;
+    }
+
+    // Adds 'length' bytes to the input.
+    void update(const unsigned char *data, size_t length)
+    {
+        total += length;
+        if (buffered + length < STRIPE)
+        {
+            memcpy(buffer + buffered, data, length); // Not a whole stripe yet.
+            buffered += length;
+            return;
+        }
+        if (buffered > 0)
+        {
+            size_t fill = STRIPE - buffered; // Complete the stripe left over from the previous call.
+            memcpy(buffer + buffered, data, fill);
+            consumeStripe(buffer);
+            data += fill;
+            length -= fill;
+            buffered = 0;
+        }
+        for (; length >= STRIPE; data += STRIPE, length -= STRIPE)
+            consumeStripe(data);
+        memcpy(buffer, data, length); // Keep the tail for the next call or digest().
+        buffered = length;
+    }
+
+    // Hash of everything added so far.
+    uint64_t digest() const
+    {
+        uint64_t hash;
+        if (total >= STRIPE)
+        {
+            hash = rotate(lanes[0], 1) + rotate(lanes[1], 7) + rotate(lanes[2], 12) + rotate(lanes[3], 18);
+            for (int i = 0; i < 4; i++)
+                hash = (hash ^ round(0, lanes[i])) * PRIME1 + PRIME4;
+        }
+        else
+            hash = seed + PRIME5;
+        hash += total;
+        const unsigned char *p = buffer;
+        size_t left = buffered;
+        for (; left >= 8; p += 8, left -= 8)
+            hash = rotate(hash ^ round(0, read64(p)), 27) * PRIME1 + PRIME4;
+        if (left >= 4)
+        {
+            hash = rotate(hash ^ (uint64_t(read32(p)) * PRIME1), 23) * PRIME2 + PRIME3;
+            p += 4;
+            left -= 4;
+        }
+        for (; left > 0; p++, left--)
+            hash = rotate(hash ^ (*p * PRIME5), 11) * PRIME1;
+        hash ^= hash >> 33; // Final avalanche, so every input bit affects every output bit.
+        hash *= PRIME2;
+        hash ^= hash >> 29;
+        hash *= PRIME3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+private:
+    static const uint64_t PRIME1 = 11400714785074694791ull;
+    static const uint64_t PRIME2 = 14029467366897019727ull;
+    static const uint64_t PRIME3 = 1609587929392839161ull;
+    static const uint64_t PRIME4 = 9650029242287828579ull;
+    static const uint64_t PRIME5 = 2870177450012600261ull;
+    static const size_t STRIPE = 32; // Bytes consumed per step: one 8-byte word for each of the four lanes.
+
+    uint64_t lanes[4];               // Independent accumulators, so the CPU can work on all four at once.
+    uint64_t seed;                   // Seed given to reset().
+    uint64_t total;                  // Bytes added so far.
+    unsigned char buffer[STRIPE];    // Bytes not yet forming a whole stripe.
+    size_t buffered;                 // Number of bytes in 'buffer'.
+
+    static uint64_t rotate(uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); }
+
+    static uint64_t round(uint64_t lane, uint64_t input) { return rotate(lane + input * PRIME2, 31) * PRIME1; }
+
+    // Little-endian loads, independent of the alignment of 'p'.
+    static uint64_t read64(const unsigned char *p)
+    {
+        uint64_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+    static uint32_t read32(const unsigned char *p)
+    {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    void consumeStripe(const unsigned char *p)
+    {
+        for (int i = 0; i < 4; i++)
+            lanes[i] = round(lanes[i], read64(p + 8 * i));
+    }
+};
+
+// Function to hash a whole buffer in one call
+inline uint64_t contentHash(const unsigned char *data, size_t length)
+{
+    ContentHasher hasher;
+    hasher.update(data, length);
+    return hasher.digest();
+}
+
+#endif // CONTENT_HASH_H
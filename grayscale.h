@@ -0,0 +1,221 @@
+#ifndef GRAYSCALE_H
+#define GRAYSCALE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GRAYSCALE_X86 1
+#endif
+
+// Every grayscale kernel converts 'pixels' interleaved RGB pixels (3 bytes each) into one gray byte per pixel
+// using the average method, (r + g + b) / 3. All kernels must produce exactly the same bytes.
+typedef void (*GrayscaleKernel)(const unsigned char *rgb, unsigned char *gray, size_t pixels);
+
+// Description of one kernel: its name, entry point and whether the running CPU can execute it.
+struct GrayscaleKernelInfo
+{
+    const char *name;       // Name used on the command line and in logs.
+    GrayscaleKernel kernel; // Function performing the conversion.
+    bool supported;         // True if the CPU has the instructions the kernel needs.
+};
+
+// Fixed-point reciprocal of 3 used by the vector kernels: (sum * 21846) >> 16 == sum / 3 for every sum of
+// three bytes (0..765), so the division becomes a single 16-bit "multiply high" instruction.
+const unsigned short GRAY_RECIPROCAL_3 = 21846;
+
+// Reference kernel: one pixel at a time with an integer division. Used for the image tail and on CPUs without SIMD.
+inline void convertGrayscaleScalar(const unsigned char *rgb, unsigned char *gray, size_t pixels)
+{
+    for (size_t i = 0; i < pixels; i++)
+    {
+        int r = rgb[3 * i];       // Extract the red component.
+        int g = rgb[3 * i + 1];   // Extract the green component.
+        int b = rgb[3 * i + 2];   // Extract the blue component.
+        gray[i] = static_cast<unsigned char>((r + g + b) / 3); // Average of the three channels.
+    }
+}
+
+#ifdef GRAYSCALE_X86
+
+// PSHUFB control masks that deinterleave 16 RGB pixels (48 bytes = three 16-byte blocks A, B, C).
+// Row 3*channel + block gathers that channel's bytes found in the given block into their final
+// positions; -1 writes a zero so the three partial results can simply be OR-ed together.
+alignas(16) const signed char GRAY_DEINTERLEAVE_MASKS[9][16] = {
+    { 0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}, // Red from block A.
+    {-1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14, -1, -1, -1, -1, -1}, // Red from block B.
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  1,  4,  7, 10, 13}, // Red from block C.
+    { 1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}, // Green from block A.
+    {-1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1}, // Green from block B.
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14}, // Green from block C.
+    { 2,  5,  8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}, // Blue from block A.
+    {-1, -1, -1, -1, -1,  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1}, // Blue from block B.
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15}, // Blue from block C.
+};
+
+// SSE4.1 kernel: 16 pixels per iteration.
+__attribute__((target("sse4.1")))
+inline void convertGrayscaleSse41(const unsigned char *rgb, unsigned char *gray, size_t pixels)
+{
+    __m128i mask[9]; // The deinterleave masks.
+    for (int m = 0; m < 9; m++)
+        mask[m] = _mm_load_si128(reinterpret_cast<const __m128i *>(GRAY_DEINTERLEAVE_MASKS[m]));
+    const __m128i divide = _mm_set1_epi16(GRAY_RECIPROCAL_3); // Fixed-point 1/3.
+    const __m128i zero = _mm_setzero_si128(); // Used to zero-extend bytes to 16 bits.
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16)
+    {
+        const unsigned char *p = rgb + 3 * i; // First byte of this group of 16 pixels.
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));      // Bytes 0..15.
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16)); // Bytes 16..31.
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 32)); // Bytes 32..47.
+        // Gather the 16 red, green and blue bytes into one register each.
+        __m128i r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, mask[0]), _mm_shuffle_epi8(b, mask[1])), _mm_shuffle_epi8(c, mask[2]));
+        __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, mask[3]), _mm_shuffle_epi8(b, mask[4])), _mm_shuffle_epi8(c, mask[5]));
+        __m128i bl = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, mask[6]), _mm_shuffle_epi8(b, mask[7])), _mm_shuffle_epi8(c, mask[8]));
+        // Widen to 16 bits and add the channels (the sum fits easily: at most 765).
+        __m128i sumLo = _mm_add_epi16(_mm_add_epi16(_mm_cvtepu8_epi16(r), _mm_cvtepu8_epi16(g)), _mm_cvtepu8_epi16(bl));
+        __m128i sumHi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero)), _mm_unpackhi_epi8(bl, zero));
+        // Divide by 3 with a multiply-high and narrow back to bytes.
+        __m128i result = _mm_packus_epi16(_mm_mulhi_epu16(sumLo, divide), _mm_mulhi_epu16(sumHi, divide));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(gray + i), result);
+    }
+    convertGrayscaleScalar(rgb + 3 * i, gray + i, pixels - i); // Remaining 0..15 pixels.
+}
+
+// AVX2 kernel: 32 pixels per iteration. PSHUFB works within 128-bit lanes, so each lane is loaded
+// with the same 16-pixel layout the SSE kernel uses (lane 0: pixels 0..15, lane 1: pixels 16..31).
+__attribute__((target("avx2")))
+inline void convertGrayscaleAvx2(const unsigned char *rgb, unsigned char *gray, size_t pixels)
+{
+    __m256i mask[9]; // The deinterleave masks repeated in both lanes.
+    for (int m = 0; m < 9; m++)
+        mask[m] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(GRAY_DEINTERLEAVE_MASKS[m])));
+    const __m256i divide = _mm256_set1_epi16(GRAY_RECIPROCAL_3); // Fixed-point 1/3.
+    const __m256i zero = _mm256_setzero_si256(); // Used to zero-extend bytes to 16 bits.
+    size_t i = 0;
+    for (; i + 32 <= pixels; i += 32)
+    {
+        const unsigned char *p = rgb + 3 * i; // First byte of this group of 32 pixels.
+        // Block A/B/C of pixels 0..15 in the low lane, of pixels 16..31 in the high lane.
+        __m256i a = _mm256_loadu2_m128i(reinterpret_cast<const __m128i *>(p + 48), reinterpret_cast<const __m128i *>(p));
+        __m256i b = _mm256_loadu2_m128i(reinterpret_cast<const __m128i *>(p + 64), reinterpret_cast<const __m128i *>(p + 16));
+        __m256i c = _mm256_loadu2_m128i(reinterpret_cast<const __m128i *>(p + 80), reinterpret_cast<const __m128i *>(p + 32));
+        __m256i r = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, mask[0]), _mm256_shuffle_epi8(b, mask[1])), _mm256_shuffle_epi8(c, mask[2]));
+        __m256i g = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, mask[3]), _mm256_shuffle_epi8(b, mask[4])), _mm256_shuffle_epi8(c, mask[5]));
+        __m256i bl = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, mask[6]), _mm256_shuffle_epi8(b, mask[7])), _mm256_shuffle_epi8(c, mask[8]));
+        // Unpack and pack both operate per lane, so the pixel order within each lane is preserved.
+        __m256i sumLo = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(r, zero), _mm256_unpacklo_epi8(g, zero)), _mm256_unpacklo_epi8(bl, zero));
+        __m256i sumHi = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(r, zero), _mm256_unpackhi_epi8(g, zero)), _mm256_unpackhi_epi8(bl, zero));
+        __m256i result = _mm256_packus_epi16(_mm256_mulhi_epu16(sumLo, divide), _mm256_mulhi_epu16(sumHi, divide));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(gray + i), result);
+    }
+    convertGrayscaleSse41(rgb + 3 * i, gray + i, pixels - i); // Remaining 0..31 pixels.
+}
+
+// Function to load one 16-byte block for each of the four 128-bit lanes; lane k starts 48*k bytes (16 pixels) further.
+__attribute__((target("avx512f,avx512bw")))
+inline __m512i grayLoadLanes512(const unsigned char *p)
+{
+    __m512i v = _mm512_castsi128_si512(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+    v = _mm512_inserti32x4(v, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 48)), 1);
+    v = _mm512_inserti32x4(v, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 96)), 2);
+    return _mm512_inserti32x4(v, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 144)), 3);
+}
+
+// AVX-512 kernel: 64 pixels per iteration, using the same per-lane layout across four 128-bit lanes.
+__attribute__((target("avx512f,avx512bw")))
+inline void convertGrayscaleAvx512(const unsigned char *rgb, unsigned char *gray, size_t pixels)
+{
+    __m512i mask[9]; // The deinterleave masks repeated in all four lanes.
+    for (int m = 0; m < 9; m++)
+        mask[m] = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_load_si128(reinterpret_cast<const __m128i *>(GRAY_DEINTERLEAVE_MASKS[m])));
+    const __m512i divide = _mm512_set1_epi16(GRAY_RECIPROCAL_3); // Fixed-point 1/3.
+    const __m512i zero = _mm512_setzero_si512(); // Used to zero-extend bytes to 16 bits.
+    size_t i = 0;
+    for (; i + 64 <= pixels; i += 64)
+    {
+        const unsigned char *p = rgb + 3 * i; // First byte of this group of 64 pixels.
+        __m512i a = grayLoadLanes512(p);      // Block A of every lane.
+        __m512i b = grayLoadLanes512(p + 16); // Block B of every lane.
+        __m512i c = grayLoadLanes512(p + 32); // Block C of every lane.
+        __m512i r = _mm512_or_si512(_mm512_or_si512(_mm512_shuffle_epi8(a, mask[0]), _mm512_shuffle_epi8(b, mask[1])), _mm512_shuffle_epi8(c, mask[2]));
+        __m512i g = _mm512_or_si512(_mm512_or_si512(_mm512_shuffle_epi8(a, mask[3]), _mm512_shuffle_epi8(b, mask[4])), _mm512_shuffle_epi8(c, mask[5]));
+        __m512i bl = _mm512_or_si512(_mm512_or_si512(_mm512_shuffle_epi8(a, mask[6]), _mm512_shuffle_epi8(b, mask[7])), _mm512_shuffle_epi8(c, mask[8]));
+        __m512i sumLo = _mm512_add_epi16(_mm512_add_epi16(_mm512_unpacklo_epi8(r, zero), _mm512_unpacklo_epi8(g, zero)), _mm512_unpacklo_epi8(bl, zero));
+        __m512i sumHi = _mm512_add_epi16(_mm512_add_epi16(_mm512_unpackhi_epi8(r, zero), _mm512_unpackhi_epi8(g, zero)), _mm512_unpackhi_epi8(bl, zero));
+        __m512i result = _mm512_packus_epi16(_mm512_mulhi_epu16(sumLo, divide), _mm512_mulhi_epu16(sumHi, divide));
+        _mm512_storeu_si512(reinterpret_cast<__m512i *>(gray + i), result);
+    }
+    convertGrayscaleAvx2(rgb + 3 * i, gray + i, pixels - i); // Remaining 0..63 pixels.
+}
+
+#endif // GRAYSCALE_X86
+
+// Function to list every kernel compiled into the program, fastest first, with CPU support detected via CPUID.
+inline const GrayscaleKernelInfo *grayscaleKernels(size_t &count)
+{
+    static const GrayscaleKernelInfo kernels[] = {
+#ifdef GRAYSCALE_X86
+        {"avx512", convertGrayscaleAvx512, __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")},
+        {"avx2", convertGrayscaleAvx2, static_cast<bool>(__builtin_cpu_supports("avx2"))},
+        {"sse4.1", convertGrayscaleSse41, static_cast<bool>(__builtin_cpu_supports("sse4.1"))},
+#endif
+        {"scalar", convertGrayscaleScalar, true},
+    };
+    count = sizeof(kernels) / sizeof(kernels[0]); // Number of entries in the table.
+    return kernels;
+}
+
+// Function to find the fastest kernel the CPU supports (the table is ordered fastest first and ends with the scalar
+// kernel, which every CPU runs)
+inline const GrayscaleKernelInfo *fastestGrayscaleKernel()
+{
+    size_t count = 0;
+    const GrayscaleKernelInfo *kernels = grayscaleKernels(count);
+    for (size_t k = 0; k < count; k++)
+        if (kernels[k].supported)
+            return &kernels[k];
+    return &kernels[count - 1];
+}
+
+// Kernel used by convertRgbToGray(): the fastest one the CPU supports, unless selectGrayscaleKernel() picked another.
+// The static is initialised exactly once even if workers race to the first call, and the pointer is atomic, so a
+// kernel selected while workers run is seen whole.
+inline std::atomic<const GrayscaleKernelInfo *> &grayscaleKernelSelection()
+{
+    static std::atomic<const GrayscaleKernelInfo *> active{fastestGrayscaleKernel()};
+    return active;
+}
+
+// Function to return the kernel convertRgbToGray() uses
+inline const GrayscaleKernelInfo *activeGrayscaleKernel()
+{
+    return grayscaleKernelSelection().load(std::memory_order_acquire);
+}
+
+// Function to force a specific kernel by name; fails if it is unknown or not supported by this CPU.
+inline bool selectGrayscaleKernel(const char *name)
+{
+    size_t count = 0;
+    const GrayscaleKernelInfo *kernels = grayscaleKernels(count);
+    for (size_t k = 0; k < count; k++)
+    {
+        if (strcmp(kernels[k].name, name) == 0 && kernels[k].supported)
+        {
+            grayscaleKernelSelection().store(&kernels[k], std::memory_order_release); // Use this kernel from now on.
+            return true;
+        }
+    }
+    return false; // Unknown name or missing CPU support.
+}
+
+// Function to convert 'pixels' RGB pixels to grayscale with the selected kernel.
+inline void convertRgbToGray(const unsigned char *rgb, unsigned char *gray, size_t pixels)
+{
+    activeGrayscaleKernel()->kernel(rgb, gray, pixels);
+}
+
+#endif // GRAYSCALE_H
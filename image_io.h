@@ -0,0 +1,344 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// In-process image reading, writing and resizing, so the client needs neither temp files nor child processes.
+//
+// Built in: binary PPM (P6) and PGM (P5) with any maxval up to 65535, and headerless raw RGB or gray bytes.
+// Other formats (JPG, PNG, ...) fall back to ImageMagick, streamed through a pipe as PNM instead of a temp file.
+
+// An 8-bit image with interleaved channels (1 = gray, 3 = RGB; raw input read by readRawFile() may use any layout).
+struct Image
+{
+    uint32_t width = 0;                 // Width in pixels.
+    uint32_t height = 0;                // Height in pixels.
+    int channels = 0;                   // Bytes per pixel.
+    std::vector<unsigned char> pixels;  // width * height * channels bytes, row by row.
+};
+
+// Largest width or height the decoder accepts, so a corrupt header cannot make it allocate gigabytes.
+const uint32_t MAX_DECODE_DIMENSION = 1u << 16;
+
+// Function to read the next number from a PNM header, skipping whitespace and '#' comments
+inline bool readPnmNumber(FILE *in, uint32_t &value)
+{
+    int c = getc(in);
+    while (c == '#' || isspace(c)) // Skip separators and comment lines.
+    {
+        if (c == '#')
+            while (c != '\n' && c != EOF)
+                c = getc(in);
+        c = getc(in);
+    }
+    if (!isdigit(c))
+        return false; // Not a number: the header is malformed.
+    uint64_t number = 0;
+    while (isdigit(c) && number <= 0xFFFFFFFFull)
+    {
+        number = number * 10 + (c - '0');
+        c = getc(in);
+    }
+    value = static_cast<uint32_t>(number); // The single whitespace after the number has been consumed.
+    return isspace(c) && number <= 0xFFFFFFFFull;
+}
+
+// Function to decode a binary PPM (P6) or PGM (P5) stream; the pixel data is read straight into 'image.pixels'.
+// Fails on a malformed header, missing pixel data, or a sample above maxval.
+inline bool readPnm(FILE *in, Image &image)
+{
+    int p = getc(in), kind = getc(in);
+    uint32_t maxval = 0;
+    if (p != 'P' || (kind != '5' && kind != '6') || !readPnmNumber(in, image.width) || !readPnmNumber(in, image.height) ||
+        !readPnmNumber(in, maxval) || maxval == 0 || maxval > 65535)
+        return false;
+    if (image.width == 0 || image.height == 0 || image.width > MAX_DECODE_DIMENSION || image.height > MAX_DECODE_DIMENSION)
+        return false;
+    image.channels = kind == '6' ? 3 : 1;
+    size_t samples = size_t(image.width) * image.height * image.channels;
+    if (maxval < 256)
+    {
+        image.pixels.resize(samples);
+        if (fread(image.pixels.data(), 1, samples, in) != samples)
+            return false;
+        if (maxval != 255) // Stretch other depths to the full 8-bit range.
+            for (unsigned char &v : image.pixels)
+            {
+                if (v > maxval)
+                    return false; // Corrupt: scaling it would wrap around to an arbitrary level.
+                v = static_cast<unsigned char>((v * 255u + maxval / 2) / maxval);
+            }
+        return true;
+    }
+    // 16-bit samples are stored big-endian; they are scaled down to 8 bits.
+    std::vector<unsigned char> wide(samples * 2);
+    if (fread(wide.data(), 1, wide.size(), in) != wide.size())
+        return false;
+    image.pixels.resize(samples);
+    for (size_t i = 0; i < samples; i++)
+    {
+        uint32_t v = (uint32_t(wide[2 * i]) << 8) | wide[2 * i + 1];
+        if (v > maxval)
+            return false; // Corrupt, as above.
+        image.pixels[i] = static_cast<unsigned char>((uint64_t(v) * 255 + maxval / 2) / maxval);
+    }
+    return true;
+}
+
+// Function to read headerless raw pixels whose size is given by the caller
+inline bool readRaw(FILE *in, uint32_t width, uint32_t height, int channels, Image &image)
+{
+    if (width == 0 || height == 0 || width > MAX_DECODE_DIMENSION || height > MAX_DECODE_DIMENSION)
+        return false;
+    image.width = width;
+    image.height = height;
+    image.channels = channels;
+    image.pixels.resize(size_t(width) * height * channels);
+    return fread(image.pixels.data(), 1, image.pixels.size(), in) == image.pixels.size();
+}
+
+// Function to read a headerless raw file of 'width' x 'height' pixels of 'bytesPerPixel' bytes, kept exactly as stored
+// (for pixel formats the caller passes on without decoding, such as BGRA or 16-bit RGB)
+inline bool readRawFile(const std::string &path, uint32_t width, uint32_t height, int bytesPerPixel, Image &image)
+{
+    FILE *in = fopen(path.c_str(), "rb");
+    if (!in)
+        return false;
+    bool ok = readRaw(in, width, height, bytesPerPixel, image);
+    fclose(in);
+    return ok;
+}
+
+// Function to write 8-bit pixels as a binary PGM (1 channel) or PPM (3 channels)
+inline bool writePnm(FILE *out, const unsigned char *pixels, uint32_t width, uint32_t height, int channels)
+{
+    size_t bytes = size_t(width) * height * channels;
+    return fprintf(out, "P%c\n%u %u\n255\n", channels == 3 ? '6' : '5', width, height) > 0 &&
+           fwrite(pixels, 1, bytes, out) == bytes;
+}
+
+// Function to expand a gray image to RGB in place (RGB images are left alone)
+inline void convertToRgb(Image &image)
+{
+    if (image.channels != 1)
+        return;
+    size_t pixels = size_t(image.width) * image.height;
+    image.pixels.resize(pixels * 3);
+    for (size_t i = pixels; i-- > 0;) // Back to front, so no source byte is overwritten before it is read.
+    {
+        unsigned char v = image.pixels[i];
+        image.pixels[3 * i] = image.pixels[3 * i + 1] = image.pixels[3 * i + 2] = v;
+    }
+    image.channels = 3;
+}
+
+// Function to work out the output size of an ImageMagick-style geometry "WxH" (fit inside, keeping the aspect
+// ratio) or "WxH!" (exactly that size); returns false if the geometry cannot be parsed
+inline bool fitGeometry(const std::string &geometry, uint32_t width, uint32_t height, uint32_t &outWidth, uint32_t &outHeight)
+{
+    unsigned long w = 0, h = 0;
+    char bang = 0;
+    int fields = sscanf(geometry.c_str(), "%lux%lu%c", &w, &h, &bang);
+    if (fields < 2 || w == 0 || h == 0 || w > MAX_DECODE_DIMENSION || h > MAX_DECODE_DIMENSION || (fields == 3 && bang != '!'))
+        return false;
+    if (fields == 3)
+    {
+        outWidth = static_cast<uint32_t>(w);
+        outHeight = static_cast<uint32_t>(h);
+        return true;
+    }
+    double scale = std::min(double(w) / width, double(h) / height); // The dimension that limits the size wins.
+    outWidth = std::max<uint32_t>(1, static_cast<uint32_t>(std::lround(width * scale)));
+    outHeight = std::max<uint32_t>(1, static_cast<uint32_t>(std::lround(height * scale)));
+    return true;
+}
+
+// Filter taps along one axis: output position i blends 'taps' source positions starting at first[i].
+struct ResampleTaps
+{
+    size_t taps = 0;                // Source positions per output position.
+    std::vector<uint32_t> first;    // First source position of each output position.
+    std::vector<int32_t> weights;   // taps weights per output position, in 1/65536 units, summing to 65536.
+};
+
+// Function to compute the taps of a triangle (tent) filter from 'source' to 'target' positions.
+// When shrinking, the tent is widened to cover every source pixel, so the result is averaged rather than aliased.
+inline ResampleTaps computeResampleTaps(uint32_t source, uint32_t target)
+{
+    ResampleTaps result;
+    double scale = double(source) / target;            // Source pixels per output pixel.
+    double support = std::max(1.0, scale);             // Radius of the tent in source pixels.
+    result.taps = std::min<size_t>(source, size_t(std::ceil(support * 2)) + 1);
+    result.first.resize(target);
+    result.weights.assign(size_t(target) * result.taps, 0);
+    std::vector<double> w(result.taps);
+    for (uint32_t i = 0; i < target; i++)
+    {
+        double center = (i + 0.5) * scale - 0.5;       // Output pixel center in source coordinates.
+        long start = std::lround(std::ceil(center - support));
+        start = std::max(0L, std::min(start, long(source) - long(result.taps))); // Keep the window inside the image.
+        double total = 0;
+        for (size_t k = 0; k < result.taps; k++)
+        {
+            w[k] = std::max(0.0, 1.0 - std::fabs(start + long(k) - center) / support);
+            total += w[k];
+        }
+        int32_t assigned = 0;
+        size_t heaviest = 0;
+        for (size_t k = 0; k < result.taps; k++)
+        {
+            int32_t fixed = total > 0 ? int32_t(std::lround(w[k] / total * 65536)) : 0;
+            result.weights[i * result.taps + k] = fixed;
+            assigned += fixed;
+            if (w[k] > w[heaviest])
+                heaviest = k;
+        }
+        result.weights[i * result.taps + heaviest] += 65536 - assigned; // Rounding leftovers keep flat areas exact.
+        result.first[i] = static_cast<uint32_t>(start);
+    }
+    return result;
+}
+
+// Function to resize an image with a separable tent filter (rows first, then columns), in fixed-point arithmetic
+inline Image resizeImage(const Image &source, uint32_t width, uint32_t height)
+{
+    const int c = source.channels;
+    ResampleTaps horizontal = computeResampleTaps(source.width, width);
+    ResampleTaps vertical = computeResampleTaps(source.height, height);
+
+    // Pass 1: resize every row to the new width.
+    std::vector<unsigned char> rows(size_t(width) * source.height * c);
+    for (uint32_t y = 0; y < source.height; y++)
+    {
+        const unsigned char *in = source.pixels.data() + size_t(y) * source.width * c;
+        unsigned char *out = rows.data() + size_t(y) * width * c;
+        for (uint32_t x = 0; x < width; x++)
+        {
+            const int32_t *w = horizontal.weights.data() + size_t(x) * horizontal.taps;
+            const unsigned char *src = in + size_t(horizontal.first[x]) * c;
+            for (int ch = 0; ch < c; ch++)
+            {
+                int64_t sum = 0;
+                for (size_t k = 0; k < horizontal.taps; k++)
+                    sum += int64_t(w[k]) * src[k * c + ch];
+                out[size_t(x) * c + ch] = static_cast<unsigned char>(std::min<int64_t>(255, std::max<int64_t>(0, (sum + 32768) >> 16)));
+            }
+        }
+    }
+
+    // Pass 2: blend rows into the new height, a whole row at a time so the inner loop walks memory in order.
+    Image result;
+    result.width = width;
+    result.height = height;
+    result.channels = c;
+    result.pixels.resize(size_t(width) * height * c);
+    size_t rowBytes = size_t(width) * c;
+    std::vector<int64_t> sums(rowBytes);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        const int32_t *w = vertical.weights.data() + size_t(y) * vertical.taps;
+        std::fill(sums.begin(), sums.end(), 0);
+        for (size_t k = 0; k < vertical.taps; k++)
+        {
+            if (w[k] == 0)
+                continue;
+            const unsigned char *src = rows.data() + (size_t(vertical.first[y]) + k) * rowBytes;
+            for (size_t i = 0; i < rowBytes; i++)
+                sums[i] += int64_t(w[k]) * src[i];
+        }
+        unsigned char *out = result.pixels.data() + size_t(y) * rowBytes;
+        for (size_t i = 0; i < rowBytes; i++)
+            out[i] = static_cast<unsigned char>(std::min<int64_t>(255, std::max<int64_t>(0, (sums[i] + 32768) >> 16)));
+    }
+    return result;
+}
+
+// Function to check whether 'path' ends with 'extension' (case-insensitive, extension given in lower case)
+inline bool hasExtension(const std::string &path, const char *extension)
+{
+    size_t n = strlen(extension);
+    if (path.size() < n)
+        return false;
+    for (size_t i = 0; i < n; i++)
+        if (tolower(static_cast<unsigned char>(path[path.size() - n + i])) != extension[i])
+            return false;
+    return true;
+}
+
+// Function to quote a path for the shell used by popen()
+inline std::string shellQuote(const std::string &text)
+{
+    std::string quoted = "'";
+    for (char ch : text)
+        quoted += ch == '\'' ? std::string("'\\''") : std::string(1, ch);
+    return quoted + "'";
+}
+
+// Function to read an image file. PNM files are recognised by their contents and decoded here; with 'rawWidth' and
+// 'rawHeight' set, the file is read as raw RGB (or raw gray for ".gray"). Anything else is decoded by ImageMagick,
+// which writes a PPM into a pipe, unless 'allowFallback' is false.
+inline bool readImageFile(const std::string &path, uint32_t rawWidth, uint32_t rawHeight, bool allowFallback, Image &image)
+{
+    FILE *in = fopen(path.c_str(), "rb");
+    if (!in)
+        return false;
+    if (rawWidth > 0 && rawHeight > 0)
+    {
+        bool ok = readRaw(in, rawWidth, rawHeight, hasExtension(path, ".gray") ? 1 : 3, image);
+        fclose(in);
+        return ok;
+    }
+    int first = getc(in), second = getc(in); // PNM files start with "P5" or "P6".
+    if (first == 'P' && (second == '5' || second == '6'))
+    {
+        rewind(in);
+        bool ok = readPnm(in, image);
+        fclose(in);
+        return ok;
+    }
+    fclose(in);
+    if (!allowFallback)
+        return false;
+    std::string command = "magick " + shellQuote(path) + " -depth 8 -colorspace sRGB ppm:-";
+    FILE *pipe = popen(command.c_str(), "r");
+    if (!pipe)
+        return false;
+    bool ok = readPnm(pipe, image);
+    return pclose(pipe) == 0 && ok;
+}
+
+// Function to write an image file: ".pgm"/".ppm"/".pnm" are encoded here and ".raw"/".bin"/".gray"/".rgb" are
+// written as bare pixels. Other extensions are encoded by ImageMagick from a PNM written into a pipe, unless
+// 'allowFallback' is false.
+inline bool writeImageFile(const std::string &path, const unsigned char *pixels, uint32_t width, uint32_t height, int channels,
+                           bool allowFallback)
+{
+    bool pnm = hasExtension(path, ".pgm") || hasExtension(path, ".ppm") || hasExtension(path, ".pnm");
+    bool raw = hasExtension(path, ".raw") || hasExtension(path, ".bin") || hasExtension(path, ".gray") || hasExtension(path, ".rgb");
+    if (pnm || raw)
+    {
+        FILE *out = fopen(path.c_str(), "wb");
+        if (!out)
+            return false;
+        size_t bytes = size_t(width) * height * channels;
+        bool ok = pnm ? writePnm(out, pixels, width, height, channels) : fwrite(pixels, 1, bytes, out) == bytes;
+        return fclose(out) == 0 && ok;
+    }
+    if (!allowFallback)
+        return false;
+    std::string command = "magick pnm:- " + shellQuote(path);
+    FILE *pipe = popen(command.c_str(), "w");
+    if (!pipe)
+        return false;
+    bool ok = writePnm(pipe, pixels, width, height, channels);
+    return pclose(pipe) == 0 && ok;
+}
+
+#endif // IMAGE_IO_H
@@ -0,0 +1,147 @@
+#ifndef INTENSITY_H
+#define INTENSITY_H
+
+#include <arpa/inet.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "protocol.h"
+
+// Intensity-range bucketing (REQUEST_FLAG_INTENSITY_BUCKETS) as a counting sort over the 256 gray levels.
+//
+// The image is cut into parts that are processed independently, so the work spreads over the worker pool:
+//   1. count:   every part builds the histogram of its own pixels (one pass, no sharing between parts),
+//   2. prefix:  the part histograms are summed into the result and turned into a write cursor per part and bucket
+//               (256 x parts additions, negligible),
+//   3. scatter: every part writes the indices of its pixels to its cursors, so the parts never write the same slot.
+// Parts are scattered in image order and each part writes its pixels in order, so every bucket lists its pixel
+// indices in ascending order whatever the number of parts. See protocol.h for the layout of the result.
+
+// Histogram of one part, on its own cache lines so parts counted by different workers do not share any.
+struct alignas(64) IntensityHistogram
+{
+    uint32_t counts[INTENSITY_LEVELS] = {};
+};
+
+// Function to fill in the default thresholds: 'buckets' ranges of (nearly) equal width, like bucketRange()
+inline void defaultIntensityThresholds(uint32_t buckets, unsigned char *thresholds)
+{
+    for (uint32_t b = 1; b < buckets; b++)
+        thresholds[b - 1] = static_cast<unsigned char>(INTENSITY_LEVELS * b / buckets);
+}
+
+// Function to check the 'buckets' - 1 thresholds of a request: each one above the previous (and above 0)
+inline bool validIntensityThresholds(const unsigned char *thresholds, uint32_t buckets)
+{
+    for (uint32_t b = 1; b < buckets; b++)
+        if (thresholds[b - 1] <= (b > 1 ? thresholds[b - 2] : 0))
+            return false;
+    return true;
+}
+
+// Function to map every gray level to its bucket
+inline void intensityBucketMap(const unsigned char *thresholds, uint32_t buckets, unsigned char *map)
+{
+    uint32_t bucket = 0;
+    for (int level = 0; level < INTENSITY_LEVELS; level++)
+    {
+        while (bucket + 1 < buckets && level >= thresholds[bucket])
+            bucket++; // 'level' has reached the lower bound of the next bucket.
+        map[level] = static_cast<unsigned char>(bucket);
+    }
+}
+
+// Function to add the gray levels of 'pixels' pixels to a histogram.
+// Eight pixels are loaded per step and spread over four sub-histograms, so consecutive pixels of the same level
+// (common in real images) do not wait on each other's increments.
+inline void countIntensities(const unsigned char *gray, size_t pixels, IntensityHistogram &histogram)
+{
+    uint32_t sub[4][INTENSITY_LEVELS] = {};
+    size_t i = 0;
+    for (; i + 8 <= pixels; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, gray + i, sizeof(word)); // One load for eight pixels.
+        sub[0][word & 0xff]++;
+        sub[1][(word >> 8) & 0xff]++;
+        sub[2][(word >> 16) & 0xff]++;
+        sub[3][(word >> 24) & 0xff]++;
+        sub[0][(word >> 32) & 0xff]++;
+        sub[1][(word >> 40) & 0xff]++;
+        sub[2][(word >> 48) & 0xff]++;
+        sub[3][word >> 56]++;
+    }
+    for (; i < pixels; i++)
+        sub[0][gray[i]]++;
+    for (int level = 0; level < INTENSITY_LEVELS; level++)
+        histogram.counts[level] += sub[0][level] + sub[1][level] + sub[2][level] + sub[3][level];
+}
+
+// Function to write the histogram and bucket table of the result from the histograms of its parts, and to set
+// cursors[part * buckets + b] to the slot of the index list where part 'part' writes its first pixel of bucket b
+inline void prefixIntensityParts(const std::vector<IntensityHistogram> &parts, const unsigned char *map, uint32_t buckets,
+                                 std::vector<uint32_t> &cursors, unsigned char *result)
+{
+    std::vector<uint32_t> counts(buckets, 0);
+    cursors.assign(parts.size() * buckets, 0);
+    for (int level = 0; level < INTENSITY_LEVELS; level++)
+    {
+        uint32_t total = 0; // Pixels of this level in the whole image.
+        for (size_t part = 0; part < parts.size(); part++)
+        {
+            cursors[part * buckets + map[level]] += parts[part].counts[level]; // For now: pixels per part and bucket.
+            total += parts[part].counts[level];
+        }
+        counts[map[level]] += total;
+        putBigEndian(result + 4 * level, total, 4);
+    }
+    uint32_t offset = 0; // Exclusive prefix sum over the buckets, then over the parts within each bucket.
+    unsigned char *table = result + 4 * INTENSITY_LEVELS;
+    for (uint32_t b = 0; b < buckets; b++)
+    {
+        putBigEndian(table + 8 * b, counts[b], 4);
+        putBigEndian(table + 8 * b + 4, offset, 4);
+        for (size_t part = 0; part < parts.size(); part++)
+        {
+            uint32_t pixels = cursors[part * buckets + b];
+            cursors[part * buckets + b] = offset;
+            offset += pixels;
+        }
+    }
+}
+
+// Function to write the index of every pixel of a part (pixels [first, first + pixels) of the image) to the next
+// slot of its bucket; 'cursors' are the part's cursors from prefixIntensityParts() and advance as slots are used
+inline void scatterIntensityIndices(const unsigned char *gray, uint64_t first, size_t pixels, const unsigned char *map,
+                                    uint32_t *cursors, unsigned char *indices)
+{
+    for (size_t i = 0; i < pixels; i++)
+    {
+        uint32_t index = htonl(static_cast<uint32_t>(first + i)); // Network byte order, like every other field.
+        memcpy(indices + 4 * size_t(cursors[map[gray[first + i]]]++), &index, sizeof(index));
+    }
+}
+
+// Function to return where the index list starts in an intensity result
+inline size_t intensityIndexOffset(uint32_t buckets)
+{
+    return 4 * (INTENSITY_LEVELS + 2 * size_t(buckets));
+}
+
+// Function to bucket a whole gray image by intensity in one part (on the calling thread), into 'result', which
+// must hold intensityResultSize(pixels, buckets) bytes
+inline void bucketByIntensity(const unsigned char *gray, size_t pixels, const unsigned char *thresholds, uint32_t buckets,
+                              unsigned char *result)
+{
+    unsigned char map[INTENSITY_LEVELS];
+    intensityBucketMap(thresholds, buckets, map);
+    std::vector<IntensityHistogram> parts(1);
+    countIntensities(gray, pixels, parts[0]);
+    std::vector<uint32_t> cursors;
+    prefixIntensityParts(parts, map, buckets, cursors, result);
+    scatterIntensityIndices(gray, 0, pixels, map, cursors.data(), result + intensityIndexOffset(buckets));
+}
+
+#endif // INTENSITY_H
@@ -0,0 +1,131 @@
+#ifndef LUMA_H
+#define LUMA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "grayscale.h"
+#include "protocol.h"
+
+// Conversion of every PixelFormat to 8-bit gray, as the plain average of R, G and B or as BT.601 / BT.709 luma.
+//
+// Each pair of format and weighting is its own instantiation of convertLuma(): the channel positions, the bit depth
+// and the fixed-point coefficients are compile-time constants, so every pair compiles to a loop of loads, multiplies
+// and adds with no branch per pixel. lumaKernel() picks the instantiation once per request. The average of 8-bit RGB
+// or BGR uses the SIMD kernels of grayscale.h instead, since the sum does not depend on the channel order.
+//
+// 16-bit channels are reduced to 8 bits by dropping the low byte of the result, so they give the same gray as their
+// high bytes would, up to the rounding of the weighted sum.
+
+// How the channels are weighted.
+enum LumaWeighting
+{
+    LUMA_AVERAGE,   // (R + G + B) / 3, rounded down: the server's original conversion.
+    LUMA_BT601,     // 0.299 R + 0.587 G + 0.114 B, rounded to nearest (SDTV, JPEG).
+    LUMA_BT709,     // 0.2126 R + 0.7152 G + 0.0722 B, rounded to nearest (HDTV, sRGB).
+    LUMA_WEIGHTINGS
+};
+
+// Layout of a pixel format: bytes per pixel and channel, and the byte offset of each color channel.
+template <int Channels, int Depth, int Red, int Green, int Blue>
+struct PixelLayout
+{
+    static constexpr int DEPTH = Depth;                       // Bits per channel (8 or 16).
+    static constexpr int CHANNEL_BYTES = Depth / 8;           // Bytes per channel.
+    static constexpr int PIXEL_BYTES = Channels * CHANNEL_BYTES; // Bytes per pixel; alpha is skipped over.
+    static constexpr int RED = Red * CHANNEL_BYTES;           // Offset of the red channel within a pixel.
+    static constexpr int GREEN = Green * CHANNEL_BYTES;       // Offset of the green channel.
+    static constexpr int BLUE = Blue * CHANNEL_BYTES;         // Offset of the blue channel.
+
+    // Function to read the channel at 'offset' of a pixel (16-bit channels are big-endian)
+    static unsigned channel(const unsigned char *pixel, int offset)
+    {
+        return Depth == 8 ? pixel[offset] : (unsigned(pixel[offset]) << 8) | pixel[offset + 1];
+    }
+};
+
+typedef PixelLayout<3, 8, 0, 1, 2> LayoutRgb8;
+typedef PixelLayout<3, 8, 2, 1, 0> LayoutBgr8;
+typedef PixelLayout<4, 8, 0, 1, 2> LayoutRgba8;
+typedef PixelLayout<4, 8, 2, 1, 0> LayoutBgra8;
+typedef PixelLayout<3, 16, 0, 1, 2> LayoutRgb16;
+typedef PixelLayout<4, 16, 0, 1, 2> LayoutRgba16;
+
+// Weights of R, G and B in parts per 10000, indexed by LumaWeighting (the average is handled apart).
+constexpr int LUMA_WEIGHTS[LUMA_WEIGHTINGS][3] = {{0, 0, 0}, {2990, 5870, 1140}, {2126, 7152, 722}};
+
+// Fixed-point coefficients for channels of 'Depth' bits: gray = (r * RED + g * GREEN + b * BLUE + ROUNDING) >> SHIFT.
+// ONE is the fixed-point 1.0 scaled down by the bits dropped from 16-bit channels.
+// - The average uses ceil(ONE / 3) for every channel without rounding, which is exact: (r + g + b) / 3 for 8-bit
+//   channels (the same multiplier as GRAY_RECIPROCAL_3) and (r + g + b) / 768 for 16-bit ones.
+// - BT.601 and BT.709 round red and blue, and give green the rest, so the weights add up to exactly ONE and white stays
+//   white. Rounding adds half a unit of the input, so 16-bit white (65535) still ends up as 255.
+// 8-bit channels fit in 32-bit sums (255 * 2^16 + 2^15 < 2^32); 16-bit channels need 64 bits.
+template <LumaWeighting Weighting, int Depth>
+struct LumaCoefficients
+{
+    typedef typename std::conditional<Depth == 8, uint32_t, uint64_t>::type Accumulator;
+    static constexpr int SHIFT = 2 * Depth;                                   // 16 or 32 fraction bits.
+    static constexpr Accumulator ONE = Accumulator(1) << (SHIFT - (Depth - 8)); // 1.0 in the output's 8 bits.
+    static constexpr Accumulator weight(int channel)
+    {
+        return Weighting == LUMA_AVERAGE ? (ONE + 2) / 3 : (ONE * LUMA_WEIGHTS[Weighting][channel] + 5000) / 10000;
+    }
+    static constexpr Accumulator RED = weight(0);
+    static constexpr Accumulator BLUE = weight(2);
+    static constexpr Accumulator GREEN = Weighting == LUMA_AVERAGE ? weight(1) : ONE - RED - BLUE;
+    static constexpr Accumulator ROUNDING = Weighting == LUMA_AVERAGE ? 0 : ONE / 2;
+};
+
+// Generic kernel: converts 'pixels' pixels of 'Layout' to gray with 'Weighting'. Has the GrayscaleKernel signature.
+template <class Layout, LumaWeighting Weighting>
+inline void convertLuma(const unsigned char *in, unsigned char *gray, size_t pixels)
+{
+    typedef LumaCoefficients<Weighting, Layout::DEPTH> Weights;
+    typedef typename Weights::Accumulator Accumulator;
+    for (size_t i = 0; i < pixels; i++, in += Layout::PIXEL_BYTES)
+    {
+        Accumulator r = Layout::channel(in, Layout::RED);
+        Accumulator g = Layout::channel(in, Layout::GREEN);
+        Accumulator b = Layout::channel(in, Layout::BLUE);
+        gray[i] = static_cast<unsigned char>((r * Weights::RED + g * Weights::GREEN + b * Weights::BLUE + Weights::ROUNDING) >>
+                                             Weights::SHIFT);
+    }
+}
+
+// Function to return the weighting asked for by the request flags
+inline LumaWeighting requestLumaWeighting(uint32_t flags)
+{
+    if (flags & REQUEST_FLAG_LUMA_BT601)
+        return LUMA_BT601;
+    return (flags & REQUEST_FLAG_LUMA_BT709) ? LUMA_BT709 : LUMA_AVERAGE;
+}
+
+// Function to pick the kernel for a pixel format and weighting (null for an unknown format); called once per request
+inline GrayscaleKernel lumaKernel(uint16_t pixelFormat, LumaWeighting weighting)
+{
+    // Kernels per PixelFormat (from PIXEL_FORMAT_RGB8 on) and weighting.
+    static const GrayscaleKernel kernels[][LUMA_WEIGHTINGS] = {
+        {convertLuma<LayoutRgb8, LUMA_AVERAGE>, convertLuma<LayoutRgb8, LUMA_BT601>, convertLuma<LayoutRgb8, LUMA_BT709>},
+        {convertLuma<LayoutBgr8, LUMA_AVERAGE>, convertLuma<LayoutBgr8, LUMA_BT601>, convertLuma<LayoutBgr8, LUMA_BT709>},
+        {convertLuma<LayoutRgba8, LUMA_AVERAGE>, convertLuma<LayoutRgba8, LUMA_BT601>, convertLuma<LayoutRgba8, LUMA_BT709>},
+        {convertLuma<LayoutBgra8, LUMA_AVERAGE>, convertLuma<LayoutBgra8, LUMA_BT601>, convertLuma<LayoutBgra8, LUMA_BT709>},
+        {convertLuma<LayoutRgb16, LUMA_AVERAGE>, convertLuma<LayoutRgb16, LUMA_BT601>, convertLuma<LayoutRgb16, LUMA_BT709>},
+        {convertLuma<LayoutRgba16, LUMA_AVERAGE>, convertLuma<LayoutRgba16, LUMA_BT601>, convertLuma<LayoutRgba16, LUMA_BT709>},
+    };
+    if (weighting == LUMA_AVERAGE && (pixelFormat == PIXEL_FORMAT_RGB8 || pixelFormat == PIXEL_FORMAT_BGR8))
+        return activeGrayscaleKernel()->kernel; // The vector kernels: the average does not care about the channel order.
+    size_t index = size_t(pixelFormat) - PIXEL_FORMAT_RGB8;
+    if (pixelFormat < PIXEL_FORMAT_RGB8 || index >= sizeof(kernels) / sizeof(kernels[0]) || weighting >= LUMA_WEIGHTINGS)
+        return nullptr;
+    return kernels[index][weighting];
+}
+
+// Function to pick the kernel a request needs (its validated header names a known format)
+inline GrayscaleKernel requestLumaKernel(const RequestHeader &request)
+{
+    return lumaKernel(request.pixelFormat, requestLumaWeighting(request.flags));
+}
+
+#endif // LUMA_H
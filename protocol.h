@@ -0,0 +1,465 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "compression.h"
+
+// Wire protocol shared by the client and the server.
+//
+// Every request starts with a fixed 48-byte header followed by 'payloadLength' bytes of pixel data.
+// Every response starts with a 48-byte header followed by the grayscale buckets, back to back.
+// All header fields are unsigned integers in network byte order (big-endian).
+//
+// A request may carry only a shard of the image: the buckets [firstBucket, firstBucket + bucketCount) of a
+// width x height image split into 'buckets' buckets. The payload then holds just the pixels of those buckets,
+// and the response holds just their gray bytes. A whole image is the shard firstBucket = 0, bucketCount = buckets.
+//
+// A connection normally carries one request. With REQUEST_FLAG_KEEP_ALIVE it stays open as a session: the client
+// may send further requests without waiting for the responses (pipelining), and the server answers each one as
+// soon as it is done, so responses can arrive in a different order. The response echoes the request ID, which is
+// how the client matches them up. The IDs are chosen by the client; the server does not interpret them.
+//
+// With REQUEST_FLAG_HASH_ONLY the payload is just the content hash of the pixels (see content_hash.h) instead of
+// the pixels themselves. If the server has the result cached, it answers as usual; otherwise it answers
+// STATUS_NOT_CACHED and keeps the session open, and the client uploads the image in a normal request.
+//
+// With REQUEST_FLAG_INTENSITY_BUCKETS the buckets are intensity ranges instead of slices of the image: pixel i goes
+// into bucket b if its gray value lies in [threshold[b], threshold[b + 1]), with threshold[0] = 0 and an implicit
+// threshold[buckets] = 256. The request carries the whole image, followed by the buckets - 1 thresholds 1..buckets-1
+// (one byte each, strictly increasing). The response carries, as u32 values in network byte order:
+//   - the 256-bin histogram of the gray image,
+//   - a count and an offset per bucket (where its pixels start in the index list),
+//   - the index list: the pixel indices (y * width + x) of bucket 0, then bucket 1, ..., each in ascending order.
+// It carries no gray bytes. Intensity requests cannot be streamed.
+//
+// Pixel payloads can travel compressed (see compression.h). With REQUEST_FLAG_COMPRESSED the request payload is the
+// compressed RGB pixels and 'payloadLength' is its compressed size. With REQUEST_FLAG_ACCEPT_COMPRESSED the client
+// offers to take a compressed response; the server decides, and sets RESPONSE_FLAG_COMPRESSED when it did compress.
+// The compressed gray bytes of all buckets then follow the header as one stream, and 'payloadLength' is its size.
+// A server that does not want compressed uploads answers STATUS_UNSUPPORTED_FLAGS. Neither direction can be combined
+// with streaming, and intensity results are never compressed.
+//
+// The pixels may come in any PixelFormat: 8 or 16 bits per channel, RGB or BGR order, with or without an alpha
+// channel (which is ignored). 16-bit channels are big-endian, as in 16-bit PPM files. The gray value is the plain
+// average of R, G and B unless REQUEST_FLAG_LUMA_BT601 or REQUEST_FLAG_LUMA_BT709 asks for weighted luma (see luma.h).
+//
+// On the same host, a client can connect to the server's Unix domain socket and send REQUEST_FLAG_SHARED_MEMORY
+// requests (see shared_memory.h). Two descriptors travel with the header (SCM_RIGHTS): a memory file holding the
+// pixels, and one of at least the response payload length for the gray bytes. 'payloadLength' is the size of the
+// pixels in the first file, but no payload follows the header. The server converts straight from one file into the
+// other and answers with RESPONSE_FLAG_SHARED_MEMORY and a header alone. Shared-memory requests are positional and
+// uncompressed, are not streamed and carry no hash; over TCP they are answered STATUS_UNSUPPORTED_FLAGS.
+//
+//   offset  request            response
+//   0       magic   (u32)      magic   (u32)
+//   4       version (u16)      version (u16)
+//   6       format  (u16)      status  (u16)
+//   8       width   (u32)      width   (u32)
+//   12      height  (u32)      height  (u32)
+//   16      buckets (u32)      buckets (u32)
+//   20      flags   (u32)      flags   (u32)
+//   24      payload length (u64, bytes following the header)
+//   32      first bucket (u32, first bucket carried by this message)
+//   36      bucket count (u32, buckets carried by this message)
+//   40      request ID (u64, chosen by the client, echoed in the response)
+
+// Network and protocol constants
+const int DEFAULT_PORT = 55000;                  // Default port the server listens on.
+const uint32_t PROTOCOL_MAGIC = 0x47524159;      // "GRAY": marks the start of every header.
+const uint16_t PROTOCOL_VERSION = 3;             // Incremented whenever the header layout changes.
+const size_t HEADER_SIZE = 48;                   // Size of a request or response header in bytes.
+const uint32_t DEFAULT_BUCKETS = 8;              // Number of buckets when the client does not ask for another count.
+const size_t CONTENT_HASH_SIZE = 8;              // Payload of a hash-only request: the content hash of the pixels (u64).
+
+// Hard limits: a header outside them is rejected before any buffer is allocated.
+// The largest accepted request is MAX_IMAGE_PIXELS * 8 bytes = 512 MiB of 16-bit RGBA data (192 MiB of 8-bit RGB).
+const uint32_t MAX_IMAGE_DIMENSION = 16384;      // Maximum width or height in pixels.
+const uint64_t MAX_IMAGE_PIXELS = 64ull << 20;   // Maximum width x height (64 megapixels).
+const uint32_t MAX_BUCKETS = 4096;               // Maximum number of buckets per image.
+const uint32_t MAX_INTENSITY_BUCKETS = 256;      // Maximum number of intensity ranges (one per gray level).
+const int INTENSITY_LEVELS = 256;                // Gray levels, and bins of the histogram in an intensity response.
+
+// Pixel formats the payload can be encoded in.
+enum PixelFormat : uint16_t
+{
+    PIXEL_FORMAT_RGB8 = 1,   // Interleaved 8-bit R, G, B.
+    PIXEL_FORMAT_BGR8 = 2,   // Interleaved 8-bit B, G, R.
+    PIXEL_FORMAT_RGBA8 = 3,  // Interleaved 8-bit R, G, B, A.
+    PIXEL_FORMAT_BGRA8 = 4,  // Interleaved 8-bit B, G, R, A.
+    PIXEL_FORMAT_RGB16 = 5,  // Interleaved 16-bit R, G, B (big-endian).
+    PIXEL_FORMAT_RGBA16 = 6, // Interleaved 16-bit R, G, B, A (big-endian).
+};
+
+// Request flags (bit mask in the request header).
+enum RequestFlags : uint32_t
+{
+    REQUEST_FLAG_STREAMING = 1u << 0,   // Convert each band of rows as it arrives and stream the gray bytes back right away.
+    REQUEST_FLAG_KEEP_ALIVE = 1u << 1,  // Keep the connection open for further (possibly pipelined) requests.
+    REQUEST_FLAG_HASH_ONLY = 1u << 2,   // The payload is the content hash of the pixels; answered from the server's cache.
+    REQUEST_FLAG_INTENSITY_BUCKETS = 1u << 3, // Bucket the pixels by intensity range instead of by position.
+    REQUEST_FLAG_COMPRESSED = 1u << 4,  // The pixels are compressed; 'payloadLength' is the compressed size.
+    REQUEST_FLAG_ACCEPT_COMPRESSED = 1u << 5, // The client can decode a compressed response.
+    REQUEST_FLAG_LUMA_BT601 = 1u << 6,  // Gray is BT.601 luma (0.299 R + 0.587 G + 0.114 B) instead of the average.
+    REQUEST_FLAG_LUMA_BT709 = 1u << 7,  // Gray is BT.709 luma (0.2126 R + 0.7152 G + 0.0722 B) instead of the average.
+    REQUEST_FLAG_SHARED_MEMORY = 1u << 8, // Pixels and gray bytes are in memory files passed with the header (Unix socket).
+};
+const uint32_t SUPPORTED_REQUEST_FLAGS = REQUEST_FLAG_STREAMING | REQUEST_FLAG_KEEP_ALIVE | REQUEST_FLAG_HASH_ONLY |
+                                         REQUEST_FLAG_INTENSITY_BUCKETS | REQUEST_FLAG_COMPRESSED |
+                                         REQUEST_FLAG_ACCEPT_COMPRESSED | REQUEST_FLAG_LUMA_BT601 |
+                                         REQUEST_FLAG_LUMA_BT709 | REQUEST_FLAG_SHARED_MEMORY; // Any other bit is rejected.
+
+// Response flags (bit mask in the response header).
+enum ResponseFlags : uint32_t
+{
+    RESPONSE_FLAG_COMPRESSED = 1u << 0, // The gray bytes are compressed; 'payloadLength' is the compressed size.
+    RESPONSE_FLAG_SHARED_MEMORY = 1u << 1, // The gray bytes are in the client's output file; none follow the header.
+};
+
+// Result of a request, reported in the response header.
+enum ResponseStatus : uint16_t
+{
+    STATUS_OK = 0,                  // Buckets follow the header.
+    STATUS_BAD_MAGIC = 1,           // The request did not start with PROTOCOL_MAGIC.
+    STATUS_UNSUPPORTED_VERSION = 2, // The server speaks a different protocol version.
+    STATUS_UNSUPPORTED_FORMAT = 3,  // Unknown pixel format.
+    STATUS_INVALID_DIMENSIONS = 4,  // Zero width/height, or a dimension above MAX_IMAGE_DIMENSION.
+    STATUS_IMAGE_TOO_LARGE = 5,     // More than MAX_IMAGE_PIXELS pixels.
+    STATUS_INVALID_BUCKETS = 6,     // Zero buckets, more than MAX_BUCKETS, more buckets than pixels, a shard outside them,
+                                    // or intensity thresholds that are not strictly increasing.
+    STATUS_LENGTH_MISMATCH = 7,     // Payload length does not match the pixels of the shard x bytes per pixel.
+    STATUS_UNSUPPORTED_FLAGS = 8,   // An unknown flag was set, streaming was combined with a session, a hash, intensity
+                                    // buckets or compression, both luma weightings were asked for, the server does
+                                    // not take compressed uploads, or shared memory was asked for over TCP or combined
+                                    // with streaming, a hash, intensity buckets or compression.
+    STATUS_NOT_CACHED = 9,          // Hash-only request for a result the server does not have; send the pixels instead.
+    STATUS_CORRUPT_PAYLOAD = 10,    // A compressed payload could not be decoded.
+    STATUS_BAD_SHARED_MEMORY = 11,  // The two memory files were missing, unsealed, too small, or could not be mapped.
+};
+
+// Header of a request sent by the client.
+struct RequestHeader
+{
+    uint32_t magic = PROTOCOL_MAGIC;         // Always PROTOCOL_MAGIC.
+    uint16_t version = PROTOCOL_VERSION;     // Protocol version of the sender.
+    uint16_t pixelFormat = PIXEL_FORMAT_RGB8; // Encoding of the payload (PixelFormat).
+    uint32_t width = 0;                      // Image width in pixels.
+    uint32_t height = 0;                     // Image height in pixels.
+    uint32_t buckets = DEFAULT_BUCKETS;      // Number of buckets the grayscale image is split into.
+    uint32_t flags = 0;                      // RequestFlags.
+    uint64_t payloadLength = 0;              // Bytes of pixel data following the header.
+    uint32_t firstBucket = 0;                // First bucket carried by this request.
+    uint32_t bucketCount = DEFAULT_BUCKETS;  // Number of buckets carried (equal to 'buckets' for a whole image).
+    uint64_t requestId = 0;                  // Identifies the request within its connection.
+};
+
+// Header of a response sent by the server.
+struct ResponseHeader
+{
+    uint32_t magic = PROTOCOL_MAGIC;         // Always PROTOCOL_MAGIC.
+    uint16_t version = PROTOCOL_VERSION;     // Protocol version of the sender.
+    uint16_t status = STATUS_OK;             // ResponseStatus of the request.
+    uint32_t width = 0;                      // Image width in pixels.
+    uint32_t height = 0;                     // Image height in pixels.
+    uint32_t buckets = 0;                    // Number of buckets that follow.
+    uint32_t flags = 0;                      // ResponseFlags.
+    uint64_t payloadLength = 0;              // Bytes of grayscale data following the header.
+    uint32_t firstBucket = 0;                // First bucket that follows (echoed from the request).
+    uint32_t bucketCount = 0;                // Number of buckets that follow.
+    uint64_t requestId = 0;                  // ID of the request this answers.
+};
+
+// Function to write an integer of 'bytes' bytes in big-endian order
+inline void putBigEndian(unsigned char *out, uint64_t value, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--)
+    {
+        out[i] = static_cast<unsigned char>(value); // Lowest remaining byte goes last.
+        value >>= 8;
+    }
+}
+
+// Function to read an integer of 'bytes' bytes stored in big-endian order
+inline uint64_t getBigEndian(const unsigned char *in, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value = (value << 8) | in[i]; // Most significant byte comes first.
+    return value;
+}
+
+// Function to serialize the fields shared by both header types into HEADER_SIZE bytes
+inline void encodeHeader(unsigned char *out, uint32_t magic, uint16_t version, uint16_t formatOrStatus, uint32_t width,
+                         uint32_t height, uint32_t buckets, uint32_t flags, uint64_t payloadLength, uint32_t firstBucket,
+                         uint32_t bucketCount, uint64_t requestId)
+{
+    putBigEndian(out, magic, 4);
+    putBigEndian(out + 4, version, 2);
+    putBigEndian(out + 6, formatOrStatus, 2);
+    putBigEndian(out + 8, width, 4);
+    putBigEndian(out + 12, height, 4);
+    putBigEndian(out + 16, buckets, 4);
+    putBigEndian(out + 20, flags, 4);
+    putBigEndian(out + 24, payloadLength, 8);
+    putBigEndian(out + 32, firstBucket, 4);
+    putBigEndian(out + 36, bucketCount, 4);
+    putBigEndian(out + 40, requestId, 8);
+}
+
+// Function to serialize a request header
+inline void encodeRequestHeader(const RequestHeader &header, unsigned char *out)
+{
+    encodeHeader(out, header.magic, header.version, header.pixelFormat, header.width, header.height, header.buckets,
+                 header.flags, header.payloadLength, header.firstBucket, header.bucketCount, header.requestId);
+}
+
+// Function to serialize a response header
+inline void encodeResponseHeader(const ResponseHeader &header, unsigned char *out)
+{
+    encodeHeader(out, header.magic, header.version, header.status, header.width, header.height, header.buckets,
+                 header.flags, header.payloadLength, header.firstBucket, header.bucketCount, header.requestId);
+}
+
+// Function to parse a request header from HEADER_SIZE bytes
+inline RequestHeader decodeRequestHeader(const unsigned char *in)
+{
+    RequestHeader header;
+    header.magic = static_cast<uint32_t>(getBigEndian(in, 4));
+    header.version = static_cast<uint16_t>(getBigEndian(in + 4, 2));
+    header.pixelFormat = static_cast<uint16_t>(getBigEndian(in + 6, 2));
+    header.width = static_cast<uint32_t>(getBigEndian(in + 8, 4));
+    header.height = static_cast<uint32_t>(getBigEndian(in + 12, 4));
+    header.buckets = static_cast<uint32_t>(getBigEndian(in + 16, 4));
+    header.flags = static_cast<uint32_t>(getBigEndian(in + 20, 4));
+    header.payloadLength = getBigEndian(in + 24, 8);
+    header.firstBucket = static_cast<uint32_t>(getBigEndian(in + 32, 4));
+    header.bucketCount = static_cast<uint32_t>(getBigEndian(in + 36, 4));
+    header.requestId = getBigEndian(in + 40, 8);
+    return header;
+}
+
+// Function to parse a response header from HEADER_SIZE bytes
+inline ResponseHeader decodeResponseHeader(const unsigned char *in)
+{
+    ResponseHeader header;
+    header.magic = static_cast<uint32_t>(getBigEndian(in, 4));
+    header.version = static_cast<uint16_t>(getBigEndian(in + 4, 2));
+    header.status = static_cast<uint16_t>(getBigEndian(in + 6, 2));
+    header.width = static_cast<uint32_t>(getBigEndian(in + 8, 4));
+    header.height = static_cast<uint32_t>(getBigEndian(in + 12, 4));
+    header.buckets = static_cast<uint32_t>(getBigEndian(in + 16, 4));
+    header.flags = static_cast<uint32_t>(getBigEndian(in + 20, 4));
+    header.payloadLength = getBigEndian(in + 24, 8);
+    header.firstBucket = static_cast<uint32_t>(getBigEndian(in + 32, 4));
+    header.bucketCount = static_cast<uint32_t>(getBigEndian(in + 36, 4));
+    header.requestId = getBigEndian(in + 40, 8);
+    return header;
+}
+
+// Function to compute where bucket 'index' starts in the grayscale image and how many bytes it holds.
+// Buckets are as equal as possible; when 'pixels' is not divisible by 'buckets', later buckets get the extra bytes.
+inline void bucketRange(uint64_t pixels, uint32_t buckets, uint32_t index, uint64_t &offset, uint64_t &length)
+{
+    offset = pixels * index / buckets; // First byte of this bucket.
+    length = pixels * (index + 1) / buckets - offset; // Up to the first byte of the next bucket.
+}
+
+// Function to compute which part of the grayscale image the buckets [firstBucket, firstBucket + bucketCount) cover
+inline void shardRange(uint64_t pixels, uint32_t buckets, uint32_t firstBucket, uint32_t bucketCount, uint64_t &offset,
+                       uint64_t &length)
+{
+    offset = pixels * firstBucket / buckets; // First byte of the first bucket.
+    length = pixels * (uint64_t(firstBucket) + bucketCount) / buckets - offset; // Up to the first byte after the last bucket.
+}
+
+// A bucket is a non-owning view into the single grayscale buffer: where it starts and how many bytes it holds.
+struct BucketView
+{
+    uint64_t offset; // First byte of the bucket in the grayscale image.
+    uint64_t length; // Number of bytes in the bucket.
+};
+
+// Function to describe all buckets of a grayscale image of 'pixels' bytes as views into that image
+inline std::vector<BucketView> partitionIntoBuckets(uint64_t pixels, uint32_t buckets)
+{
+    std::vector<BucketView> views(buckets);
+    for (uint32_t i = 0; i < buckets; i++)
+        bucketRange(pixels, buckets, i, views[i].offset, views[i].length);
+    return views;
+}
+
+// Function to describe the buckets of a shard as views into the shard's own gray bytes (the first view starts at 0)
+inline std::vector<BucketView> partitionShard(uint64_t pixels, uint32_t buckets, uint32_t firstBucket, uint32_t bucketCount)
+{
+    std::vector<BucketView> views(bucketCount);
+    uint64_t base = pixels * firstBucket / buckets; // Where the shard starts in the whole image.
+    for (uint32_t i = 0; i < bucketCount; i++)
+    {
+        bucketRange(pixels, buckets, firstBucket + i, views[i].offset, views[i].length);
+        views[i].offset -= base;
+    }
+    return views;
+}
+
+// Function to return the number of bytes one pixel occupies in the given format (0 if the format is unknown)
+inline int bytesPerPixel(uint16_t pixelFormat)
+{
+    switch (pixelFormat)
+    {
+    case PIXEL_FORMAT_RGB8:
+    case PIXEL_FORMAT_BGR8:
+        return 3;
+    case PIXEL_FORMAT_RGBA8:
+    case PIXEL_FORMAT_BGRA8:
+        return 4;
+    case PIXEL_FORMAT_RGB16:
+        return 6;
+    case PIXEL_FORMAT_RGBA16:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+// Function to return the command-line name of a pixel format (null if the format is unknown)
+inline const char *pixelFormatName(uint16_t pixelFormat)
+{
+    switch (pixelFormat)
+    {
+    case PIXEL_FORMAT_RGB8: return "rgb8";
+    case PIXEL_FORMAT_BGR8: return "bgr8";
+    case PIXEL_FORMAT_RGBA8: return "rgba8";
+    case PIXEL_FORMAT_BGRA8: return "bgra8";
+    case PIXEL_FORMAT_RGB16: return "rgb16";
+    case PIXEL_FORMAT_RGBA16: return "rgba16";
+    default: return nullptr;
+    }
+}
+
+// Function to look up a pixel format by its command-line name; false if there is none
+inline bool parsePixelFormat(const char *name, uint16_t &pixelFormat)
+{
+    for (uint16_t format = PIXEL_FORMAT_RGB8; pixelFormatName(format); format++)
+    {
+        if (strcmp(pixelFormatName(format), name) == 0)
+        {
+            pixelFormat = format;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to return the number of pixels a request carries: the shard's pixels, or the whole image in intensity mode
+inline uint64_t requestPixels(const RequestHeader &header)
+{
+    uint64_t offset, pixels;
+    shardRange(uint64_t(header.width) * header.height, header.buckets, header.firstBucket, header.bucketCount, offset, pixels);
+    return pixels;
+}
+
+// Function to return the size of an intensity response payload: histogram, bucket table and one index per pixel
+inline uint64_t intensityResultSize(uint64_t pixels, uint32_t buckets)
+{
+    return 4 * (INTENSITY_LEVELS + 2 * uint64_t(buckets) + pixels);
+}
+
+// Function to return the payload length a request header must announce (ignoring REQUEST_FLAG_HASH_ONLY), or the
+// uncompressed length with REQUEST_FLAG_COMPRESSED
+inline uint64_t requestPayloadLength(const RequestHeader &header)
+{
+    uint64_t length = requestPixels(header) * bytesPerPixel(header.pixelFormat);
+    if (header.flags & REQUEST_FLAG_INTENSITY_BUCKETS)
+        length += header.buckets - 1; // The thresholds follow the pixels.
+    return length;
+}
+
+// Function to return the payload length of the successful response to a request
+inline uint64_t responsePayloadLength(const RequestHeader &header)
+{
+    if (header.flags & REQUEST_FLAG_INTENSITY_BUCKETS)
+        return intensityResultSize(requestPixels(header), header.buckets);
+    return requestPixels(header); // One gray byte per pixel.
+}
+
+// Function to check a request header against the protocol limits before anything is allocated for it
+inline ResponseStatus validateRequestHeader(const RequestHeader &header)
+{
+    if (header.magic != PROTOCOL_MAGIC)
+        return STATUS_BAD_MAGIC;
+    if (header.version != PROTOCOL_VERSION)
+        return STATUS_UNSUPPORTED_VERSION;
+    if (bytesPerPixel(header.pixelFormat) == 0)
+        return STATUS_UNSUPPORTED_FORMAT;
+    if (header.flags & ~SUPPORTED_REQUEST_FLAGS)
+        return STATUS_UNSUPPORTED_FLAGS;
+    if ((header.flags & REQUEST_FLAG_STREAMING) &&
+        (header.flags & (REQUEST_FLAG_KEEP_ALIVE | REQUEST_FLAG_HASH_ONLY | REQUEST_FLAG_INTENSITY_BUCKETS)))
+        return STATUS_UNSUPPORTED_FLAGS; // A streamed response needs the connection to itself, the pixels, and positional buckets.
+    if ((header.flags & REQUEST_FLAG_STREAMING) && (header.flags & (REQUEST_FLAG_COMPRESSED | REQUEST_FLAG_ACCEPT_COMPRESSED)))
+        return STATUS_UNSUPPORTED_FLAGS; // Bands are converted as their bytes arrive, not per compressed chunk.
+    if ((header.flags & REQUEST_FLAG_INTENSITY_BUCKETS) && (header.flags & REQUEST_FLAG_COMPRESSED))
+        return STATUS_UNSUPPORTED_FLAGS; // The thresholds travel behind the pixels uncompressed.
+    if ((header.flags & REQUEST_FLAG_LUMA_BT601) && (header.flags & REQUEST_FLAG_LUMA_BT709))
+        return STATUS_UNSUPPORTED_FLAGS; // One weighting per request.
+    if ((header.flags & REQUEST_FLAG_SHARED_MEMORY) &&
+        (header.flags & (REQUEST_FLAG_STREAMING | REQUEST_FLAG_HASH_ONLY | REQUEST_FLAG_INTENSITY_BUCKETS |
+                         REQUEST_FLAG_COMPRESSED | REQUEST_FLAG_ACCEPT_COMPRESSED)))
+        return STATUS_UNSUPPORTED_FLAGS; // Nothing travels on the socket to stream, hash or compress.
+    if (header.width == 0 || header.height == 0 || header.width > MAX_IMAGE_DIMENSION || header.height > MAX_IMAGE_DIMENSION)
+        return STATUS_INVALID_DIMENSIONS;
+    uint64_t pixels = uint64_t(header.width) * header.height; // Cannot overflow: both factors are at most 2^14.
+    if (pixels > MAX_IMAGE_PIXELS)
+        return STATUS_IMAGE_TOO_LARGE;
+    if (header.flags & REQUEST_FLAG_INTENSITY_BUCKETS)
+    {
+        if (header.buckets == 0 || header.buckets > MAX_INTENSITY_BUCKETS)
+            return STATUS_INVALID_BUCKETS;
+        if (header.firstBucket != 0 || header.bucketCount != header.buckets)
+            return STATUS_INVALID_BUCKETS; // Every bucket can hold pixels from anywhere, so the image cannot be sharded.
+    }
+    else
+    {
+        if (header.buckets == 0 || header.buckets > MAX_BUCKETS || header.buckets > pixels)
+            return STATUS_INVALID_BUCKETS;
+        if (header.bucketCount == 0 || uint64_t(header.firstBucket) + header.bucketCount > header.buckets)
+            return STATUS_INVALID_BUCKETS;
+    }
+    if (header.flags & REQUEST_FLAG_HASH_ONLY)
+        return header.payloadLength == CONTENT_HASH_SIZE ? STATUS_OK : STATUS_LENGTH_MISMATCH;
+    if (header.flags & REQUEST_FLAG_COMPRESSED)
+    {
+        uint64_t raw = requestPayloadLength(header); // Compressed, the payload may be anywhere up to the worst case.
+        if (header.payloadLength == 0 || header.payloadLength > compressedBound(raw, bytesPerPixel(header.pixelFormat)))
+            return STATUS_LENGTH_MISMATCH;
+    }
+    else if (header.payloadLength != requestPayloadLength(header))
+        return STATUS_LENGTH_MISMATCH;
+    return STATUS_OK;
+}
+
+// Function to describe a response status for error messages
+inline const char *statusMessage(uint16_t status)
+{
+    switch (status)
+    {
+    case STATUS_OK: return "ok";
+    case STATUS_BAD_MAGIC: return "bad magic number";
+    case STATUS_UNSUPPORTED_VERSION: return "unsupported protocol version";
+    case STATUS_UNSUPPORTED_FORMAT: return "unsupported pixel format";
+    case STATUS_INVALID_DIMENSIONS: return "invalid image dimensions";
+    case STATUS_IMAGE_TOO_LARGE: return "image too large";
+    case STATUS_INVALID_BUCKETS: return "invalid bucket count";
+    case STATUS_LENGTH_MISMATCH: return "payload length does not match the image size";
+    case STATUS_UNSUPPORTED_FLAGS: return "unsupported flags";
+    case STATUS_NOT_CACHED: return "result not cached";
+    case STATUS_CORRUPT_PAYLOAD: return "corrupt compressed payload";
+    case STATUS_BAD_SHARED_MEMORY: return "unusable shared memory";
+    default: return "unknown status";
+    }
+}
+
+#endif // PROTOCOL_H
@@ -0,0 +1,145 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include "buffer_pool.h"
+#include "protocol.h"
+
+// Everything besides the pixels that determines a result and its size; a cache hit must match it exactly.
+struct ResultShape
+{
+    uint16_t pixelFormat = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t buckets = 0;
+    uint32_t firstBucket = 0;
+    uint32_t bucketCount = 0;
+    uint32_t flags = 0;          // Request flags that change the result (all but TRANSPORT_FLAGS).
+
+    bool operator==(const ResultShape &other) const
+    {
+        return pixelFormat == other.pixelFormat && width == other.width && height == other.height &&
+               buckets == other.buckets && firstBucket == other.firstBucket && bucketCount == other.bucketCount &&
+               flags == other.flags;
+    }
+    bool operator!=(const ResultShape &other) const { return !(*this == other); }
+};
+
+// Request flags that only change how a result travels (streaming, sessions, hash-only); all others change the result.
+const uint32_t TRANSPORT_FLAGS = REQUEST_FLAG_STREAMING | REQUEST_FLAG_KEEP_ALIVE | REQUEST_FLAG_HASH_ONLY;
+
+// Function to describe the result a request asks for
+inline ResultShape resultShape(const RequestHeader &request)
+{
+    ResultShape shape;
+    shape.pixelFormat = request.pixelFormat;
+    shape.width = request.width;
+    shape.height = request.height;
+    shape.buckets = request.buckets;
+    shape.firstBucket = request.firstBucket;
+    shape.bucketCount = request.bucketCount;
+    shape.flags = request.flags & ~TRANSPORT_FLAGS;
+    return shape;
+}
+
+// Least-recently-used cache of grayscale results, keyed by the content hash of the RGB payload combined with
+// everything else that determines the output (see cacheKey()). Only the event loop thread uses it, so it has no lock.
+//
+// A key is only 64 bits of a non-cryptographic hash, and hash-only requests let a client pick the payload hash, so a
+// key can match an entry made for another request. Every entry therefore keeps the shape of the request it answers
+// (see resultShape()), and a lookup whose shape differs is a miss: a result is never sent with another geometry.
+//
+// Results are shared, not copied: a hit hands out the same buffer to every response that sends it, and evicting
+// an entry only drops the cache's reference, so a response still being sent keeps its buffer alive.
+class ResultCache
+{
+public:
+    typedef std::shared_ptr<const PooledBuffer> Result;
+
+    // An empty cache holding at most 'capacityBytes' bytes of results (0 disables it).
+    explicit ResultCache(size_t capacityBytes = 0) : capacity(capacityBytes) {}
+
+    // True if results are cached at all.
+    bool enabled() const { return capacity > 0; }
+
+    // Function to look up the result of a request of 'shape'; a hit becomes the most recently used entry.
+    // 'compressed' tells whether the result is stored compressed. Returns null on a miss, or if the entry under 'key'
+    // was made for a request of another shape.
+    Result find(uint64_t key, const ResultShape &shape, bool &compressed)
+    {
+        auto it = index.find(key);
+        if (it == index.end() || it->second->shape != shape)
+            return Result();
+        entries.splice(entries.begin(), entries, it->second); // Move to the front without copying.
+        compressed = it->second->compressed;
+        return it->second->result;
+    }
+
+    // Function to store the result of a request of 'shape' ('compressed' if it holds the compressed gray bytes),
+    // evicting the least recently used entries until it fits. Results larger than the whole cache are not stored.
+    void insert(uint64_t key, const ResultShape &shape, Result result, bool compressed)
+    {
+        size_t size = result->size();
+        if (size > capacity || index.count(key))
+            return; // Too large, or another request stored the same result first.
+        while (used + size > capacity)
+        {
+            used -= entries.back().result->size(); // Evict the least recently used entry.
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+        entries.push_front({key, shape, compressed, std::move(result)});
+        index[key] = entries.begin();
+        used += size;
+    }
+
+    // Number of cached results.
+    size_t size() const { return entries.size(); }
+
+    // Bytes of cached results.
+    size_t bytes() const { return used; }
+
+private:
+    struct Entry
+    {
+        uint64_t key;      // Cache key of the result.
+        ResultShape shape; // Request the result was computed for.
+        bool compressed;   // 'result' holds the compressed gray bytes, as sent.
+        Result result;     // Gray bytes of the request.
+    };
+
+    size_t capacity;                                                    // Most bytes of results kept.
+    size_t used = 0;                                                    // Bytes of results currently kept.
+    std::list<Entry> entries;                                           // Most recently used first.
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;     // Entries by key.
+};
+
+// Function to mix a 64-bit value into a hash (a combine step followed by the splitmix64 finalizer)
+inline uint64_t mixHash(uint64_t hash, uint64_t value)
+{
+    hash ^= value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebull;
+    return hash ^ (hash >> 31);
+}
+
+// Function to compute the cache key of a request from the content hash of its payload: the same pixels give a
+// different result for another geometry, bucket range, pixel format or processing flag, so all of those are part
+// of the key. Flags that only change how the result travels (streaming, sessions, hash-only) are not. The compression
+// flags are: a compressed upload hashes its compressed bytes, and a compressed response is cached compressed.
+inline uint64_t cacheKey(const RequestHeader &request, uint64_t payloadHash)
+{
+    uint64_t key = mixHash(payloadHash, request.pixelFormat);
+    key = mixHash(key, (uint64_t(request.width) << 32) | request.height);
+    key = mixHash(key, (uint64_t(request.buckets) << 32) | (request.flags & ~TRANSPORT_FLAGS));
+    return mixHash(key, (uint64_t(request.firstBucket) << 32) | request.bucketCount);
+}
+
+#endif // RESULT_CACHE_H
@@ -1,30 +1,216 @@
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
 #include <algorithm>
+#include <string>
 #include <cstring>
 #include <cstdlib>
+#include <cmath>
+#include <cerrno>
+#include <csignal>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
 #include <unistd.h>
 
+#include "buffer_pool.h"
+#include "compression.h"
+#include "content_hash.h"
+#include "grayscale.h"
+#include "image_io.h"
+#include "intensity.h"
+#include "luma.h"
+#include "protocol.h"
+#include "result_cache.h"
+#include "shared_memory.h"
+#include "stats.h"
+#include "thread_pool.h"
+
 using namespace std;
 
-// Image and network constants
-const int PORT = 55000;       // Self-defined network port to connect client with server and vice versa.
-const int WIDTH = 800;        // As we are taking an image of size 800x600 as our input, the width is constant and will never change.
-const int HEIGHT = 600;       // The height of the input image (constant at 600 pixels).
-const int CHANNELS = 3;       // Number of color channels in the image: red, green, and blue (RGB).
-const int TOTAL_PIXELS = WIDTH * HEIGHT;  // Total number of pixels in the image: 800 x 600 = 480,000.
-const int IMAGE_SIZE = TOTAL_PIXELS * CHANNELS;  // Total size of the RGB image in bytes: 480,000 x 3 = 1,440,000.
-const int GRAY_SIZE = TOTAL_PIXELS;                // Total size of the grayscale image in bytes: 480,000.
-const int BUCKETS = 8;        // Number of partitions (buckets) to divide the grayscale image.
-const int BUCKET_SIZE = GRAY_SIZE / BUCKETS;         // Size of each bucket in bytes: 480,000 / 8 = 60,000.
+// Image constants (image sizes and bucket counts now come from each request header, see protocol.h)
+const int CHANNELS = 3;       // Bytes of a PIXEL_FORMAT_RGB8 pixel: red, green, and blue (other formats, see luma.h).
+
+// Event loop constants
+const int DEFAULT_BACKLOG = 128;          // Default length of the kernel's queue of pending (not yet accepted) connections.
+const int MAX_EVENTS = 256;               // Maximum number of readiness events fetched by a single epoll_wait() call.
+const int DEFAULT_SHUTDOWN_TIMEOUT = 10;  // Seconds to let in-flight connections finish after a shutdown signal.
+const int MAX_SEND_IOVECS = 64;           // Buckets handed to the kernel by a single sendmsg() call.
+const size_t DEFAULT_ZEROCOPY_THRESHOLD = 4 << 20; // Responses of at least 4 MiB are sent with MSG_ZEROCOPY.
+const size_t STREAM_BAND_BYTES = 64 << 10;  // Target size of one band of RGB rows in streaming mode.
+const size_t STREAM_QUEUED_BANDS = 4;       // Converted bands that may wait for the client before reading pauses.
+const size_t TILE_PIXELS = 64 << 10;        // Pixels converted by one worker task: 192 KiB of RGB plus 64 KiB of gray fits in L2.
+const size_t MAX_PIPELINED_REQUESTS = 16;   // Requests of one connection being processed or waiting to be sent; reading pauses beyond that.
+const size_t MAX_STATS_REQUEST = 4096;      // Bytes of a statistics request read before answering.
+
+// Instrumentation shared by the event loop and the workers (see stats.h).
+ServerStats stats;
+// Per-connection log lines and bucket summaries (--verbose). Off by default, so the request path does no console I/O.
+bool verboseLogging = false;
+
+// Server settings that can be changed from the command line.
+struct ServerConfig
+{
+    int port = DEFAULT_PORT;                          // Port to listen on.
+    int backlog = DEFAULT_BACKLOG;                    // Backlog passed to listen().
+    int shutdownTimeout = DEFAULT_SHUTDOWN_TIMEOUT;   // Grace period for in-flight connections on shutdown.
+    size_t zerocopyThreshold = DEFAULT_ZEROCOPY_THRESHOLD; // Minimum grayscale size sent with MSG_ZEROCOPY (0 disables it).
+    size_t workers = thread::hardware_concurrency();  // Compute threads converting images (0 converts on the I/O thread).
+    bool pinThreads = false;                          // Bind the I/O thread and each worker to its own CPU.
+    int statsPort = 0;                                // Loopback port serving statistics snapshots (0 disables it).
+    int statsInterval = 0;                            // Seconds between snapshots printed to stdout (0 disables them).
+    size_t cacheBytes = 0;                            // Memory for cached results (0 disables the cache).
+    size_t bufferPoolBytes = BufferPool::DEFAULT_CACHE_LIMIT; // Released request buffers kept for reuse.
+    bool compression = true;                          // Take compressed uploads and compress responses for clients that accept it.
+    string localSocket;                               // Path of the Unix domain socket for same-host clients (empty disables it).
+};
+
+// The receiving side of a connection moves through these states for every request. Received images are handed
+// off for processing right away, so on a pipelined connection the next request is read while earlier ones are
+// still being converted or sent.
+enum class ConnectionState
+{
+    RECEIVING_HEADER, // Reading the request header that describes the image.
+    RECEIVING_IMAGE,  // Reading the raw RGB image from the client.
+    STREAMING         // Streaming mode: receiving, converting and sending band by band at the same time.
+};
+
+// Result of a non-blocking I/O step on a connection.
+enum class IoStatus
+{
+    PENDING,   // The socket would block; wait for the next readiness event.
+    COMPLETE,  // The current transfer has finished.
+    FAILED     // The peer disconnected or a socket error occurred.
+};
+
+// A response waiting to be sent. A pipelined connection may have several; they go out in the order they were finished.
+struct Response
+{
+    unsigned char header[HEADER_SIZE];                  // Encoded response header.
+    uint64_t requestId = 0;                             // ID of the request it answers (for the log).
+    ResultCache::Result gray;                           // Grayscale image the buckets point into (possibly shared with the cache).
+    vector<BucketView> buckets;                         // Buckets following the header (empty on errors).
+    bool inSharedMemory = false;                        // The gray bytes are in the client's output file; only the header is sent.
+    size_t sent = 0;                                    // Bytes of the response (header followed by buckets) sent so far.
+    bool zerocopy = false;                              // True if the buckets are sent with MSG_ZEROCOPY.
+    uint64_t zerocopyMark = 0;                          // Zero-copy sends the kernel must report complete before 'gray' is freed.
+    uint64_t requestStart = 0;                          // When the first byte of the request was read (nowNanoseconds()).
+    uint64_t sendStart = 0;                             // When its first byte was handed to the kernel.
+};
+
+// Per-connection state kept by the event loop between readiness events.
+struct Connection
+{
+    int fd = -1;                                        // Client socket file descriptor.
+    uint64_t id = 0;                                    // Unique for the lifetime of the server, unlike the descriptor.
+    bool local = false;                                 // Accepted on the Unix domain socket: requests may pass memory files.
+    vector<int> passedFds;                              // Descriptors that arrived with the current request header.
+    SharedRegion sharedInput;                           // Shared-memory request: the client's pixels, mapped read-only.
+    SharedRegion sharedOutput;                          // Shared-memory request: where the gray bytes go.
+    uint32_t watchedEvents = 0;                         // Events the socket is currently registered for in epoll.
+    ConnectionState state = ConnectionState::RECEIVING_HEADER; // Current step of the request being received.
+    unsigned char requestBytes[HEADER_SIZE];            // Raw bytes of the request header.
+    size_t headerReceived = 0;                          // Number of header bytes received so far.
+    RequestHeader request;                              // Decoded request header.
+    PooledBuffer image;                                 // Raw RGB image being received (one band of rows when streaming).
+    int pixelBytes = CHANNELS;                          // Bytes per pixel in the request's pixel format.
+    GrayscaleKernel convert = nullptr;                  // Converter for the request's pixel format and weighting (luma.h).
+    size_t received = 0;                                // Number of image bytes received so far.
+    size_t bandFilled = 0;                              // Streaming: bytes of the current band received so far.
+    uint64_t requestStart = 0;                          // When the first byte of the current request was read (nowNanoseconds()).
+    bool hashing = false;                               // The image is hashed while it arrives, for the result cache.
+    ContentHasher hasher;                               // Content hash of the image bytes received so far.
+    vector<size_t> chunkOffsets;                        // Compressed upload: where each chunk starts in 'image'.
+    bool keepAlive = false;                             // The last request asked to keep the connection open.
+    bool readDone = false;                              // No further requests will be read from this connection.
+    size_t inFlight = 0;                                // Images of this connection being processed.
+    deque<Response> responses;                          // Responses waiting to be sent; the front one is being sent.
+    deque<Response> retired;                            // Sent responses whose pages the kernel may still read (MSG_ZEROCOPY).
+    bool writeBlocked = false;                          // The last send stopped because the socket buffer was full.
+    PooledBuffer gray;                                  // Streaming: converted bands waiting to be sent.
+    size_t grayHead = 0;                                // Streaming: first converted gray byte not yet sent.
+    size_t grayTail = 0;                                // Streaming: end of the converted gray bytes.
+    unsigned char responseBytes[HEADER_SIZE];           // Streaming: encoded response header.
+    size_t responseSent = 0;                            // Streaming: bytes of the response header sent so far.
+    bool zerocopyEnabled = false;                       // SO_ZEROCOPY has been switched on for the socket.
+    uint64_t zerocopySends = 0;                         // Number of sendmsg() calls made with MSG_ZEROCOPY.
+    uint64_t zerocopyCompleted = 0;                     // Number of those the kernel has reported as finished.
+};
+
+// An image handed to the worker pool. The job owns its buffers, so the connection may close while workers still use them.
+struct ImageJob
+{
+    int fd = -1;                                        // Socket of the connection the image came from.
+    uint64_t connectionId = 0;                          // Id of that connection (descriptors are reused after close).
+    RequestHeader request;                              // Header describing the image.
+    uint64_t requestStart = 0;                          // When the first byte of the request was read.
+    bool cacheable = false;                             // Store the result in the cache under 'cacheKey'.
+    uint64_t cacheKey = 0;                              // Cache key of the request (see result_cache.h).
+    PooledBuffer image;                                 // Raw RGB image.
+    int pixelBytes = CHANNELS;                          // Bytes per pixel in the request's pixel format.
+    GrayscaleKernel convert = nullptr;                  // Converter chosen for the request when it arrived.
+    PooledBuffer gray;                                  // Grayscale image written by the workers.
+    vector<BucketView> buckets;                         // Buckets as views into 'gray'.
+    SharedRegion input;                                 // Shared-memory request: the pixels, read in place of 'image'.
+    SharedRegion output;                                // Shared-memory request: the gray bytes, written in place of 'gray'.
+    atomic<size_t> remainingTiles{0};                   // Tiles not yet converted; the worker finishing the last one posts the job.
+    uint64_t submitted = 0;                             // When the tiles were queued, for the grayscale stage timing.
+    // Compression only (see compression.h): the tiles are the compression chunks.
+    PooledBuffer upload;                                // Compressed upload as received; decoded into 'image' chunk by chunk.
+    vector<size_t> chunkOffsets;                        // Where each chunk starts in 'upload'.
+    bool compressResponse = false;                      // The gray bytes go out compressed.
+    PooledBuffer packed;                                // Compressed gray bytes: one slot of compressedChunkBound() per chunk.
+    vector<size_t> packedLengths;                       // Bytes used in each slot, length prefix included.
+    atomic<bool> corrupt{false};                        // A chunk of the upload could not be decoded.
+    // Intensity buckets only (see intensity.h): the tiles are the parts of the counting sort.
+    vector<BucketView> tiles;                           // Pixel ranges of the tiles.
+    vector<IntensityHistogram> histograms;              // Histogram of each tile, counted right after converting it.
+    vector<uint32_t> cursors;                           // Write cursors per tile and bucket for the scatter.
+    unsigned char intensityMap[INTENSITY_LEVELS];       // Bucket of every gray level.
+    PooledBuffer intensity;                             // Histogram, bucket table and index list; replaces 'gray' when done.
+    uint64_t scatterStart = 0;                          // When the prefix sums started, for the partition stage timing.
+};
+
+// Jobs finished by the workers, waiting to be picked up by the I/O thread (woken through the eventfd).
+struct CompletionQueue
+{
+    int event_fd = -1;                                  // Becomes readable when 'finished' is not empty.
+    mutex lock;                                         // Protects 'finished'.
+    vector<shared_ptr<ImageJob>> finished;              // Jobs whose gray image and buckets are ready.
+};
+
+// Everything the event loop works with.
+struct ServerContext
+{
+    ServerConfig config;                                // Settings from the command line.
+    int epoll_fd = -1;                                  // The epoll instance.
+    unordered_map<int, Connection> connections;         // State of every connected client, keyed by socket.
+    uint64_t nextConnectionId = 1;                      // Id given to the next accepted connection.
+    unordered_set<int> statsClients;                    // Connections to the statistics port waiting for their request.
+    bool draining = false;                              // Shutting down: sessions end after their current request.
+    ResultCache cache;                                  // Results of recent images, for repeated frames.
+    CompletionQueue completions;                        // Results coming back from the workers.
+    unique_ptr<ThreadPool> pool;                        // Compute threads (null with --workers 0); declared last so it stops first.
+};
 
 // Function to create the server socket
-int createServerSocket() 
+int createServerSocket()
 {
-    // Creating a TCP socket using IPv4 (AF_INET) and stream sockets (SOCK_STREAM).
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    // Creating a non-blocking TCP socket using IPv4 (AF_INET) and stream sockets (SOCK_STREAM).
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (server_fd < 0)
     { // Check if socket creation failed (socket() returns a negative value on error).
         perror("Socket creation failed"); // Print an error message with details from the system (using errno).
@@ -34,177 +220,1975 @@ int createServerSocket()
 }
 
 // Function to bind the socket to a port and listen for connections
-void bindAndListen(int server_fd, int port) 
+void bindAndListen(int server_fd, int port, int backlog)
 {
     int opt = 1; // Option value used to enable socket options.
     // Set socket options to allow reuse of the address and port, avoiding "Address already in use" errors.
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)) < 0) 
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)) < 0)
     {
         perror("setsockopt failed"); // Print an error message if setsockopt fails.
         exit(EXIT_FAILURE); // Exit the program due to the error.
     }
-    
+
     sockaddr_in address; // Structure to hold the server's address information.
     address.sin_family = AF_INET; // Specify the address family as IPv4.
     address.sin_addr.s_addr = INADDR_ANY; // Bind to all available network interfaces.
     address.sin_port = htons(port); // Convert the port number to network byte order (big-endian) using htons.
-    
+
     // Bind the socket to the address and port specified in the 'address' structure.
-    if (bind(server_fd, (sockaddr *)&address, sizeof(address)) < 0) 
+    if (bind(server_fd, (sockaddr *)&address, sizeof(address)) < 0)
     {
         perror("bind failed"); // Print an error message if binding fails.
         exit(EXIT_FAILURE); // Exit the program due to the error.
     }
-    
-    // Start listening for incoming connections; the second parameter defines the maximum queue length for pending connections.
-    if (listen(server_fd, 3) < 0) 
+
+    // Start listening for incoming connections; the backlog defines the maximum queue length for pending connections.
+    if (listen(server_fd, backlog) < 0)
     {
         perror("listen failed"); // Print an error message if listen fails.
         exit(EXIT_FAILURE); // Exit the program due to the error.
     }
-    
-    cout << "Server listening on port " << port << endl; // Inform the user that the server is now listening.
+
+    cout << "Server listening on port " << port << " (backlog " << backlog << ")" << endl; // Inform the user that the server is now listening.
+}
+
+// Function to create the epoll instance that multiplexes all sockets
+int createEventLoop()
+{
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC); // Create an epoll instance that is closed automatically on exec.
+    if (epoll_fd < 0)
+    {
+        perror("epoll_create1 failed"); // Print an error message if the epoll instance could not be created.
+        exit(EXIT_FAILURE); // Exit the program due to the error.
+    }
+    return epoll_fd; // Return the epoll file descriptor.
+}
+
+// Function to register (or update) the events a file descriptor is watched for
+bool watchDescriptor(int epoll_fd, int fd, uint32_t events, bool add)
+{
+    epoll_event ev {}; // Event description passed to epoll_ctl().
+    ev.events = events; // Readiness events we are interested in (EPOLLIN / EPOLLOUT).
+    ev.data.fd = fd; // Store the descriptor so the event loop knows which socket became ready.
+    if (epoll_ctl(epoll_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) < 0)
+    {
+        perror("epoll_ctl failed"); // Print an error message if the registration fails.
+        return false; // Report the failure to the caller.
+    }
+    return true; // The descriptor is now watched for the requested events.
+}
+
+// Function to route SIGINT/SIGTERM into a file descriptor so shutdown is handled by the event loop
+int createSignalDescriptor()
+{
+    signal(SIGPIPE, SIG_IGN); // A client that disconnects mid-send must not kill the whole server.
+    sigset_t mask; // Set of signals to be delivered through the descriptor.
+    sigemptyset(&mask); // Start from an empty set.
+    sigaddset(&mask, SIGINT); // Ctrl+C in the terminal.
+    sigaddset(&mask, SIGTERM); // Termination request (e.g. from kill or a service manager).
+    // Block the default handling of these signals so they are only reported through the signalfd.
+    if (sigprocmask(SIG_BLOCK, &mask, nullptr) < 0)
+    {
+        perror("sigprocmask failed"); // Print an error message if the signals could not be blocked.
+        exit(EXIT_FAILURE); // Exit the program due to the error.
+    }
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC); // Create a descriptor that becomes readable on a signal.
+    if (signal_fd < 0)
+    {
+        perror("signalfd failed"); // Print an error message if the descriptor could not be created.
+        exit(EXIT_FAILURE); // Exit the program due to the error.
+    }
+    return signal_fd; // Return the signal descriptor so it can be watched by epoll.
+}
+
+// Function to create the eventfd through which the workers wake the event loop
+int createCompletionDescriptor()
+{
+    int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); // A counter that is readable while it is non-zero.
+    if (event_fd < 0)
+    {
+        perror("eventfd failed"); // Print an error message if the descriptor could not be created.
+        exit(EXIT_FAILURE); // Exit the program due to the error.
+    }
+    return event_fd;
+}
+
+// Function to open the statistics port; it only listens on the loopback interface, so snapshots stay local
+int createStatsSocket(int port)
+{
+    int stats_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int opt = 1; // Allows a restarted server to bind again right away.
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // 127.0.0.1 only.
+    address.sin_port = htons(port);
+    if (stats_fd < 0 || setsockopt(stats_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(stats_fd, (sockaddr *)&address, sizeof(address)) < 0 || listen(stats_fd, DEFAULT_BACKLOG) < 0)
+    {
+        perror("statistics port failed"); // Print an error message if the port could not be opened.
+        exit(EXIT_FAILURE); // Exit the program due to the error.
+    }
+    cout << "Statistics on 127.0.0.1:" << port << endl;
+    return stats_fd;
+}
+
+// Function to open the Unix domain socket for same-host clients at 'path', replacing a stale socket file left there
+int createLocalSocket(const string &path, int backlog)
+{
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        cerr << "Local socket path too long: " << path << endl;
+        exit(EXIT_FAILURE);
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    unlink(path.c_str()); // A previous run that did not shut down cleanly leaves the file behind.
+    int local_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (local_fd < 0 || bind(local_fd, (sockaddr *)&address, sizeof(address)) < 0 || listen(local_fd, backlog) < 0)
+    {
+        perror("local socket failed"); // Print an error message if the socket could not be opened.
+        exit(EXIT_FAILURE); // Exit the program due to the error.
+    }
+    cout << "Local clients on " << path << " (shared memory)" << endl;
+    return local_fd;
 }
 
-// Function to accept an incoming connection
-int acceptClient(int server_fd) 
+// Function to create the timer that triggers a statistics snapshot every 'seconds'
+int createStatsTimer(int seconds)
 {
-    sockaddr_in address; // Structure to store the client's address information.
-    socklen_t addrlen = sizeof(address); // The size of the address structure.
-    // Accept a new connection from a client; a new socket is created for this client.
-    int client_sock = accept(server_fd, (sockaddr *)&address, &addrlen);
-    if (client_sock < 0) 
-    { // Check if accept() failed.
-        perror("accept failed"); // Print an error message if accepting the connection fails.
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC); // Readable whenever the timer expired.
+    itimerspec period {};
+    period.it_interval.tv_sec = seconds;
+    period.it_value.tv_sec = seconds; // First snapshot after one full interval.
+    if (timer_fd < 0 || timerfd_settime(timer_fd, 0, &period, nullptr) < 0)
+    {
+        perror("timerfd failed"); // Print an error message if the timer could not be set up.
         exit(EXIT_FAILURE); // Exit the program due to the error.
     }
-    cout << "Client connected." << endl; // Notify that a client has successfully connected.
-    return client_sock; // Return the client's socket file descriptor.
+    return timer_fd;
 }
 
-// Function to receive the raw RGB image data from the client
-bool receiveImageData(int sock, vector<unsigned char> &image) 
+// Function to start the worker pool; with pinning, the calling (I/O) thread gets the first CPU and the workers the others
+unique_ptr<ThreadPool> startWorkers(const ServerConfig &config)
 {
-    image.resize(IMAGE_SIZE); // Resize the vector to hold the complete image data.
-    int total_received = 0; // Counter for the total number of bytes received.
-    // Loop until the entire image data (IMAGE_SIZE bytes) is received.
-    while (total_received < IMAGE_SIZE) 
+    if (config.workers == 0)
+        return nullptr; // Images are converted on the I/O thread.
+    vector<int> cpus = ThreadPool::availableCpus(); // CPUs this process may run on.
+    if (config.pinThreads && !cpus.empty())
     {
-        // Receive data from the client and store it in the vector at the correct offset.
-        int bytes = recv(sock, image.data() + total_received, IMAGE_SIZE - total_received, 0);
-        if (bytes <= 0) 
-        { // If no bytes are received or an error occurs...
-            cerr << "Failed to receive image data." << endl; // Print an error message to the standard error stream.
-            return false; // Return false to indicate failure in receiving the image data.
+        ThreadPool::pinThread(pthread_self(), cpus[0]); // Keep the event loop on its own core.
+        if (cpus.size() > 1)
+            cpus.erase(cpus.begin()); // The workers share the remaining ones.
+    }
+    cout << "Worker threads: " << config.workers << (config.pinThreads ? " (pinned)" : "") << endl;
+    return unique_ptr<ThreadPool>(new ThreadPool(config.workers, config.pinThreads, cpus));
+}
+
+// Function to accept every pending connection and register it with the event loop ('local' for the Unix domain socket)
+void acceptClients(int server_fd, ServerContext &server, bool local = false)
+{
+    // Keep accepting until the kernel's queue of pending connections is empty.
+    while (true)
+    {
+        uint64_t acceptStart = nowNanoseconds(); // Start of the accept stage.
+        sockaddr_storage address; // Structure to store the client's address information (IPv4 or a Unix socket path).
+        socklen_t addrlen = sizeof(address); // The size of the address structure.
+        // Accept a new connection; the client socket is created non-blocking so it never stalls the event loop.
+        int client_sock = accept4(server_fd, (sockaddr *)&address, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return; // No more pending connections for now.
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue; // The connection went away before we accepted it; try the next one.
+            perror("accept failed"); // Other errors (e.g. out of file descriptors) are reported but not fatal.
+            return; // Retry on the next readiness event.
+        }
+        // Watch the new client for incoming image data.
+        if (!watchDescriptor(server.epoll_fd, client_sock, EPOLLIN | EPOLLRDHUP, true))
+        {
+            close(client_sock); // Drop the client if it cannot be registered.
+            continue;
         }
-        total_received += bytes; // Update the total number of bytes received.
+        Connection &conn = server.connections[client_sock]; // Create the per-connection state.
+        conn.fd = client_sock; // Remember the socket owned by this connection.
+        conn.id = server.nextConnectionId++; // Lets results from the workers find the right connection.
+        conn.local = local; // Only same-host peers can pass memory files.
+        conn.watchedEvents = EPOLLIN | EPOLLRDHUP; // Matches the registration above.
+        stats.recordStage(STAGE_ACCEPT, acceptStart);
+        ServerStats::add(stats.connectionsAccepted);
+        ServerStats::add(stats.connectionsActive);
+        if (verboseLogging)
+            cout << "Client connected (fd " << client_sock << ", " << server.connections.size() << " active)." << endl; // Notify that a client has successfully connected.
     }
-    cout << "Received image (" << total_received << " bytes)." << endl; // Log the total bytes received.
-    return true; // Return true indicating the image data was received successfully.
 }
 
-// Function to convert an RGB image to grayscale using the average method.
-vector<unsigned char> convertToGrayscale(const vector<unsigned char> &image) 
+// Function to receive up to 'length' bytes into 'dest', continuing from 'received', without blocking.
+// With 'descriptors', descriptors passed along with the bytes (SCM_RIGHTS) are collected there; otherwise the
+// kernel discards them.
+IoStatus receiveBytes(int fd, unsigned char *dest, size_t length, size_t &received, vector<int> *descriptors = nullptr)
 {
-    vector<unsigned char> gray(GRAY_SIZE); // Create a vector to store the grayscale image.
-    // Process each pixel: each pixel in the RGB image consists of three consecutive bytes (R, G, B).
-    for (int i = 0; i < TOTAL_PIXELS; i++) 
+    // Loop until all bytes are received or the socket has nothing more to give.
+    while (received < length)
     {
-        int r = image[3 * i];       // Extract the red component.
-        int g = image[3 * i + 1];   // Extract the green component.
-        int b = image[3 * i + 2];   // Extract the blue component.
-        // Compute the average value of R, G, and B to convert to a single grayscale value.
-        gray[i] = static_cast<unsigned char>((r + g + b) / 3);
+        // Receive data from the client and store it at the correct offset.
+        ssize_t bytes = descriptors ? receiveWithDescriptors(fd, dest + received, length - received, *descriptors)
+                                    : recv(fd, dest + received, length - received, 0);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return IoStatus::PENDING; // The rest of the data has not arrived yet.
+        if (bytes < 0 && errno == EINTR)
+            continue; // Interrupted by a signal; simply retry.
+        if (bytes <= 0)
+            return IoStatus::FAILED; // The client disconnected or an error occurred.
+        received += bytes; // Update the total number of bytes received.
+        ServerStats::add(stats.bytesReceived, bytes);
     }
-    return gray; // Return the grayscale image vector.
+    return IoStatus::COMPLETE; // Everything that was asked for has arrived.
+}
+
+// Function to send up to 'length' bytes from 'data', continuing from 'sent', without blocking
+IoStatus sendBytes(int fd, const unsigned char *data, size_t length, size_t &sent)
+{
+    while (sent < length)
+    {
+        // Send the unsent part; MSG_NOSIGNAL avoids SIGPIPE if the client has gone away.
+        ssize_t bytes_sent = send(fd, data + sent, length - sent, MSG_NOSIGNAL);
+        if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return IoStatus::PENDING; // The socket buffer is full; continue when it drains.
+        if (bytes_sent < 0 && errno == EINTR)
+            continue; // Interrupted by a signal; simply retry.
+        if (bytes_sent < 0)
+        { // Check if the send() operation failed.
+            if (verboseLogging)
+                perror("send failed"); // Print an error message using perror.
+            return IoStatus::FAILED; // Indicate the failure to send data.
+        }
+        sent += bytes_sent; // Track short writes so the rest is sent later.
+        ServerStats::add(stats.bytesSent, bytes_sent);
+    }
+    return IoStatus::COMPLETE; // Everything was sent.
+}
+
+// Function to receive and validate the request header that announces the image
+IoStatus receiveRequestHeader(Connection &conn)
+{
+    bool firstBytes = conn.headerReceived == 0; // The request timing starts with its first byte.
+    // Read the fixed-size header; on the Unix domain socket the memory files of a shared-memory request come with it.
+    IoStatus status = receiveBytes(conn.fd, conn.requestBytes, HEADER_SIZE, conn.headerReceived, conn.local ? &conn.passedFds : nullptr);
+    if (firstBytes && conn.headerReceived > 0)
+        conn.requestStart = nowNanoseconds();
+    if (status == IoStatus::FAILED && conn.headerReceived > 0 && verboseLogging)
+        cerr << "Failed to receive request header (fd " << conn.fd << ")." << endl; // A client closing before any request is not an error.
+    if (status != IoStatus::COMPLETE)
+        return status;
+    conn.request = decodeRequestHeader(conn.requestBytes); // Parse the header fields.
+    if (!verboseLogging)
+        return IoStatus::COMPLETE;
+    cout << "Request: " << conn.request.width << "x" << conn.request.height << " pixels, " << conn.request.buckets << " buckets";
+    if (conn.request.bucketCount != conn.request.buckets) // Shard of a larger image, sent by a coordinating client.
+        cout << " (shard: buckets " << conn.request.firstBucket + 1 << "-" << uint64_t(conn.request.firstBucket) + conn.request.bucketCount << ")";
+    cout << ", " << conn.request.payloadLength << " bytes, request " << conn.request.requestId
+         << (conn.request.flags & REQUEST_FLAG_KEEP_ALIVE ? " (session)" : "")
+         << (conn.request.flags & REQUEST_FLAG_SHARED_MEMORY ? " in shared memory" : "") << " (fd " << conn.fd << ")." << endl; // Log what the client announced.
+    return IoStatus::COMPLETE;
 }
 
-// Function to partition the grayscale image into 8 equal buckets
-vector<vector<unsigned char>> partitionIntoBuckets(const vector<unsigned char> &gray) 
+// Function to receive as much of the raw RGB image as is currently available
+IoStatus receiveImageData(Connection &conn)
 {
-    // Create a 2D vector (vector of vectors) where each sub-vector represents a bucket of BUCKET_SIZE bytes.
-    vector<vector<unsigned char>> buckets(BUCKETS, vector<unsigned char>(BUCKET_SIZE));
-    // For each bucket, copy a segment of the grayscale image into it.
-    for (int i = 0; i < BUCKETS; i++) {
-        // Use the standard algorithm 'copy' to move BUCKET_SIZE elements from the grayscale vector into the current bucket.
-        copy(gray.begin() + i * BUCKET_SIZE, gray.begin() + (i + 1) * BUCKET_SIZE, buckets[i].begin());
+    size_t before = conn.received;
+    IoStatus status = receiveBytes(conn.fd, conn.image.data(), conn.image.size(), conn.received); // Read into the image buffer.
+    if (conn.hashing)
+        conn.hasher.update(conn.image.data() + before, conn.received - before); // Hashed while still in the CPU cache.
+    if (status == IoStatus::FAILED && verboseLogging)
+        cerr << "Failed to receive image data (fd " << conn.fd << ")." << endl; // Print an error message to the standard error stream.
+    if (status == IoStatus::COMPLETE)
+    {
+        stats.recordStage(STAGE_RECEIVE, conn.requestStart);
+        if (verboseLogging)
+            cout << "Received image (" << conn.received << " bytes, fd " << conn.fd << ")." << endl; // Log the total bytes received.
     }
-    return buckets; // Return the 2D vector containing all the buckets.
+    return status;
+}
+
+// Function to encode the response header for 'request' into 'out'; 'status' other than STATUS_OK sends an error without buckets.
+// A non-zero 'packedLength' announces compressed gray bytes of that size.
+void prepareResponse(const RequestHeader &request, ResponseStatus status, unsigned char *out, uint64_t packedLength = 0)
+{
+    ResponseHeader response; // Header describing what follows.
+    response.status = status; // Outcome of the request.
+    response.requestId = request.requestId; // Lets a pipelining client match the response to its request.
+    if (status == STATUS_OK)
+    {
+        response.width = request.width; // Echo the image geometry back to the client.
+        response.height = request.height;
+        response.buckets = request.buckets;
+        response.firstBucket = request.firstBucket; // The same shard comes back.
+        response.bucketCount = request.bucketCount;
+        response.payloadLength = responsePayloadLength(request); // Gray bytes, or the intensity buckets.
+        if (request.flags & REQUEST_FLAG_SHARED_MEMORY)
+            response.flags = RESPONSE_FLAG_SHARED_MEMORY; // Written to the client's output file, not sent.
+        if (packedLength > 0)
+        {
+            response.flags = RESPONSE_FLAG_COMPRESSED;
+            response.payloadLength = packedLength;
+        }
+    }
+    encodeResponseHeader(response, out); // Serialize it for sending.
+}
+
+// Function to convert an image to grayscale with the kernel chosen for its pixel format and weighting.
+PooledBuffer convertToGrayscale(const PooledBuffer &image, size_t pixels, GrayscaleKernel convert)
+{
+    PooledBuffer gray(pixels); // Recycled storage for the grayscale image; every byte is written below.
+    // By default each output byte is (R + G + B) / 3 of the matching pixel, done by the SIMD kernel picked at startup.
+    convert(image.data(), gray.data(), pixels);
+    return gray; // Return the grayscale image vector.
 }
 
 // Function to print a summary of the grayscale buckets (first 10 values per bucket)
-void printBucketsSummary(const vector<vector<unsigned char>> &buckets) 
+void printBucketsSummary(const unsigned char *gray, const vector<BucketView> &buckets)
 {
-    cout << "Grayscale image data partitioned into 8 buckets:" << endl; // Header message for clarity.
+    cout << "Grayscale image data partitioned into " << buckets.size() << " buckets:" << endl; // Header message for clarity.
     // Loop through each bucket to print a summary.
-    for (int i = 0; i < BUCKETS; i++) 
+    for (size_t i = 0; i < buckets.size(); i++)
     {
         cout << "Bucket " << i + 1 << ": "; // Print the bucket number (using i+1 for a human-friendly count).
         // Print the first 10 grayscale values from each bucket (or less if the bucket has fewer than 10 values).
-        for (int j = 0; j < 10 && j < BUCKET_SIZE; j++) 
+        for (size_t j = 0; j < 10 && j < buckets[i].length; j++)
         {
-            cout << static_cast<int>(buckets[i][j]) << " "; // Convert the unsigned char to an int for clear numeric output.
+            cout << static_cast<int>(gray[buckets[i].offset + j]) << " "; // Convert the unsigned char to an int for clear numeric output.
         }
         cout << "..." << endl; // Indicate that the bucket contains more data.
     }
 }
 
-// Function to send each bucket of data back to the client
-bool sendBucketsData(int sock, const vector<vector<unsigned char>> &buckets) 
+// Function to describe the buckets carried by a request as views into its gray bytes.
+// An intensity result is sent as a single view: its histogram, bucket table and index list are already in place.
+vector<BucketView> requestBuckets(const RequestHeader &request)
+{
+    if (request.flags & REQUEST_FLAG_INTENSITY_BUCKETS)
+        return vector<BucketView>(1, BucketView{0, responsePayloadLength(request)});
+    uint64_t pixels = uint64_t(request.width) * request.height; // Size of the whole image, which defines the bucket layout.
+    return partitionShard(pixels, request.buckets, request.firstBucket, request.bucketCount);
+}
+
+// Function to decide whether the response to a request goes out compressed: the client must accept it, and only
+// positional gray bytes are compressed
+bool compressesResponse(const ServerConfig &config, const RequestHeader &request)
+{
+    return config.compression && (request.flags & REQUEST_FLAG_ACCEPT_COMPRESSED) &&
+           !(request.flags & (REQUEST_FLAG_INTENSITY_BUCKETS | REQUEST_FLAG_STREAMING));
+}
+
+// Function to process one compression chunk of an image: decode its pixels if they arrived compressed, convert them,
+// and compress the gray bytes if the response goes out compressed. All three passes run while the chunk is in L2.
+void processChunk(ImageJob &job, size_t chunk)
+{
+    size_t pixels = requestPixels(job.request);
+    size_t first = chunk * COMPRESSION_CHUNK_PIXELS; // First pixel of the chunk.
+    size_t count = min(COMPRESSION_CHUNK_PIXELS, pixels - first);
+    if (job.request.flags & REQUEST_FLAG_COMPRESSED)
+    {
+        const unsigned char *in = job.upload.data() + job.chunkOffsets[chunk]; // Framing was checked on arrival.
+        if (!decompressChunk(in + 4, compressedChunkLength(in), job.pixelBytes, job.image.data() + first * job.pixelBytes,
+                             count * job.pixelBytes))
+        {
+            job.corrupt = true; // Answered with STATUS_CORRUPT_PAYLOAD once every chunk is done.
+            return;
+        }
+    }
+    job.convert(job.image.data() + first * job.pixelBytes, job.gray.data() + first, count);
+    if (job.compressResponse)
+        job.packedLengths[chunk] = compressChunk(job.gray.data() + first, count, 1,
+                                                 job.packed.data() + chunk * compressedChunkBound(COMPRESSION_CHUNK_PIXELS));
+}
+
+// Function to size the buffers of an image processed chunk by chunk; returns the number of chunks
+size_t prepareChunks(ImageJob &job)
 {
-    // Loop through all buckets to send them one by one.
-    for (int i = 0; i < BUCKETS; i++) 
+    size_t pixels = requestPixels(job.request);
+    size_t chunks = compressionChunkCount(pixels, 1);
+    if (job.request.flags & REQUEST_FLAG_COMPRESSED)
     {
-        // Send the current bucket's data over the network using the send() function.
-        ssize_t bytes_sent = send(sock, buckets[i].data(), BUCKET_SIZE, 0);
-        if (bytes_sent < 0) 
-        { // Check if the send() operation failed.
-            perror("send failed"); // Print an error message using perror.
-            return false; // Return false to indicate the failure to send data.
+        job.upload = move(job.image); // The compressed bytes as received; the pixels are decoded next to them.
+        job.image.resize(pixels * job.pixelBytes);
+    }
+    if (job.compressResponse)
+    {
+        job.packed.resize(chunks * compressedChunkBound(COMPRESSION_CHUNK_PIXELS)); // Chunks are compressed in parallel.
+        job.packedLengths.assign(chunks, 0);
+    }
+    return chunks;
+}
+
+// Function to close the gaps between the compressed chunks of a response and send them in place of the gray bytes.
+// Gray bytes that did not get smaller (noise) are sent as they are, so a compressed result is always shorter than the raw one.
+void packResponse(ImageJob &job)
+{
+    size_t slot = compressedChunkBound(COMPRESSION_CHUNK_PIXELS), end = 0;
+    for (size_t c = 0; c < job.packedLengths.size(); c++)
+        end += job.packedLengths[c];
+    if (end >= job.gray.size())
+    {
+        job.compressResponse = false;
+        job.packed.release();
+        return;
+    }
+    end = 0;
+    for (size_t c = 0; c < job.packedLengths.size(); c++)
+    {
+        memmove(job.packed.data() + end, job.packed.data() + c * slot, job.packedLengths[c]);
+        end += job.packedLengths[c];
+    }
+    job.packed.resize(end);
+    job.gray = move(job.packed);
+    job.buckets.assign(1, BucketView{0, end}); // One stream: the bucket boundaries are only known after decoding.
+}
+
+// Function to process a fully received image on the I/O thread: grayscale conversion followed by bucketing
+void processImage(ImageJob &job)
+{
+    size_t pixels = requestPixels(job.request); // Pixels received (only those of the shard for a partial request).
+    uint64_t start = nowNanoseconds();
+    if ((job.request.flags & REQUEST_FLAG_COMPRESSED) || job.compressResponse)
+    {
+        job.gray.resize(pixels);
+        for (size_t c = 0, chunks = prepareChunks(job); c < chunks && !job.corrupt; c++)
+            processChunk(job, c);
+        stats.recordStage(STAGE_GRAYSCALE, start);
+        job.buckets = requestBuckets(job.request);
+        if (job.compressResponse && !job.corrupt)
+            packResponse(job);
+        return;
+    }
+    if (job.output.mapped())
+    {
+        job.convert(job.input.data(), job.output.data(), pixels); // From the client's memory straight into the client's memory.
+        stats.recordStage(STAGE_GRAYSCALE, start);
+        job.buckets = requestBuckets(job.request); // Only for the log: no bytes of them are sent.
+        return;
+    }
+    job.gray = convertToGrayscale(job.image, pixels, job.convert); // Process the image to convert it to grayscale.
+    stats.recordStage(STAGE_GRAYSCALE, start);
+    start = nowNanoseconds();
+    if (job.request.flags & REQUEST_FLAG_INTENSITY_BUCKETS)
+    {
+        PooledBuffer result(responsePayloadLength(job.request));
+        bucketByIntensity(job.gray.data(), pixels, job.image.data() + pixels * job.pixelBytes, job.request.buckets, result.data());
+        job.gray = move(result);
+    }
+    job.buckets = requestBuckets(job.request); // Describe the requested buckets as views into the gray image.
+    stats.recordStage(STAGE_PARTITION, start);
+}
+
+// Function to split the buckets of an image into tiles of about TILE_PIXELS pixels for the workers.
+// Large buckets are cut into equal slices and small neighbouring buckets share a tile, so every task stays cache-sized.
+vector<BucketView> planTiles(const vector<BucketView> &buckets)
+{
+    vector<BucketView> tiles; // Pixel ranges, in image order.
+    for (const BucketView &bucket : buckets)
+    {
+        if (!tiles.empty() && tiles.back().length + bucket.length <= TILE_PIXELS)
+        {
+            tiles.back().length += bucket.length; // Buckets are contiguous, so a small one extends the previous tile.
+            continue;
+        }
+        uint64_t slices = max<uint64_t>(1, (bucket.length + TILE_PIXELS - 1) / TILE_PIXELS); // Tiles needed for this bucket.
+        for (uint64_t k = 0; k < slices; k++)
+        {
+            uint64_t start = bucket.length * k / slices; // Equal slices, like bucketRange().
+            uint64_t end = bucket.length * (k + 1) / slices;
+            tiles.push_back({bucket.offset + start, end - start});
+        }
+    }
+    return tiles;
+}
+
+// Function to hand a finished job to the I/O thread and wake it up (called on a worker)
+void postCompletion(CompletionQueue &completions, shared_ptr<ImageJob> job)
+{
+    {
+        lock_guard<mutex> guard(completions.lock);
+        completions.finished.push_back(move(job));
+    }
+    uint64_t one = 1; // Adds to the eventfd counter, which makes it readable.
+    if (write(completions.event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write failed");
+}
+
+// Function to bucket a converted image by intensity on the worker pool (called on the worker that converted the last tile):
+// the prefix sums over the tile histograms run here, then every tile scatters its pixel indices as its own task
+void scatterIntensityJob(ThreadPool &pool, CompletionQueue &completions, shared_ptr<ImageJob> job)
+{
+    job->scatterStart = nowNanoseconds();
+    uint32_t buckets = job->request.buckets;
+    job->intensity.resize(responsePayloadLength(job->request));
+    prefixIntensityParts(job->histograms, job->intensityMap, buckets, job->cursors, job->intensity.data());
+    job->remainingTiles = job->tiles.size();
+    for (size_t t = 0; t < job->tiles.size(); t++)
+    {
+        pool.submit([job, t, buckets, &completions]()
+        {
+            scatterIntensityIndices(job->gray.data(), job->tiles[t].offset, job->tiles[t].length, job->intensityMap,
+                                    job->cursors.data() + t * buckets, job->intensity.data() + intensityIndexOffset(buckets));
+            if (job->remainingTiles.fetch_sub(1, memory_order_acq_rel) == 1)
+            {
+                job->gray = move(job->intensity); // The response sends the result in place of the gray image.
+                stats.recordStage(STAGE_PARTITION, job->scatterStart);
+                postCompletion(completions, job);
+            }
+        });
+    }
+}
+
+// Function to convert a received image on the worker pool, one tile per task
+void submitImageJob(ServerContext &server, shared_ptr<ImageJob> job)
+{
+    bool intensity = (job->request.flags & REQUEST_FLAG_INTENSITY_BUCKETS) != 0;
+    size_t pixels = requestPixels(job->request);
+    if (!job->output.mapped())
+        job->gray.resize(pixels); // Every tile writes its own part of the gray image.
+    if (intensity)
+    {
+        job->buckets = requestBuckets(job->request);
+        job->tiles = planTiles(vector<BucketView>(1, BucketView{0, pixels})); // Intensity buckets say nothing about position.
+        job->histograms.resize(job->tiles.size());
+        intensityBucketMap(job->image.data() + pixels * job->pixelBytes, job->request.buckets, job->intensityMap);
+        job->remainingTiles = job->tiles.size();
+        job->submitted = nowNanoseconds();
+        CompletionQueue &completions = server.completions;
+        ThreadPool &pool = *server.pool; // Outlives the tasks: it drains them before it is destroyed.
+        for (size_t t = 0; t < job->tiles.size(); t++)
+        {
+            pool.submit([job, t, &pool, &completions]()
+            {
+                const BucketView &tile = job->tiles[t];
+                job->convert(job->image.data() + tile.offset * job->pixelBytes, job->gray.data() + tile.offset, tile.length);
+                countIntensities(job->gray.data() + tile.offset, tile.length, job->histograms[t]); // While the tile is in L2.
+                if (job->remainingTiles.fetch_sub(1, memory_order_acq_rel) == 1)
+                {
+                    stats.recordStage(STAGE_GRAYSCALE, job->submitted);
+                    scatterIntensityJob(pool, completions, job); // Last tile: all histograms are complete.
+                }
+            });
+        }
+        return;
+    }
+    if ((job->request.flags & REQUEST_FLAG_COMPRESSED) || job->compressResponse)
+    {
+        job->buckets = requestBuckets(job->request);
+        size_t chunks = prepareChunks(*job); // One task per chunk: decoding and compressing need chunk boundaries.
+        job->remainingTiles = chunks;
+        job->submitted = nowNanoseconds();
+        CompletionQueue &completions = server.completions;
+        for (size_t c = 0; c < chunks; c++)
+        {
+            server.pool->submit([job, c, &completions]()
+            {
+                processChunk(*job, c);
+                if (job->remainingTiles.fetch_sub(1, memory_order_acq_rel) == 1)
+                {
+                    stats.recordStage(STAGE_GRAYSCALE, job->submitted);
+                    if (job->compressResponse && !job->corrupt)
+                        packResponse(*job); // Off the I/O thread, which only sends the result.
+                    postCompletion(completions, job);
+                }
+            });
+        }
+        return;
+    }
+    uint64_t start = nowNanoseconds();
+    job->buckets = requestBuckets(job->request); // Describe the requested buckets as views into the gray image.
+    stats.recordStage(STAGE_PARTITION, start);
+    vector<BucketView> tiles = planTiles(job->buckets);
+    job->remainingTiles = tiles.size();
+    job->submitted = nowNanoseconds();
+    CompletionQueue &completions = server.completions; // Outlives the pool, see ServerContext.
+    // A shared-memory request is converted in place: the tiles read and write the client's memory files.
+    const unsigned char *in = job->input.mapped() ? job->input.data() : job->image.data();
+    unsigned char *out = job->output.mapped() ? job->output.data() : job->gray.data();
+    for (const BucketView &tile : tiles)
+    {
+        server.pool->submit([job, tile, in, out, &completions]()
+        {
+            job->convert(in + tile.offset * job->pixelBytes, out + tile.offset, tile.length);
+            if (job->remainingTiles.fetch_sub(1, memory_order_acq_rel) == 1)
+            {
+                stats.recordStage(STAGE_GRAYSCALE, job->submitted); // From queueing the first tile to finishing the last.
+                postCompletion(completions, job); // Last tile: the whole gray image is ready.
+            }
+        });
+    }
+}
+
+// Function to decide whether a response of 'bytes' gray bytes is sent with MSG_ZEROCOPY, enabling it on the socket if needed
+bool useZerocopy(Connection &conn, size_t bytes, const ServerConfig &config)
+{
+    if (config.zerocopyThreshold == 0 || bytes < config.zerocopyThreshold)
+        return false;
+    int one = 1; // Large responses let the kernel send straight from our pages instead of copying them.
+    if (!conn.zerocopyEnabled)
+        conn.zerocopyEnabled = setsockopt(conn.fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    return conn.zerocopyEnabled;
+}
+
+// Function to account for a response sent compressed
+void countCompressedResponse(const RequestHeader &request, uint64_t packedLength)
+{
+    ServerStats::add(stats.compressedResponses);
+    ServerStats::add(stats.compressedResponseBytes, packedLength);
+    ServerStats::add(stats.compressedResponseRaw, responsePayloadLength(request));
+}
+
+// Function to take over the results of a processed image and queue its response (on the I/O thread)
+void finishImage(ServerContext &server, Connection &conn, ImageJob &job)
+{
+    Response response; // Owns the gray image the buckets point into.
+    response.requestId = job.request.requestId;
+    response.requestStart = job.requestStart;
+    conn.inFlight--; // The image has left the workers.
+    if (job.corrupt)
+    {
+        prepareResponse(job.request, STATUS_CORRUPT_PAYLOAD, response.header); // The session itself is still in step.
+        ServerStats::add(stats.requestsRejected);
+        conn.responses.push_back(move(response));
+        return;
+    }
+    if (job.output.mapped())
+    {
+        if (verboseLogging)
+            printBucketsSummary(job.output.data(), job.buckets);
+        prepareResponse(job.request, STATUS_OK, response.header); // The header alone tells the client its gray bytes are ready.
+        response.inSharedMemory = true;
+        ServerStats::add(stats.sharedMemoryRequests);
+        ServerStats::add(stats.sharedMemoryBytes, job.input.size() + job.output.size());
+        conn.responses.push_back(move(response)); // The mappings go with the job.
+        return;
+    }
+    response.gray = make_shared<const PooledBuffer>(move(job.gray));
+    response.buckets = move(job.buckets);
+    job.image.release(); // The RGB data is no longer needed once the buckets exist; the next request can reuse it.
+    if (job.cacheable)
+    {
+        server.cache.insert(job.cacheKey, resultShape(job.request), response.gray, job.compressResponse); // Shared with the response, not copied.
+        stats.cacheEntries.store(server.cache.size(), memory_order_relaxed);
+        stats.cacheBytes.store(server.cache.bytes(), memory_order_relaxed);
+    }
+    if (job.request.flags & REQUEST_FLAG_COMPRESSED)
+    {
+        ServerStats::add(stats.compressedRequests);
+        ServerStats::add(stats.compressedRequestBytes, job.request.payloadLength);
+        ServerStats::add(stats.compressedRequestRaw, requestPayloadLength(job.request));
+    }
+    if (verboseLogging && !(job.request.flags & REQUEST_FLAG_INTENSITY_BUCKETS) && !job.compressResponse)
+        printBucketsSummary(response.gray->data(), response.buckets); // Print a brief summary (first 10 values) of each bucket to the console.
+    prepareResponse(job.request, STATUS_OK, response.header, job.compressResponse ? response.gray->size() : 0); // The buckets are preceded by a header describing them.
+    if (job.compressResponse)
+        countCompressedResponse(job.request, response.gray->size());
+    response.zerocopy = useZerocopy(conn, response.gray->size(), server.config);
+    conn.responses.push_back(move(response)); // Sent after any response finished before it.
+}
+
+// Function to answer the current request of a connection from the result cache; false on a miss
+bool answerFromCache(ServerContext &server, Connection &conn, uint64_t key)
+{
+    bool compressed = false; // Cached as it was sent.
+    ResultCache::Result gray = server.cache.find(key, resultShape(conn.request), compressed);
+    if (gray && compressed && !compressesResponse(server.config, conn.request))
+        gray.reset(); // Only a client that accepts compressed gray bytes can take this one.
+    ServerStats::add(gray ? stats.cacheHits : stats.cacheMisses);
+    if (!gray)
+        return false;
+    Response response; // Sends the cached gray bytes; nothing is converted.
+    response.requestId = conn.request.requestId;
+    response.requestStart = conn.requestStart;
+    response.gray = move(gray);
+    if (compressed)
+    {
+        response.buckets.assign(1, BucketView{0, response.gray->size()}); // One compressed stream, as it was sent first.
+        prepareResponse(conn.request, STATUS_OK, response.header, response.gray->size());
+        countCompressedResponse(conn.request, response.gray->size());
+    }
+    else
+    {
+        response.buckets = requestBuckets(conn.request);
+        prepareResponse(conn.request, STATUS_OK, response.header);
+    }
+    response.zerocopy = useZerocopy(conn, response.gray->size(), server.config);
+    if (verboseLogging)
+        cout << "Cache hit (request " << conn.request.requestId << ", fd " << conn.fd << ")." << endl;
+    conn.responses.push_back(move(response));
+    return true;
+}
+
+// Function to send as much of a response (header and buckets) as the socket currently accepts.
+// The header and up to MAX_SEND_IOVECS buckets go out in a single sendmsg() straight from the gray buffer.
+IoStatus sendBucketsData(Connection &conn, Response &response)
+{
+    size_t total = HEADER_SIZE; // Size of the whole response.
+    for (const BucketView &bucket : response.buckets)
+        total += bucket.length;
+    while (response.sent < total)
+    {
+        iovec iov[MAX_SEND_IOVECS + 1]; // Unsent part of the header plus the next buckets.
+        int count = 0;
+        if (response.sent < HEADER_SIZE)
+            iov[count++] = {response.header + response.sent, HEADER_SIZE - response.sent};
+        size_t position = HEADER_SIZE; // Offset of the current bucket within the response.
+        for (size_t i = 0; i < response.buckets.size() && count <= MAX_SEND_IOVECS; i++)
+        {
+            const BucketView &bucket = response.buckets[i];
+            if (response.sent < position + bucket.length)
+            {
+                size_t skip = response.sent > position ? response.sent - position : 0; // Part of the bucket already sent.
+                iov[count++] = {const_cast<unsigned char *>(response.gray->data()) + bucket.offset + skip, bucket.length - skip}; // sendmsg() only reads it.
+            }
+            position += bucket.length;
+        }
+        msghdr msg {}; // Scatter-gather description of the data to send.
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        // MSG_NOSIGNAL avoids SIGPIPE if the client has gone away.
+        ssize_t bytes_sent = sendmsg(conn.fd, &msg, MSG_NOSIGNAL | (response.zerocopy ? MSG_ZEROCOPY : 0));
+        if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return IoStatus::PENDING; // The socket buffer is full; continue when it drains.
+        if (bytes_sent < 0 && errno == EINTR)
+            continue; // Interrupted by a signal; simply retry.
+        if (bytes_sent < 0 && errno == ENOBUFS && response.zerocopy)
+        {
+            response.zerocopy = false; // The kernel ran out of zero-copy resources; fall back to copying sends.
+            continue;
+        }
+        if (bytes_sent < 0)
+        { // Check if the sendmsg() operation failed.
+            if (verboseLogging)
+                perror("send failed"); // Print an error message using perror.
+            return IoStatus::FAILED; // Indicate the failure to send data.
+        }
+        if (response.zerocopy)
+            conn.zerocopySends++; // Each successful zero-copy call is reported back once on the error queue.
+        response.sent += bytes_sent; // Track short writes so the rest is sent later.
+        ServerStats::add(stats.bytesSent, bytes_sent);
+    }
+    if (verboseLogging)
+        cout << "Sent " << response.buckets.size() << " buckets (" << total - HEADER_SIZE << " bytes, request " << response.requestId
+             << ", fd " << conn.fd << ")." << endl; // Log the successful transmission.
+    return IoStatus::COMPLETE; // All buckets were sent successfully.
+}
+
+// Function to send the queued responses of a connection, oldest first, until the socket buffer is full
+IoStatus sendResponses(Connection &conn)
+{
+    while (!conn.responses.empty())
+    {
+        Response &response = conn.responses.front();
+        if (response.sendStart == 0)
+            response.sendStart = nowNanoseconds(); // Start of the send stage.
+        IoStatus status = sendBucketsData(conn, response);
+        if (status != IoStatus::COMPLETE)
+            return status;
+        response.zerocopyMark = conn.zerocopySends; // Its pages are free once every send so far is reported complete.
+        conn.retired.push_back(move(response)); // Moving keeps the gray buffer where the kernel expects it.
+        conn.responses.pop_front();
+    }
+    return IoStatus::COMPLETE;
+}
+
+// Function to free sent responses once the kernel is done with their pages, and account for them
+void releaseResponses(Connection &conn)
+{
+    while (!conn.retired.empty() && conn.zerocopyCompleted >= conn.retired.front().zerocopyMark)
+    {
+        Response &response = conn.retired.front();
+        stats.recordStage(STAGE_SEND, response.sendStart);
+        if (!response.buckets.empty() || response.inSharedMemory)
+        {
+            stats.recordStage(STAGE_REQUEST, response.requestStart);
+            ServerStats::add(stats.requestsCompleted);
+        }
+        conn.retired.pop_front();
+    }
+}
+
+// Function to collect MSG_ZEROCOPY completion notices from the socket's error queue; false on a real socket error
+bool drainZerocopyCompletions(Connection &conn)
+{
+    while (true)
+    {
+        char control[128]; // Room for the control message carrying the notice.
+        msghdr msg {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(conn.fd, &msg, MSG_ERRQUEUE) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK; // An empty queue means everything was collected.
+        }
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            bool ipError = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                           (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if (!ipError)
+                continue;
+            const sock_extended_err *err = reinterpret_cast<const sock_extended_err *>(CMSG_DATA(cm));
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                return false; // A genuine error was queued.
+            conn.zerocopyCompleted += err->ee_data - err->ee_info + 1; // Notices cover a range of send calls.
+        }
+    }
+}
+
+// Function to prepare a streaming request: a band-sized RGB buffer and room for a few converted bands
+void startStreaming(Connection &conn)
+{
+    size_t rowBytes = size_t(conn.request.width) * conn.pixelBytes; // One row of pixels.
+    size_t bandRows = max<size_t>(1, STREAM_BAND_BYTES / rowBytes); // Whole rows per band, at least one.
+    conn.image.resize(bandRows * rowBytes); // Only one band of RGB is held at a time.
+    conn.gray.resize(bandRows * conn.request.width * STREAM_QUEUED_BANDS); // Converted bands waiting to be sent.
+    prepareResponse(conn.request, STATUS_OK, conn.responseBytes); // The header can go out before any pixel has been converted.
+    conn.responseSent = 0;
+}
+
+// Function to advance a streaming request: each band of RGB is converted as soon as it has arrived and its
+// gray bytes are sent straight away, so buckets leave while later rows are still on their way in.
+// Reading pauses while STREAM_QUEUED_BANDS converted bands are waiting for a slow client.
+IoStatus streamImageData(Connection &conn, bool &wantRead, bool &wantWrite)
+{
+    while (true)
+    {
+        // Send the response header, then every converted byte that has not been sent yet.
+        IoStatus out = sendBytes(conn.fd, conn.responseBytes, HEADER_SIZE, conn.responseSent);
+        if (out == IoStatus::COMPLETE)
+            out = sendBytes(conn.fd, conn.gray.data(), conn.grayTail, conn.grayHead);
+        if (out == IoStatus::FAILED)
+            return IoStatus::FAILED;
+        if (conn.grayHead == conn.grayTail)
+            conn.grayHead = conn.grayTail = 0; // Everything converted so far has been sent; reuse the buffer from the start.
+
+        if (conn.received == conn.request.payloadLength)
+        {
+            wantRead = false; // The whole image has arrived; only sending remains.
+            wantWrite = out == IoStatus::PENDING;
+            return out;
+        }
+
+        // Make room for the gray bytes of the band being received.
+        size_t bandSize = min<size_t>(conn.image.size(), conn.request.payloadLength - (conn.received - conn.bandFilled));
+        size_t bandPixels = bandSize / conn.pixelBytes;
+        if (conn.grayTail + bandPixels > conn.gray.size() && conn.grayHead > 0)
+        {
+            memmove(conn.gray.data(), conn.gray.data() + conn.grayHead, conn.grayTail - conn.grayHead); // Move the unsent bytes to the front.
+            conn.grayTail -= conn.grayHead;
+            conn.grayHead = 0;
+        }
+        if (conn.grayTail + bandPixels > conn.gray.size())
+        {
+            wantRead = false; // The client is not keeping up; stop reading until it has caught up.
+            wantWrite = true;
+            return IoStatus::PENDING;
+        }
+
+        // Receive the rest of the current band.
+        size_t before = conn.bandFilled;
+        IoStatus in = receiveBytes(conn.fd, conn.image.data(), bandSize, conn.bandFilled);
+        conn.received += conn.bandFilled - before; // Keep the total for the whole image up to date.
+        if (in == IoStatus::FAILED)
+        {
+            if (verboseLogging)
+                cerr << "Failed to receive image data (fd " << conn.fd << ")." << endl;
+            return IoStatus::FAILED;
+        }
+        if (in == IoStatus::PENDING)
+        {
+            wantRead = true; // Wait for the rest of the band.
+            wantWrite = out == IoStatus::PENDING;
+            return IoStatus::PENDING;
+        }
+
+        // The band is complete: convert it right away and loop around to send it.
+        conn.convert(conn.image.data(), conn.gray.data() + conn.grayTail, bandPixels);
+        conn.grayTail += bandPixels;
+        conn.bandFilled = 0; // The next band starts empty.
+    }
+}
+
+// Function to change the events a connection is watched for, skipping the system call when nothing changes
+bool setConnectionEvents(int epoll_fd, Connection &conn, uint32_t events)
+{
+    if (conn.watchedEvents == events)
+        return true; // Already registered this way.
+    conn.watchedEvents = events;
+    return watchDescriptor(epoll_fd, conn.fd, events, false);
+}
+
+// Function to update the events a connection is watched for from what it is waiting for
+bool updateConnectionEvents(ServerContext &server, Connection &conn)
+{
+    uint32_t events = 0;
+    if (!conn.readDone && conn.inFlight + conn.responses.size() < MAX_PIPELINED_REQUESTS)
+        events |= EPOLLIN | EPOLLRDHUP; // Room for another request.
+    if (conn.writeBlocked && !conn.responses.empty())
+        events |= EPOLLOUT; // Wait for free space in the send buffer.
+    return setConnectionEvents(server.epoll_fd, conn, events);
+}
+
+// Function to close a client connection and forget its state
+void closeConnection(ServerContext &server, int fd)
+{
+    auto it = server.connections.find(fd);
+    if (it != server.connections.end())
+    {
+        Connection &conn = it->second;
+        uint64_t unanswered = conn.inFlight + conn.responses.size() + (conn.headerReceived > 0 ? 1 : 0);
+        ServerStats::add(stats.requestsAborted, unanswered); // Requests that were started but never answered.
+        stats.connectionsActive.fetch_sub(1, memory_order_relaxed);
+        closeDescriptors(conn.passedFds); // Memory files of a request that was never taken in.
+    }
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, fd, nullptr); // Stop watching the socket.
+    close(fd); // Close the connection with the client.
+    server.connections.erase(fd); // Release the buffers held by the connection (a job still on the workers keeps its own).
+}
+
+// Function to get a connection ready for the next request of its session once the current one has been taken in
+void finishReceiving(ServerContext &server, Connection &conn)
+{
+    conn.state = ConnectionState::RECEIVING_HEADER;
+    conn.headerReceived = 0;
+    conn.received = 0;
+    conn.hashing = false;
+    if (!conn.keepAlive || server.draining)
+        conn.readDone = true; // That was the last request on this connection.
+}
+
+// Function to hand a fully received image to the worker pool (or process it right here without one)
+void dispatchImage(ServerContext &server, Connection &conn, bool cacheable, uint64_t key)
+{
+    shared_ptr<ImageJob> job = make_shared<ImageJob>(); // Takes over the image for the duration of the processing.
+    job->fd = conn.fd;
+    job->connectionId = conn.id;
+    job->request = conn.request;
+    job->requestStart = conn.requestStart;
+    job->cacheable = cacheable;
+    job->cacheKey = key;
+    job->image = move(conn.image);
+    job->pixelBytes = conn.pixelBytes;
+    job->convert = conn.convert;
+    job->chunkOffsets.swap(conn.chunkOffsets); // Both keep their storage for the next compressed request.
+    job->input = move(conn.sharedInput);
+    job->output = move(conn.sharedOutput);
+    job->compressResponse = compressesResponse(server.config, conn.request);
+    conn.inFlight++;
+    finishReceiving(server, conn);
+    if (server.pool)
+    {
+        submitImageJob(server, job);
+        return; // collectCompletedJobs() queues the response.
+    }
+    processImage(*job); // Compute the buckets for this client right here.
+    finishImage(server, conn, *job);
+}
+
+// Function to map the two memory files passed with a shared-memory request (pixels, then gray bytes) and close the
+// descriptors; false if they are missing, unsealed or too small for the request
+bool mapSharedMemory(Connection &conn)
+{
+    uint64_t inputBytes = conn.request.payloadLength, outputBytes = responsePayloadLength(conn.request);
+    bool usable = conn.passedFds.size() == 2 && sealedRegionHolds(conn.passedFds[0], inputBytes) &&
+                  sealedRegionHolds(conn.passedFds[1], outputBytes) && conn.sharedInput.map(conn.passedFds[0], inputBytes, false) &&
+                  conn.sharedOutput.map(conn.passedFds[1], outputBytes, true);
+    closeDescriptors(conn.passedFds); // The mappings stay valid without them.
+    if (!usable)
+    {
+        conn.sharedInput.unmap();
+        conn.sharedOutput.unmap();
+    }
+    return usable;
+}
+
+// Function to answer the current request of a connection with an error status; the connection closes once it is sent
+void rejectRequest(Connection &conn, ResponseStatus status)
+{
+    if (verboseLogging)
+        cerr << "Rejected request: " << statusMessage(status) << " (fd " << conn.fd << ")." << endl;
+    ServerStats::add(stats.requestsRejected);
+    Response response; // An error header without buckets.
+    prepareResponse(conn.request, status, response.header);
+    response.requestId = conn.request.requestId;
+    response.requestStart = conn.requestStart;
+    conn.responses.push_back(move(response)); // Tell the client why, then close.
+    conn.readDone = true;
+    conn.state = ConnectionState::RECEIVING_HEADER;
+    conn.headerReceived = 0;
+    conn.hashing = false;
+}
+
+// Function to take in the next request of a connection: its header, then its image, which is handed off for processing.
+// COMPLETE means the request has been taken in (dispatched, rejected, or switched to streaming).
+IoStatus receiveRequest(ServerContext &server, Connection &conn)
+{
+    if (conn.state == ConnectionState::RECEIVING_HEADER)
+    {
+        IoStatus status = receiveRequestHeader(conn); // Read whatever part of the header is available.
+        if (status != IoStatus::COMPLETE)
+            return status;
+        conn.keepAlive = (conn.request.flags & REQUEST_FLAG_KEEP_ALIVE) != 0;
+        ResponseStatus check = validateRequestHeader(conn.request); // Reject bad headers before allocating anything.
+        bool streaming = (conn.request.flags & REQUEST_FLAG_STREAMING) != 0;
+        if (check == STATUS_OK && streaming && (conn.inFlight > 0 || !conn.responses.empty()))
+            check = STATUS_UNSUPPORTED_FLAGS; // Streaming cannot share the connection with pipelined responses.
+        if (check == STATUS_OK && (conn.request.flags & REQUEST_FLAG_COMPRESSED) && !server.config.compression)
+            check = STATUS_UNSUPPORTED_FLAGS; // Compressed uploads were switched off (--compression off).
+        bool shared = (conn.request.flags & REQUEST_FLAG_SHARED_MEMORY) != 0;
+        if (check == STATUS_OK && shared && !conn.local)
+            check = STATUS_UNSUPPORTED_FLAGS; // Memory files can only be passed over the Unix domain socket.
+        if (check == STATUS_OK && shared && !mapSharedMemory(conn))
+            check = STATUS_BAD_SHARED_MEMORY;
+        closeDescriptors(conn.passedFds); // Only shared-memory requests take descriptors.
+        if (check != STATUS_OK)
+        {
+            rejectRequest(conn, check); // The bytes after a bad header cannot be trusted.
+            return IoStatus::COMPLETE;
+        }
+        conn.pixelBytes = bytesPerPixel(conn.request.pixelFormat);
+        conn.convert = requestLumaKernel(conn.request); // Chosen once here, not per tile or pixel.
+        if (shared)
+        {
+            stats.recordStage(STAGE_RECEIVE, conn.requestStart); // The header was all there was to receive.
+            dispatchImage(server, conn, false, 0); // The pixels are already in place; results of shared memory are not cached.
+            return IoStatus::COMPLETE;
+        }
+        if (streaming)
+        {
+            startStreaming(conn); // Band-sized buffers instead of the whole frame.
+            conn.state = ConnectionState::STREAMING;
+            conn.readDone = true; // The stream ends the connection.
+            return IoStatus::COMPLETE;
+        }
+        conn.image.resize(conn.request.payloadLength); // Size the buffer from the validated header.
+        conn.state = ConnectionState::RECEIVING_IMAGE;
+        conn.hashing = server.cache.enabled() && !(conn.request.flags & REQUEST_FLAG_HASH_ONLY);
+        conn.hasher.reset();
+    }
+    IoStatus status = receiveImageData(conn); // Read whatever part of the image is available.
+    if (status != IoStatus::COMPLETE)
+        return status;
+    if (conn.request.flags & REQUEST_FLAG_HASH_ONLY)
+    {
+        uint64_t key = cacheKey(conn.request, getBigEndian(conn.image.data(), CONTENT_HASH_SIZE)); // The client hashed the pixels.
+        if (!answerFromCache(server, conn, key))
+        {
+            Response response; // Not an error: the client follows up with the pixels.
+            prepareResponse(conn.request, STATUS_NOT_CACHED, response.header);
+            response.requestId = conn.request.requestId;
+            response.requestStart = conn.requestStart;
+            conn.responses.push_back(move(response));
+        }
+        finishReceiving(server, conn);
+        return IoStatus::COMPLETE;
+    }
+    if ((conn.request.flags & REQUEST_FLAG_INTENSITY_BUCKETS) &&
+        !validIntensityThresholds(conn.image.data() + requestPixels(conn.request) * conn.pixelBytes, conn.request.buckets))
+    {
+        rejectRequest(conn, STATUS_INVALID_BUCKETS); // Only known once the thresholds behind the pixels have arrived.
+        return IoStatus::COMPLETE;
+    }
+    if ((conn.request.flags & REQUEST_FLAG_COMPRESSED) &&
+        !locateChunks(conn.image.data(), conn.image.size(), requestPayloadLength(conn.request), conn.pixelBytes, conn.chunkOffsets))
+    {
+        rejectRequest(conn, STATUS_CORRUPT_PAYLOAD); // The chunk lengths do not add up; the workers could not split it.
+        return IoStatus::COMPLETE;
+    }
+    if (conn.hashing)
+    {
+        uint64_t key = cacheKey(conn.request, conn.hasher.digest()); // The pixels were hashed while they arrived.
+        if (answerFromCache(server, conn, key))
+        {
+            finishReceiving(server, conn); // A repeated frame: nothing to convert.
+            return IoStatus::COMPLETE;
+        }
+        dispatchImage(server, conn, true, key); // The result is cached once it has been computed.
+        return IoStatus::COMPLETE;
+    }
+    dispatchImage(server, conn, false, 0); // The whole image is here; it can now be processed.
+    return IoStatus::COMPLETE;
+}
+
+// Function to advance a client's state machine after its socket reported readiness
+void handleClientEvent(ServerContext &server, int fd, uint32_t events)
+{
+    auto it = server.connections.find(fd); // Look up the state belonging to this socket.
+    if (it == server.connections.end())
+        return; // The connection was already closed earlier in this batch of events.
+    Connection &conn = it->second; // Work on the connection in place.
+
+    // With MSG_ZEROCOPY, EPOLLERR also signals completion notices waiting on the error queue.
+    if ((events & EPOLLERR) && conn.zerocopySends > 0 && drainZerocopyCompletions(conn))
+        events &= ~EPOLLERR; // Only completions were queued, not an error.
+
+    // Errors and full hang-ups end the connection. A client that only shuts down its sending side (EPOLLRDHUP) after
+    // its request is done sending, not gone: it still gets its answer, and the receive below sees the end of input.
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        if (verboseLogging)
+            cerr << "Client disconnected early (fd " << fd << ")." << endl; // The client went away before being fully served.
+        closeConnection(server, fd); // Clean up its resources.
+        return;
+    }
+
+    // Step 1: Take in requests (header, then image) while the pipeline has room.
+    while (!conn.readDone && conn.inFlight + conn.responses.size() < MAX_PIPELINED_REQUESTS)
+    {
+        IoStatus status = receiveRequest(server, conn);
+        if (status == IoStatus::PENDING)
+            break; // Wait for more data to arrive.
+        if (status == IoStatus::FAILED)
+        {
+            if (conn.keepAlive && conn.state == ConnectionState::RECEIVING_HEADER && conn.headerReceived == 0)
+            {
+                conn.readDone = true; // A session ends when the client stops sending between requests.
+                break;
+            }
+            closeConnection(server, fd); // Drop the client if reception failed.
+            return;
+        }
+    }
+
+    // Streaming mode: receive, convert and send band by band until the whole image has been sent.
+    if (conn.state == ConnectionState::STREAMING)
+    {
+        bool wantRead = false, wantWrite = false; // What the stream is waiting for.
+        IoStatus status = streamImageData(conn, wantRead, wantWrite);
+        if (status == IoStatus::PENDING)
+        {
+            if (!setConnectionEvents(server.epoll_fd, conn, (wantRead ? uint32_t(EPOLLIN | EPOLLRDHUP) : 0u) | (wantWrite ? uint32_t(EPOLLOUT) : 0u)))
+                closeConnection(server, fd);
+            return;
+        }
+        if (status == IoStatus::COMPLETE)
+        {
+            conn.headerReceived = 0; // Answered.
+            stats.recordStage(STAGE_REQUEST, conn.requestStart); // Receiving, converting and sending overlap, so only the total is timed.
+            ServerStats::add(stats.requestsCompleted);
+            if (verboseLogging)
+                cout << "Streamed " << conn.request.payloadLength / conn.pixelBytes << " gray bytes. Connection closed (fd " << fd << ")." << endl;
+        }
+        closeConnection(server, fd); // Close the connection after success or failure.
+        return;
+    }
+
+    // Step 2: Send the finished responses, in the order they were finished, as far as the socket allows right now.
+    if (!conn.responses.empty())
+    {
+        IoStatus status = sendResponses(conn);
+        if (status == IoStatus::FAILED)
+        {
+            closeConnection(server, fd);
+            return;
+        }
+        conn.writeBlocked = status == IoStatus::PENDING;
+    }
+    releaseResponses(conn); // Sent buffers the kernel no longer needs.
+
+    // Step 3: Close the connection once its last request has been answered, otherwise wait for what comes next.
+    // Buffers sent with MSG_ZEROCOPY are kept until the kernel has reported every send as complete.
+    if (conn.readDone && conn.inFlight == 0 && conn.responses.empty() && conn.retired.empty())
+    {
+        if (verboseLogging)
+            cout << "Processing complete. Connection closed (fd " << fd << ")." << endl; // Inform that this client has been served.
+        closeConnection(server, fd);
+        return;
+    }
+    if (!updateConnectionEvents(server, conn))
+        closeConnection(server, fd);
+}
+
+// Function to end every session once a shutdown was requested: idle connections close, busy ones after their current request
+void finishSessions(ServerContext &server)
+{
+    server.draining = true;
+    vector<int> fds; // Collected first, since handling a connection may close it.
+    for (auto &entry : server.connections)
+        fds.push_back(entry.first);
+    for (int fd : fds)
+    {
+        Connection &conn = server.connections[fd];
+        if (conn.state == ConnectionState::RECEIVING_HEADER && conn.headerReceived == 0)
+            conn.readDone = true; // Between requests: no further ones are read.
+        handleClientEvent(server, fd, 0); // Closes the connection if nothing is left to send.
+    }
+}
+
+// Function to hand finished jobs back to their connections and start sending the responses
+void collectCompletedJobs(ServerContext &server)
+{
+    uint64_t count; // Number of wake-ups; the list below is what matters.
+    while (read(server.completions.event_fd, &count, sizeof(count)) == sizeof(count)) {} // Reset the eventfd.
+    vector<shared_ptr<ImageJob>> finished; // Taken out of the queue so the workers are not blocked meanwhile.
+    {
+        lock_guard<mutex> guard(server.completions.lock);
+        finished.swap(server.completions.finished);
+    }
+    for (shared_ptr<ImageJob> &job : finished)
+    {
+        auto it = server.connections.find(job->fd);
+        if (it == server.connections.end() || it->second.id != job->connectionId)
+            continue; // The client disconnected while its image was being processed.
+        finishImage(server, it->second, *job);
+        handleClientEvent(server, job->fd, 0); // Start sending without waiting for the next readiness event.
+    }
+}
+
+// Function to accept connections to the statistics port; each one is answered once its request arrives
+void acceptStatsClients(int stats_fd, ServerContext &server)
+{
+    while (true)
+    {
+        int client_sock = accept4(stats_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0 && errno == EINTR)
+            continue;
+        if (client_sock < 0)
+            return; // Nothing more to accept (or an error, retried on the next readiness event).
+        if (!watchDescriptor(server.epoll_fd, client_sock, EPOLLIN | EPOLLRDHUP, true))
+        {
+            close(client_sock);
+            continue;
+        }
+        server.statsClients.insert(client_sock);
+    }
+}
+
+// Function to answer a statistics request with a snapshot and close the connection.
+// An HTTP GET (e.g. from curl) gets an HTTP response; any other line gets the bare JSON.
+void answerStatsClient(ServerContext &server, int fd)
+{
+    char request[MAX_STATS_REQUEST]; // Only the first bytes matter; the rest is discarded.
+    ssize_t length = recv(fd, request, sizeof(request), 0);
+    if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return; // Spurious wake-up; wait for the request.
+    if (length > 0)
+    {
+        string body = formatStatsJson(stats) + "\n";
+        string reply = length >= 4 && memcmp(request, "GET ", 4) == 0
+            ? "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\nContent-Length: " + to_string(body.size()) +
+                  "\r\nConnection: close\r\n\r\n" + body
+            : body;
+        // The reply is small enough for an empty socket buffer; a client that does not read it simply loses it.
+        if (send(fd, reply.data(), reply.size(), MSG_NOSIGNAL) < 0 && verboseLogging)
+            perror("statistics send failed");
+    }
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    server.statsClients.erase(fd);
+}
+
+// Function to check the kernel of every pixel format and weighting (luma.h) against a floating-point reference:
+// the average must match exactly, weighted luma may differ by one level where the fixed-point sum rounds the other way
+bool checkLumaKernels(const vector<unsigned char> &rgb)
+{
+    static const struct { uint16_t format; const char *name; int red, blue; } formats[] = {
+        {PIXEL_FORMAT_RGB8, "rgb8", 0, 2}, {PIXEL_FORMAT_BGR8, "bgr8", 2, 0}, {PIXEL_FORMAT_RGBA8, "rgba8", 0, 2},
+        {PIXEL_FORMAT_BGRA8, "bgra8", 2, 0}, {PIXEL_FORMAT_RGB16, "rgb16", 0, 2}, {PIXEL_FORMAT_RGBA16, "rgba16", 0, 2}};
+    const double weights[LUMA_WEIGHTINGS][3] = {{1, 1, 1}, {0.299, 0.587, 0.114}, {0.2126, 0.7152, 0.0722}};
+    const char *weightingNames[LUMA_WEIGHTINGS] = {"average", "bt601", "bt709"};
+    const size_t pixels = 1 << 20; // Bytes of the RGB table reused as pixels of every format.
+    vector<unsigned char> gray(pixels);
+    bool allPassed = true;
+    for (const auto &format : formats)
+    {
+        int pixelBytes = bytesPerPixel(format.format), depth = pixelBytes >= 6 ? 16 : 8;
+        for (int w = 0; w < LUMA_WEIGHTINGS; w++)
+        {
+            lumaKernel(format.format, LumaWeighting(w))(rgb.data(), gray.data(), pixels);
+            bool passed = true;
+            for (size_t i = 0; i < pixels && passed; i++)
+            {
+                const unsigned char *pixel = rgb.data() + i * pixelBytes;
+                double channel[3];
+                for (int c = 0; c < 3; c++)
+                {
+                    int offset = (c == 0 ? format.red : c == 2 ? format.blue : 1) * depth / 8;
+                    channel[c] = depth == 8 ? pixel[offset] : pixel[offset] * 256 + pixel[offset + 1];
+                }
+                double scale = depth == 8 ? 1 : 256; // 16-bit results keep their high byte.
+                double sum = weights[w][0] * channel[0] + weights[w][1] * channel[1] + weights[w][2] * channel[2];
+                long expected = w == LUMA_AVERAGE ? long(sum) / (3 * long(scale)) : long(floor(sum / scale + 0.5 / scale));
+                long difference = long(gray[i]) - min(expected, 255L);
+                passed = w == LUMA_AVERAGE ? difference == 0 : (difference >= -1 && difference <= 1);
+            }
+            cout << "Luma " << format.name << " " << weightingNames[w] << ": " << (passed ? "passed" : "FAILED") << endl;
+            allPassed = allPassed && passed;
+        }
+    }
+    return allPassed;
+}
+
+// Function to check the payload codec (compression.h): round trips at every pixel stride, including a partial last
+// block and a partial last chunk, and rejection of a truncated payload, a wrong length prefix and a bad bit width
+bool checkCompression()
+{
+    // Smooth rows with a noisy stretch, so blocks need every width from 0 to 8 bits.
+    const size_t maxBytes = (2 * COMPRESSION_CHUNK_PIXELS + 1000) * 8;
+    vector<unsigned char> raw(maxBytes);
+    uint32_t noise = 12345;
+    for (size_t i = 0; i < maxBytes; i++)
+    {
+        noise = noise * 1103515245 + 12345; // Fixed LCG, so every run checks the same bytes.
+        raw[i] = (i / 8192) % 4 == 3 ? static_cast<unsigned char>(noise >> 24) : static_cast<unsigned char>(i / 97 + (noise >> 30));
+    }
+    const int strides[] = {1, 3, 4, 6, 8};
+    const size_t pixelCounts[] = {1, 31, 33, COMPRESSION_CHUNK_PIXELS, COMPRESSION_CHUNK_PIXELS + 1, 2 * COMPRESSION_CHUNK_PIXELS + 1000};
+    bool allPassed = true;
+    for (int stride : strides)
+    {
+        bool passed = true;
+        for (size_t pixels : pixelCounts)
+        {
+            size_t rawBytes = pixels * stride;
+            vector<unsigned char> packed(compressedBound(rawBytes, stride) + 1, 0xAA);
+            size_t packedBytes = compressPayload(raw.data(), rawBytes, stride, packed.data());
+            vector<unsigned char> decoded(rawBytes + 1, 0xAA); // Sentinel to detect overruns.
+            vector<size_t> offsets;
+            passed = passed && packedBytes <= compressedBound(rawBytes, stride) && packed[packedBytes] == 0xAA;
+            passed = passed && locateChunks(packed.data(), packedBytes, rawBytes, stride, offsets) &&
+                     offsets.size() == compressionChunkCount(rawBytes, stride);
+            passed = passed && decompressPayload(packed.data(), packedBytes, stride, decoded.data(), rawBytes) &&
+                     equal(raw.begin(), raw.begin() + rawBytes, decoded.begin()) && decoded[rawBytes] == 0xAA;
+            // Chunk by chunk from the located offsets, the way the server decodes in parallel.
+            fill(decoded.begin(), decoded.end(), 0xAA);
+            for (size_t c = 0; c < offsets.size() && passed; c++)
+                passed = decompressChunk(packed.data() + offsets[c] + 4, compressedChunkLength(packed.data() + offsets[c]), stride,
+                                         decoded.data() + c * COMPRESSION_CHUNK_PIXELS * stride, compressionChunkBytes(rawBytes, stride, c));
+            passed = passed && equal(raw.begin(), raw.begin() + rawBytes, decoded.begin()) && decoded[rawBytes] == 0xAA;
+        }
+        cout << "Compression stride " << stride << ": " << (passed ? "passed" : "FAILED") << endl;
+        allPassed = allPassed && passed;
+    }
+
+    // Malformed payloads of two and a half chunks must be refused without touching memory outside the buffers.
+    const int stride = 3;
+    const size_t rawBytes = (2 * COMPRESSION_CHUNK_PIXELS + 1000) * stride;
+    vector<unsigned char> packed(compressedBound(rawBytes, stride));
+    size_t packedBytes = compressPayload(raw.data(), rawBytes, stride, packed.data());
+    vector<unsigned char> decoded(rawBytes);
+    vector<size_t> offsets;
+    auto rejected = [&](const vector<unsigned char> &bad, size_t badBytes)
+    {
+        return !locateChunks(bad.data(), badBytes, rawBytes, stride, offsets) &&
+               !decompressPayload(bad.data(), badBytes, stride, decoded.data(), rawBytes);
+    };
+    auto setPrefix = [](vector<unsigned char> &bad, size_t position, size_t coded)
+    {
+        for (int b = 0; b < 4; b++)
+            bad[position + b] = static_cast<unsigned char>(coded >> (24 - 8 * b));
+    };
+    bool passed = locateChunks(packed.data(), packedBytes, rawBytes, stride, offsets) && offsets.size() == 3;
+    size_t lastChunk = passed ? offsets[2] : 0;
+    passed = passed && rejected(packed, packedBytes - 1) && rejected(packed, 2) && rejected(packed, lastChunk); // Truncated.
+    vector<unsigned char> bad = packed;
+    bad.push_back(0);
+    passed = passed && rejected(bad, packedBytes + 1); // A trailing byte after the last chunk.
+    bad = packed;
+    setPrefix(bad, 0, compressedChunkLength(packed.data()) + 1); // Claims one byte of the next chunk.
+    passed = passed && rejected(bad, packedBytes);
+    bad = packed;
+    setPrefix(bad, lastChunk, compressedChunkBound(compressionChunkBytes(rawBytes, stride, 2))); // Longer than any last chunk.
+    passed = passed && rejected(bad, packedBytes);
+    bad = packed;
+    setPrefix(bad, 0, 0xFFFFFFFF); // Longer than the payload.
+    passed = passed && rejected(bad, packedBytes);
+    bad = packed;
+    bad[4] = 9; // Bit width of the first block.
+    passed = passed && !decompressPayload(bad.data(), packedBytes, stride, decoded.data(), rawBytes) &&
+             !decompressChunk(bad.data() + 4, compressedChunkLength(bad.data()), stride, decoded.data(),
+                              compressionChunkBytes(rawBytes, stride, 0));
+    cout << "Compression malformed input: " << (passed ? "passed" : "FAILED") << endl;
+    return allPassed && passed;
+}
+
+// Function to check the parallel counting sort of intensity buckets (per-tile histograms, then scatterIntensityJob on a
+// worker pool) byte for byte against bucketByIntensity() on one thread, over a frame of several tiles
+bool checkIntensityBuckets()
+{
+    const uint32_t width = 1000, height = 333; // Five full tiles and a partial one.
+    const size_t pixels = size_t(width) * height;
+    vector<unsigned char> gray(pixels);
+    for (size_t i = 0; i < pixels; i++)
+        gray[i] = static_cast<unsigned char>((i % width) * 255 / width ^ (i * 2654435761u >> 29)); // Gradient with noise.
+    fill(gray.begin() + 3 * TILE_PIXELS - 100, gray.begin() + 3 * TILE_PIXELS + 5000, 0); // A run across a tile border.
+
+    vector<vector<unsigned char>> thresholdSets(3);
+    thresholdSets[0].resize(3);
+    defaultIntensityThresholds(4, thresholdSets[0].data());
+    thresholdSets[1].resize(MAX_INTENSITY_BUCKETS - 1);
+    defaultIntensityThresholds(MAX_INTENSITY_BUCKETS, thresholdSets[1].data());
+    thresholdSets[2] = {1, 2, 90, 91, 254, 255}; // Custom: one- and two-level buckets at both ends.
+
+    ThreadPool pool(4, false, vector<int>());
+    CompletionQueue completions;
+    completions.event_fd = eventfd(0, EFD_CLOEXEC); // Blocking: the check waits for the job on it.
+    bool allPassed = completions.event_fd >= 0;
+    for (const vector<unsigned char> &thresholds : thresholdSets)
+    {
+        uint32_t buckets = static_cast<uint32_t>(thresholds.size() + 1);
+        vector<unsigned char> expected(intensityResultSize(pixels, buckets));
+        bucketByIntensity(gray.data(), pixels, thresholds.data(), buckets, expected.data());
+
+        shared_ptr<ImageJob> job = make_shared<ImageJob>();
+        job->request.width = width;
+        job->request.height = height;
+        job->request.buckets = job->request.bucketCount = buckets; // The whole image.
+        job->request.flags = REQUEST_FLAG_INTENSITY_BUCKETS;
+        job->gray.resize(pixels);
+        memcpy(job->gray.data(), gray.data(), pixels);
+        job->tiles = planTiles(vector<BucketView>(1, BucketView{0, pixels}));
+        job->histograms.resize(job->tiles.size());
+        for (size_t t = 0; t < job->tiles.size(); t++)
+            countIntensities(job->gray.data() + job->tiles[t].offset, job->tiles[t].length, job->histograms[t]);
+        intensityBucketMap(thresholds.data(), buckets, job->intensityMap);
+        scatterIntensityJob(pool, completions, job);
+
+        uint64_t done = 0;
+        bool passed = read(completions.event_fd, &done, sizeof(done)) == sizeof(done) && job->tiles.size() > 1;
+        {
+            lock_guard<mutex> guard(completions.lock);
+            passed = passed && completions.finished.size() == 1 && completions.finished[0] == job;
+            completions.finished.clear();
+        }
+        passed = passed && job->gray.size() == expected.size() && equal(expected.begin(), expected.end(), job->gray.data());
+        cout << "Intensity buckets " << buckets << ": " << (passed ? "passed" : "FAILED") << endl;
+        allPassed = allPassed && passed;
+    }
+    close(completions.event_fd);
+    return allPassed;
+}
+
+// Function to check that ContentHasher (content_hash.h) gives the same digest however the data is split, and that
+// the digest is XXH64
+bool checkContentHasher()
+{
+    vector<unsigned char> data(100000);
+    uint32_t noise = 777;
+    for (unsigned char &byte : data)
+    {
+        noise = noise * 1103515245 + 12345;
+        byte = static_cast<unsigned char>(noise >> 24);
+    }
+    const unsigned char abc[] = {'a', 'b', 'c'};
+    bool passed = contentHash(abc, 0) == 0xEF46DB3751D8E999ull && contentHash(abc, 3) == 0x44BC2CF5AD770999ull; // Reference XXH64.
+    // Every split point of the short lengths, around the 32-byte stripes and the 8- and 4-byte tails.
+    for (size_t length = 0; length <= 100 && passed; length++)
+    {
+        uint64_t whole = contentHash(data.data(), length);
+        for (size_t split = 0; split <= length && passed; split++)
+        {
+            ContentHasher hasher;
+            hasher.update(data.data(), split);
+            hasher.update(data.data() + split, length - split);
+            passed = hasher.digest() == whole;
+        }
+    }
+    // Pieces of irregular sizes, including empty ones, with the digest taken midway; and one byte at a time.
+    uint64_t whole = contentHash(data.data(), data.size());
+    ContentHasher pieces, bytes;
+    for (size_t position = 0, step = 0; position < data.size(); step++)
+    {
+        size_t length = min<size_t>((step * 2654435761u >> 7) % 97, data.size() - position);
+        pieces.update(data.data() + position, length);
+        position += length;
+        if (step % 100 == 0)
+            pieces.digest(); // Must not disturb the state.
+    }
+    for (size_t i = 0; i < data.size(); i++)
+        bytes.update(data.data() + i, 1);
+    passed = passed && pieces.digest() == whole && bytes.digest() == whole;
+    pieces.reset();
+    pieces.update(data.data(), data.size());
+    passed = passed && pieces.digest() == whole;
+    cout << "Content hash splits: " << (passed ? "passed" : "FAILED") << endl;
+    return passed;
+}
+
+// Function to check validateRequestHeader() (protocol.h) against a table of headers it must accept or reject.
+// Every case starts from a valid 640x480 RGB request of DEFAULT_BUCKETS buckets and changes a few fields.
+bool checkHeaderValidation()
+{
+    typedef void (*Edit)(RequestHeader &);
+    static const struct { const char *name; Edit edit; ResponseStatus expected; } cases[] = {
+        // Accepted.
+        {"whole image", [](RequestHeader &) {}, STATUS_OK},
+        {"rgba16 bt709", [](RequestHeader &h) { h.pixelFormat = PIXEL_FORMAT_RGBA16; h.flags = REQUEST_FLAG_LUMA_BT709; h.payloadLength = requestPayloadLength(h); }, STATUS_OK},
+        {"one pixel, one bucket", [](RequestHeader &h) { h.width = h.height = h.buckets = h.bucketCount = 1; h.payloadLength = 3; }, STATUS_OK},
+        {"largest image", [](RequestHeader &h) { h.width = MAX_IMAGE_DIMENSION; h.height = MAX_IMAGE_PIXELS / MAX_IMAGE_DIMENSION; h.payloadLength = requestPayloadLength(h); }, STATUS_OK},
+        {"most buckets", [](RequestHeader &h) { h.buckets = h.bucketCount = MAX_BUCKETS; }, STATUS_OK},
+        {"last shard", [](RequestHeader &h) { h.firstBucket = 5; h.bucketCount = 3; h.payloadLength = requestPayloadLength(h); }, STATUS_OK},
+        {"streaming", [](RequestHeader &h) { h.flags = REQUEST_FLAG_STREAMING; }, STATUS_OK},
+        {"hash only", [](RequestHeader &h) { h.flags = REQUEST_FLAG_HASH_ONLY | REQUEST_FLAG_KEEP_ALIVE; h.payloadLength = CONTENT_HASH_SIZE; }, STATUS_OK},
+        {"intensity", [](RequestHeader &h) { h.flags = REQUEST_FLAG_INTENSITY_BUCKETS; h.buckets = h.bucketCount = MAX_INTENSITY_BUCKETS; h.payloadLength = requestPayloadLength(h); }, STATUS_OK},
+        {"compressed, one byte", [](RequestHeader &h) { h.flags = REQUEST_FLAG_COMPRESSED | REQUEST_FLAG_ACCEPT_COMPRESSED; h.payloadLength = 1; }, STATUS_OK},
+        {"compressed, worst case", [](RequestHeader &h) { h.flags = REQUEST_FLAG_COMPRESSED; h.payloadLength = compressedBound(requestPayloadLength(h), 3); }, STATUS_OK},
+        {"shared memory", [](RequestHeader &h) { h.flags = REQUEST_FLAG_SHARED_MEMORY | REQUEST_FLAG_KEEP_ALIVE; }, STATUS_OK},
+        // Header fields.
+        {"bad magic", [](RequestHeader &h) { h.magic = ~PROTOCOL_MAGIC; }, STATUS_BAD_MAGIC},
+        {"newer version", [](RequestHeader &h) { h.version = PROTOCOL_VERSION + 1; }, STATUS_UNSUPPORTED_VERSION},
+        {"unknown pixel format", [](RequestHeader &h) { h.pixelFormat = 0xFFFF; }, STATUS_UNSUPPORTED_FORMAT},
+        // Flags.
+        {"unknown flag", [](RequestHeader &h) { h.flags = ~SUPPORTED_REQUEST_FLAGS & (SUPPORTED_REQUEST_FLAGS + 1); }, STATUS_UNSUPPORTED_FLAGS},
+        {"streaming session", [](RequestHeader &h) { h.flags = REQUEST_FLAG_STREAMING | REQUEST_FLAG_KEEP_ALIVE; }, STATUS_UNSUPPORTED_FLAGS},
+        {"streaming hash", [](RequestHeader &h) { h.flags = REQUEST_FLAG_STREAMING | REQUEST_FLAG_HASH_ONLY; }, STATUS_UNSUPPORTED_FLAGS},
+        {"streaming intensity", [](RequestHeader &h) { h.flags = REQUEST_FLAG_STREAMING | REQUEST_FLAG_INTENSITY_BUCKETS; }, STATUS_UNSUPPORTED_FLAGS},
+        {"streaming upload compressed", [](RequestHeader &h) { h.flags = REQUEST_FLAG_STREAMING | REQUEST_FLAG_COMPRESSED; }, STATUS_UNSUPPORTED_FLAGS},
+        {"streaming response compressed", [](RequestHeader &h) { h.flags = REQUEST_FLAG_STREAMING | REQUEST_FLAG_ACCEPT_COMPRESSED; }, STATUS_UNSUPPORTED_FLAGS},
+        {"intensity compressed", [](RequestHeader &h) { h.flags = REQUEST_FLAG_INTENSITY_BUCKETS | REQUEST_FLAG_COMPRESSED; }, STATUS_UNSUPPORTED_FLAGS},
+        {"both luma weightings", [](RequestHeader &h) { h.flags = REQUEST_FLAG_LUMA_BT601 | REQUEST_FLAG_LUMA_BT709; }, STATUS_UNSUPPORTED_FLAGS},
+        {"shared memory streaming", [](RequestHeader &h) { h.flags = REQUEST_FLAG_SHARED_MEMORY | REQUEST_FLAG_STREAMING; }, STATUS_UNSUPPORTED_FLAGS},
+        {"shared memory hash", [](RequestHeader &h) { h.flags = REQUEST_FLAG_SHARED_MEMORY | REQUEST_FLAG_HASH_ONLY; }, STATUS_UNSUPPORTED_FLAGS},
+        {"shared memory intensity", [](RequestHeader &h) { h.flags = REQUEST_FLAG_SHARED_MEMORY | REQUEST_FLAG_INTENSITY_BUCKETS; }, STATUS_UNSUPPORTED_FLAGS},
+        {"shared memory compressed", [](RequestHeader &h) { h.flags = REQUEST_FLAG_SHARED_MEMORY | REQUEST_FLAG_ACCEPT_COMPRESSED; }, STATUS_UNSUPPORTED_FLAGS},
+        // Dimensions and pixels.
+        {"zero width", [](RequestHeader &h) { h.width = 0; }, STATUS_INVALID_DIMENSIONS},
+        {"zero height", [](RequestHeader &h) { h.height = 0; }, STATUS_INVALID_DIMENSIONS},
+        {"width above limit", [](RequestHeader &h) { h.width = MAX_IMAGE_DIMENSION + 1; h.height = 1; }, STATUS_INVALID_DIMENSIONS},
+        {"height above limit", [](RequestHeader &h) { h.width = 1; h.height = MAX_IMAGE_DIMENSION + 1; }, STATUS_INVALID_DIMENSIONS},
+        {"one row too many pixels", [](RequestHeader &h) { h.width = MAX_IMAGE_DIMENSION; h.height = MAX_IMAGE_PIXELS / MAX_IMAGE_DIMENSION + 1; }, STATUS_IMAGE_TOO_LARGE},
+        {"largest dimensions", [](RequestHeader &h) { h.width = h.height = MAX_IMAGE_DIMENSION; }, STATUS_IMAGE_TOO_LARGE},
+        // Buckets and shards.
+        {"zero buckets", [](RequestHeader &h) { h.buckets = 0; }, STATUS_INVALID_BUCKETS},
+        {"too many buckets", [](RequestHeader &h) { h.buckets = h.bucketCount = MAX_BUCKETS + 1; }, STATUS_INVALID_BUCKETS},
+        {"more buckets than pixels", [](RequestHeader &h) { h.width = h.height = 2; h.buckets = h.bucketCount = 5; }, STATUS_INVALID_BUCKETS},
+        {"empty shard", [](RequestHeader &h) { h.bucketCount = 0; }, STATUS_INVALID_BUCKETS},
+        {"shard past the end", [](RequestHeader &h) { h.firstBucket = 6; h.bucketCount = 3; }, STATUS_INVALID_BUCKETS},
+        {"shard overflowing", [](RequestHeader &h) { h.firstBucket = 0xFFFFFFFF; h.bucketCount = 2; }, STATUS_INVALID_BUCKETS},
+        {"zero intensity buckets", [](RequestHeader &h) { h.flags = REQUEST_FLAG_INTENSITY_BUCKETS; h.buckets = h.bucketCount = 0; }, STATUS_INVALID_BUCKETS},
+        {"too many intensity buckets", [](RequestHeader &h) { h.flags = REQUEST_FLAG_INTENSITY_BUCKETS; h.buckets = h.bucketCount = MAX_INTENSITY_BUCKETS + 1; }, STATUS_INVALID_BUCKETS},
+        {"intensity shard", [](RequestHeader &h) { h.flags = REQUEST_FLAG_INTENSITY_BUCKETS; h.firstBucket = 1; h.bucketCount = 7; }, STATUS_INVALID_BUCKETS},
+        // Payload lengths.
+        {"payload one byte short", [](RequestHeader &h) { h.payloadLength--; }, STATUS_LENGTH_MISMATCH},
+        {"payload one byte long", [](RequestHeader &h) { h.payloadLength++; }, STATUS_LENGTH_MISMATCH},
+        {"shard with whole image", [](RequestHeader &h) { h.firstBucket = 5; h.bucketCount = 3; }, STATUS_LENGTH_MISMATCH},
+        {"intensity without thresholds", [](RequestHeader &h) { h.flags = REQUEST_FLAG_INTENSITY_BUCKETS; }, STATUS_LENGTH_MISMATCH},
+        {"hash only with pixels", [](RequestHeader &h) { h.flags = REQUEST_FLAG_HASH_ONLY; }, STATUS_LENGTH_MISMATCH},
+        {"compressed empty", [](RequestHeader &h) { h.flags = REQUEST_FLAG_COMPRESSED; h.payloadLength = 0; }, STATUS_LENGTH_MISMATCH},
+        {"compressed above worst case", [](RequestHeader &h) { h.flags = REQUEST_FLAG_COMPRESSED; h.payloadLength = compressedBound(requestPayloadLength(h), 3) + 1; }, STATUS_LENGTH_MISMATCH},
+    };
+    bool passed = true;
+    for (const auto &test : cases)
+    {
+        RequestHeader header;
+        header.width = 640;
+        header.height = 480;
+        header.payloadLength = requestPayloadLength(header);
+        test.edit(header);
+        ResponseStatus status = validateRequestHeader(header);
+        if (status != test.expected)
+        {
+            cout << "Header " << test.name << ": " << statusMessage(status) << " instead of " << statusMessage(test.expected) << endl;
+            passed = false;
+        }
+    }
+    cout << "Header validation: " << (passed ? "passed" : "FAILED") << endl;
+    return passed;
+}
+
+// Function to check the buffer pool's size classes (buffer_pool.h) around every power of two and the huge-page
+// threshold: a class holds the size asked for, wastes less than a quarter of itself, and an exact class size maps to
+// itself; buffers of 1 MiB and more are mapped as whole huge pages
+bool checkBufferSizeClasses()
+{
+    vector<size_t> sizes = {0, 1, BufferPool::HUGE_PAGE_BYTES / 2 - 1, BufferPool::HUGE_PAGE_BYTES / 2,
+                            BufferPool::HUGE_PAGE_BYTES / 2 + 1, BufferPool::HUGE_PAGE_BYTES + 1};
+    for (int power = 2; power < 40; power++)
+    {
+        size_t base = size_t(1) << power;
+        for (size_t n : {base - 1, base, base + 1, base + base / 4, base + base / 4 + 1, base + base / 2 + 1, 2 * base - 1})
+            sizes.push_back(n);
+    }
+    bool passed = true;
+    int previousClass = 0;
+    sort(sizes.begin(), sizes.end());
+    for (size_t n : sizes)
+    {
+        int sizeClass = BufferPool::classOf(n);
+        size_t capacity = BufferPool::classBytes(sizeClass), mapped = BufferPool::mappedLength(capacity);
+        bool ok = capacity >= n && sizeClass >= previousClass && BufferPool::classOf(capacity) == sizeClass;
+        ok = ok && (n <= BufferPool::MIN_CLASS_BYTES ? capacity == BufferPool::MIN_CLASS_BYTES : (capacity - n) * 4 < capacity);
+        ok = ok && (capacity < BufferPool::HUGE_PAGE_BYTES / 2 ? mapped == capacity
+                                                                : mapped >= capacity && mapped % BufferPool::HUGE_PAGE_BYTES == 0);
+        if (!ok)
+            cout << "Buffer size " << n << ": class of " << capacity << " bytes, mapped as " << mapped << endl;
+        passed = passed && ok;
+        previousClass = sizeClass;
+    }
+    cout << "Buffer size classes: " << (passed ? "passed" : "FAILED") << endl;
+    return passed;
+}
+
+// Function to decode a PNM file held in memory with readPnm() (image_io.h)
+bool decodePnm(const string &file, Image &image)
+{
+    FILE *in = fmemopen(const_cast<char *>(file.data()), file.size(), "rb");
+    if (!in)
+        return false;
+    bool ok = readPnm(in, image);
+    fclose(in);
+    return ok;
+}
+
+// Function to check the client's PNM decoder and resizer (image_io.h): P5 and P6 at maxval 255, 15 and 65535 decode
+// to the expected levels, truncated files and samples above maxval are refused, and resizing keeps flat areas flat
+bool checkImageDecoding()
+{
+    static const struct { const char *name; string file; uint32_t width, height; int channels; vector<unsigned char> pixels; } accepted[] = {
+        {"P6 maxval 255", string("P6\n2 1\n255\n") + string("\x00\x7f\xff\x01\x02\x03", 6), 2, 1, 3, {0, 127, 255, 1, 2, 3}},
+        {"P5 maxval 15", string("P5\n# comment\n3 1 15\n") + string("\x00\x07\x0f", 3), 3, 1, 1, {0, 119, 255}},
+        {"P6 maxval 65535", string("P6 1 1 65535\n") + string("\x00\x00\x80\x00\xff\xff", 6), 1, 1, 3, {0, 128, 255}},
+        {"P5 maxval 1000", string("P5 2 1 1000\n") + string("\x01\xf4\x03\xe8", 4), 2, 1, 1, {128, 255}},
+    };
+    static const struct { const char *name; string file; } rejected[] = {
+        {"truncated pixels", string("P6\n2 1\n255\n") + string("\x00\x7f\xff\x01\x02", 5)},
+        {"truncated 16-bit pixels", string("P5 2 1 65535\n") + string("\x00\x01\x02", 3)},
+        {"truncated header", "P6\n2 1\n"},
+        {"sample above maxval", string("P5 2 1 15\n") + string("\x0f\xc8", 2)},
+        {"16-bit sample above maxval", string("P5 1 1 1000\n") + string("\x03\xe9", 2)},
+        {"maxval 0", string("P5 1 1 0\n") + string("\x00", 1)},
+        {"zero width", string("P5 0 1 255\n")},
+    };
+    bool passed = true;
+    for (const auto &test : accepted)
+    {
+        Image image;
+        bool ok = decodePnm(test.file, image) && image.width == test.width && image.height == test.height &&
+                  image.channels == test.channels && image.pixels == test.pixels;
+        if (!ok)
+            cout << "PNM " << test.name << ": not decoded as expected" << endl;
+        passed = passed && ok;
+    }
+    for (const auto &test : rejected)
+    {
+        Image image;
+        if (decodePnm(test.file, image))
+        {
+            cout << "PNM " << test.name << ": accepted" << endl;
+            passed = false;
         }
-        cout << "Sent bucket " << i + 1 << " (" << bytes_sent << " bytes)." << endl; // Log the successful transmission.
     }
-    return true; // Return true if all buckets were sent successfully.
+    cout << "PNM decoding: " << (passed ? "passed" : "FAILED") << endl;
+
+    // Resizing: a flat image stays flat at any size, the same size is an exact copy, and fitGeometry keeps the aspect.
+    Image flat, ramp;
+    flat.width = 37;
+    flat.height = 23;
+    flat.channels = 3;
+    for (size_t i = 0; i < size_t(flat.width) * flat.height; i++)
+        flat.pixels.insert(flat.pixels.end(), {10, 200, 255});
+    ramp.width = 64;
+    ramp.height = 5;
+    ramp.channels = 1;
+    for (size_t i = 0; i < size_t(ramp.width) * ramp.height; i++)
+        ramp.pixels.push_back(static_cast<unsigned char>(i * 7));
+    bool resized = resizeImage(ramp, ramp.width, ramp.height).pixels == ramp.pixels;
+    static const uint32_t sizes[][2] = {{1, 1}, {5, 3}, {36, 22}, {38, 24}, {100, 61}};
+    for (const auto &size : sizes)
+    {
+        Image scaled = resizeImage(flat, size[0], size[1]);
+        resized = resized && scaled.width == size[0] && scaled.height == size[1] && scaled.pixels.size() == size_t(size[0]) * size[1] * 3;
+        for (size_t i = 0; i < scaled.pixels.size() && resized; i++)
+            resized = scaled.pixels[i] == flat.pixels[i % 3];
+    }
+    uint32_t fitWidth = 0, fitHeight = 0, exactWidth = 0, exactHeight = 0;
+    resized = resized && fitGeometry("40x40", 80, 20, fitWidth, fitHeight) && fitWidth == 40 && fitHeight == 10 &&
+              fitGeometry("40x40!", 80, 20, exactWidth, exactHeight) && exactWidth == 40 && exactHeight == 40 &&
+              !fitGeometry("0x40", 80, 20, fitWidth, fitHeight) && !fitGeometry("40x40?", 80, 20, fitWidth, fitHeight);
+    cout << "Image resizing: " << (resized ? "passed" : "FAILED") << endl;
+    return passed && resized;
 }
 
-int main() 
+// Function to check every grayscale kernel supported by this CPU against the scalar reference, then the other
+// kernels and codecs above
+bool runSelfTest()
 {
-    // Step 1: Create and configure the server socket.
-    int server_fd = createServerSocket(); // Create a new server socket.
-    bindAndListen(server_fd, PORT);         // Bind the socket to a port and set it to listen for incoming connections.
+    // Input 1: every possible RGB triple once (2^24 pixels), which covers every channel sum.
+    const size_t pixels = size_t(1) << 24;
+    vector<unsigned char> rgb(pixels * CHANNELS);
+    for (size_t i = 0; i < pixels; i++)
+    {
+        rgb[3 * i] = static_cast<unsigned char>(i >> 16);    // Red.
+        rgb[3 * i + 1] = static_cast<unsigned char>(i >> 8); // Green.
+        rgb[3 * i + 2] = static_cast<unsigned char>(i);      // Blue.
+    }
+    vector<unsigned char> expected(pixels), actual(pixels);
+    convertGrayscaleScalar(rgb.data(), expected.data(), pixels); // Reference result: (r + g + b) / 3.
 
-    // Step 2: Accept a client connection.
-    int client_sock = acceptClient(server_fd); // Accept an incoming connection from a client.
+    bool allPassed = true;
+    size_t count = 0;
+    const GrayscaleKernelInfo *kernels = grayscaleKernels(count);
+    for (size_t k = 0; k < count; k++)
+    {
+        if (!kernels[k].supported)
+        {
+            cout << "Kernel " << kernels[k].name << ": skipped (not supported by this CPU)" << endl;
+            continue;
+        }
+        bool passed = true;
+        kernels[k].kernel(rgb.data(), actual.data(), pixels); // Whole table in one call.
+        passed = passed && actual == expected;
+        // Input 2: unaligned starts and every length up to 200 pixels, which exercises the vector tails.
+        for (size_t offset = 0; offset < 64 && passed; offset++)
+        {
+            for (size_t length = 0; length <= 200 && passed; length++)
+            {
+                size_t start = offset * 977 + length * 131; // Spread the samples over the table.
+                fill(actual.begin(), actual.begin() + length + 1, 0xAA); // Sentinel to detect overruns.
+                kernels[k].kernel(rgb.data() + 3 * start + offset % 3, actual.data(), length);
+                vector<unsigned char> reference(length + 1, 0xAA);
+                convertGrayscaleScalar(rgb.data() + 3 * start + offset % 3, reference.data(), length);
+                passed = equal(reference.begin(), reference.end(), actual.begin());
+            }
+        }
+        cout << "Kernel " << kernels[k].name << ": " << (passed ? "passed" : "FAILED") << endl;
+        allPassed = allPassed && passed;
+    }
+    allPassed = checkLumaKernels(rgb) && allPassed;
+    allPassed = checkCompression() && allPassed;
+    allPassed = checkIntensityBuckets() && allPassed;
+    allPassed = checkContentHasher() && allPassed;
+    allPassed = checkHeaderValidation() && allPassed;
+    allPassed = checkBufferSizeClasses() && allPassed;
+    allPassed = checkImageDecoding() && allPassed;
+    return allPassed;
+}
 
-    // Step 3: Receive the raw RGB image data from the client.
-    vector<unsigned char> image; // Declare a vector to hold the received image data.
-    if (!receiveImageData(client_sock, image)) 
-    { // Attempt to receive the image data; check for success.
-        close(client_sock); // Close the client socket if reception failed.
-        close(server_fd);   // Close the server socket.
-        return -1;          // Terminate the program with an error code.
+// Function to print the command line options
+void printUsage(const char *program)
+{
+    cout << "Usage: " << program << " [--port N] [--backlog N] [--shutdown-timeout SECONDS] [--zerocopy-threshold BYTES]"
+         << " [--workers N] [--pin-threads] [--stats-port N] [--stats-interval SECONDS] [--verbose]"
+         << " [--cache-mb N] [--buffer-pool-mb N] [--compression on|off] [--local-socket PATH]"
+         << " [--grayscale-kernel avx512|avx2|sse4.1|scalar] [--self-test]" << endl;
+}
+
+// Function to read the server settings from the command line
+bool parseArguments(int argc, char *argv[], ServerConfig &config)
+{
+    // Walk through the arguments in "--option value" pairs.
+    for (int i = 1; i < argc; i++)
+    {
+        string option = argv[i]; // Name of the current option.
+        if (option == "--help" || option == "-h")
+        {
+            printUsage(argv[0]); // Show the available options.
+            exit(EXIT_SUCCESS);
+        }
+        if (option == "--self-test")
+        {
+            exit(runSelfTest() ? EXIT_SUCCESS : EXIT_FAILURE); // Verify the kernels and report the result.
+        }
+        if (option == "--pin-threads")
+        {
+            config.pinThreads = true; // Options without a value.
+            continue;
+        }
+        if (option == "--verbose")
+        {
+            verboseLogging = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            cerr << "Missing value for " << option << endl; // Every other option takes exactly one value.
+            return false;
+        }
+        if (option == "--grayscale-kernel")
+        {
+            if (!selectGrayscaleKernel(argv[++i]))
+            {
+                cerr << "Unknown or unsupported grayscale kernel: " << argv[i] << endl;
+                return false;
+            }
+            continue;
+        }
+        if (option == "--compression")
+        {
+            string value = argv[++i]; // Whether to negotiate compression with clients that offer it.
+            if (value != "on" && value != "off")
+            {
+                cerr << "Invalid value for --compression: " << value << endl;
+                return false;
+            }
+            config.compression = value == "on";
+            continue;
+        }
+        if (option == "--local-socket")
+        {
+            config.localSocket = argv[++i]; // Same-host clients connect here and pass their frames in shared memory.
+            continue;
+        }
+        int value = atoi(argv[++i]); // Numeric value of the option.
+        if (option == "--port" && value > 0 && value < 65536)
+            config.port = value;
+        else if (option == "--backlog" && value > 0)
+            config.backlog = value;
+        else if (option == "--shutdown-timeout" && value >= 0)
+            config.shutdownTimeout = value;
+        else if (option == "--zerocopy-threshold" && value >= 0)
+            config.zerocopyThreshold = value;
+        else if (option == "--workers" && value >= 0 && value <= 1024)
+            config.workers = value;
+        else if (option == "--stats-port" && value > 0 && value < 65536)
+            config.statsPort = value;
+        else if (option == "--stats-interval" && value >= 0)
+            config.statsInterval = value;
+        else if (option == "--cache-mb" && value >= 0)
+            config.cacheBytes = size_t(value) << 20;
+        else if (option == "--buffer-pool-mb" && value >= 0)
+            config.bufferPoolBytes = size_t(value) << 20;
+        else
+        {
+            cerr << "Invalid option or value: " << option << " " << argv[i] << endl; // Unknown option or out-of-range value.
+            return false;
+        }
     }
+    return true; // All options were understood.
+}
 
-    // Step 4: Convert the RGB image to grayscale.
-    vector<unsigned char> gray = convertToGrayscale(image); // Process the image to convert it from RGB to grayscale.
+int main(int argc, char *argv[])
+{
+    // Step 1: Read the configuration from the command line.
+    ServerContext server; // Event loop state, starting from the default settings.
+    ServerConfig &config = server.config;
+    if (!parseArguments(argc, argv, config))
+    {
+        printUsage(argv[0]); // Remind the user of the valid options.
+        return -1; // Terminate the program with an error code.
+    }
 
-    // Step 5: Partition the grayscale image into 8 buckets.
-    vector<vector<unsigned char>> buckets = partitionIntoBuckets(gray); // Divide the grayscale image into 8 equal parts (buckets).
+    cout << "Grayscale kernel: " << activeGrayscaleKernel()->name << endl; // Report the kernel chosen by CPU dispatch.
+    server.cache = ResultCache(config.cacheBytes); // Disabled unless --cache-mb was given.
+    sharedBufferPool().setCacheLimit(config.bufferPoolBytes);
 
-    // Step 6: Display a summary of each bucket.
-    printBucketsSummary(buckets); // Print a brief summary (first 10 values) of each bucket to the console.
+    // Step 2: Create and configure the server socket and the event loop.
+    int signal_fd = createSignalDescriptor(); // Turn SIGINT/SIGTERM into events (must happen before any threads or sockets).
+    int server_fd = createServerSocket(); // Create a new non-blocking server socket.
+    bindAndListen(server_fd, config.port, config.backlog); // Bind the socket to a port and set it to listen for incoming connections.
+    int epoll_fd = server.epoll_fd = createEventLoop(); // Create the epoll instance.
+    int completion_fd = server.completions.event_fd = createCompletionDescriptor(); // Workers report finished images here.
+    if (!watchDescriptor(epoll_fd, server_fd, EPOLLIN, true) || !watchDescriptor(epoll_fd, signal_fd, EPOLLIN, true) ||
+        !watchDescriptor(epoll_fd, completion_fd, EPOLLIN, true))
+        return -1; // Without these registrations the server cannot work.
+    int stats_fd = config.statsPort ? createStatsSocket(config.statsPort) : -1; // Optional statistics port.
+    int timer_fd = config.statsInterval ? createStatsTimer(config.statsInterval) : -1; // Optional periodic snapshots.
+    int local_fd = config.localSocket.empty() ? -1 : createLocalSocket(config.localSocket, config.backlog); // Optional same-host socket.
+    if ((stats_fd >= 0 && !watchDescriptor(epoll_fd, stats_fd, EPOLLIN, true)) ||
+        (timer_fd >= 0 && !watchDescriptor(epoll_fd, timer_fd, EPOLLIN, true)) ||
+        (local_fd >= 0 && !watchDescriptor(epoll_fd, local_fd, EPOLLIN, true)))
+        return -1;
+    server.pool = startWorkers(config); // Started after the signal mask is set up, so the workers inherit it.
 
-    // Step 7: Send each bucket back to the client.
-    if (!sendBucketsData(client_sock, buckets)) 
-    { // Send the partitioned buckets back to the client; check for errors.
-        close(client_sock); // Close the client socket if sending failed.
-        close(server_fd);   // Close the server socket.
-        return -1;          // Terminate the program with an error code.
+    // Step 3: Serve clients until a shutdown signal arrives and the in-flight connections have drained.
+    unordered_map<int, Connection> &connections = server.connections; // State of every connected client, keyed by socket.
+    vector<epoll_event> events(MAX_EVENTS); // Buffer receiving the readiness events.
+    bool shuttingDown = false; // Set once a shutdown signal has been received.
+    uint64_t drainDeadline = 0; // When the grace period ends; fixed when the signal arrives, so activity cannot extend it.
+    while (!shuttingDown || !connections.empty())
+    {
+        int timeoutMs = -1; // Wait indefinitely while serving.
+        if (shuttingDown)
+        {
+            uint64_t now = nowNanoseconds();
+            if (now >= drainDeadline)
+            {
+                cerr << "Shutdown timeout reached; closing " << connections.size() << " unfinished connection(s)." << endl;
+                break; // The grace period is over, however busy the connections still are.
+            }
+            timeoutMs = static_cast<int>((drainDeadline - now + 999999) / 1000000); // Remaining grace period, rounded up.
+        }
+        int ready = epoll_wait(epoll_fd, events.data(), MAX_EVENTS, timeoutMs); // Wait for sockets to become ready.
+        if (ready < 0 && errno == EINTR)
+            continue; // Interrupted by an unrelated signal; wait again.
+        if (ready < 0)
+        {
+            perror("epoll_wait failed"); // An unexpected error in the event loop.
+            break;
+        }
+        for (int i = 0; i < ready; i++)
+        {
+            int fd = events[i].data.fd; // Descriptor that became ready.
+            if (fd == server_fd)
+                acceptClients(server_fd, server); // New clients are waiting to be accepted.
+            else if (fd == local_fd)
+                acceptClients(local_fd, server, true); // New same-host clients.
+            else if (fd == signal_fd)
+            {
+                signalfd_siginfo info; // Details of the received signal.
+                while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {} // Consume all pending signals.
+                if (shuttingDown)
+                {
+                    cerr << "Second shutdown signal; closing " << connections.size() << " connection(s) immediately." << endl;
+                    while (!connections.empty())
+                        closeConnection(server, connections.begin()->first); // Do not wait for them.
+                    break;
+                }
+                cout << "Shutdown requested; no longer accepting connections." << endl;
+                shuttingDown = true; // Leave the loop once the in-flight connections are done.
+                drainDeadline = nowNanoseconds() + uint64_t(config.shutdownTimeout) * 1000000000ull; // Bound how long we wait for them.
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_fd, nullptr); // Stop watching the listening socket.
+                close(server_fd); // Refuse new connections.
+                server_fd = -1;
+                if (local_fd >= 0)
+                {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, local_fd, nullptr);
+                    close(local_fd); // Same for the local ones.
+                    local_fd = -1;
+                    unlink(config.localSocket.c_str());
+                }
+                if (stats_fd >= 0)
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, stats_fd, nullptr); // Scrapers must not keep the loop busy now.
+                if (timer_fd >= 0)
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, timer_fd, nullptr); // The final snapshot follows the drain.
+                finishSessions(server); // Sessions end after their current request instead of waiting for more.
+            }
+            else if (fd == completion_fd)
+                collectCompletedJobs(server); // Workers finished one or more images.
+            else if (fd == stats_fd)
+                acceptStatsClients(stats_fd, server); // Someone asks for a statistics snapshot.
+            else if (fd == timer_fd)
+            {
+                uint64_t expirations; // Missed intervals are not made up for.
+                if (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+                    cout << formatStatsJson(stats) << endl; // Periodic snapshot.
+            }
+            else if (server.statsClients.count(fd))
+                answerStatsClient(server, fd);
+            else
+                handleClientEvent(server, fd, events[i].events); // Advance the client's state machine.
+        }
     }
 
-    // Close the connection.
-    close(client_sock); // Close the connection with the client.
-    close(server_fd);   // Close the server socket.
-    cout << "Processing complete. Connection closed." << endl; // Inform that processing is finished and the connection is closed.
+    // Stop the workers, then close every remaining connection and the server's own descriptors.
+    server.pool.reset(); // Waits for queued tiles; they may still post to the completion descriptor.
+    for (auto &entry : connections)
+        close(entry.first); // Close the unfinished client connections.
+    if (server_fd >= 0)
+        close(server_fd); // Close the server socket.
+    if (local_fd >= 0)
+    {
+        close(local_fd); // Close the local socket and remove its file.
+        unlink(config.localSocket.c_str());
+    }
+    close(signal_fd); // Close the signal descriptor.
+    close(completion_fd); // Close the completion descriptor.
+    for (int fd : server.statsClients)
+        close(fd); // Statistics requests that never arrived.
+    if (stats_fd >= 0)
+        close(stats_fd); // Close the statistics port.
+    if (timer_fd >= 0)
+    {
+        close(timer_fd);
+        cout << formatStatsJson(stats) << endl; // Final snapshot covering the whole run.
+    }
+    close(epoll_fd); // Close the epoll instance.
+    cout << "Server stopped." << endl; // Inform that the server has shut down.
     return 0; // End the program successfully.
-}
\ No newline at end of file
+}
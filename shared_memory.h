@@ -0,0 +1,181 @@
+#ifndef SHARED_MEMORY_H
+#define SHARED_MEMORY_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Same-host transport for REQUEST_FLAG_SHARED_MEMORY (protocol.h): the pixels and the gray result live in memory
+// files (memfd) that the client creates and passes to the server over a Unix domain socket (SCM_RIGHTS). Both sides
+// map the same pages, so only the 48-byte headers go through the socket.
+//
+// The client seals the size of each file (F_SEAL_SHRINK | F_SEAL_GROW) before passing it on. The server only maps
+// files that carry the seals and are large enough, so a client cannot truncate a mapping under the server and make
+// it fault with SIGBUS while it converts.
+
+const size_t MAX_PASSED_DESCRIPTORS = 4; // Descriptors one recvmsg() takes; a message carrying more fails the receive.
+
+// A shared mapping of (a prefix of) a memory file, unmapped when it goes out of scope. Movable, not copyable.
+class SharedRegion
+{
+public:
+    SharedRegion() {}
+    ~SharedRegion() { unmap(); }
+    SharedRegion(SharedRegion &&other) noexcept : address(other.address), length(other.length)
+    {
+        other.address = nullptr;
+        other.length = 0;
+    }
+    SharedRegion &operator=(SharedRegion &&other) noexcept
+    {
+        if (this != &other)
+        {
+            unmap();
+            address = other.address;
+            length = other.length;
+            other.address = nullptr;
+            other.length = 0;
+        }
+        return *this;
+    }
+    SharedRegion(const SharedRegion &) = delete;
+    SharedRegion &operator=(const SharedRegion &) = delete;
+
+    // Function to map the first 'bytes' bytes of 'fd' (read-only unless 'writable'); the descriptor can be closed after
+    bool map(int fd, size_t bytes, bool writable)
+    {
+        unmap();
+        if (bytes == 0)
+            return false;
+        void *mapped = mmap(nullptr, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED)
+            return false;
+        address = static_cast<unsigned char *>(mapped);
+        length = bytes;
+        return true;
+    }
+
+    // Function to drop the mapping (if any)
+    void unmap()
+    {
+        if (address)
+            munmap(address, length);
+        address = nullptr;
+        length = 0;
+    }
+
+    unsigned char *data() const { return address; }
+    size_t size() const { return length; }
+    bool mapped() const { return address != nullptr; }
+
+private:
+    unsigned char *address = nullptr;
+    size_t length = 0;
+};
+
+// Function to create a memory file of 'bytes' bytes whose size is sealed; returns its descriptor, or -1 (errno set)
+inline int createSharedMemory(const char *name, size_t bytes)
+{
+    int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, static_cast<off_t>(bytes)) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+// Function to check that 'fd' is a memory file sealed against shrinking and holding at least 'bytes' bytes
+inline bool sealedRegionHolds(int fd, size_t bytes)
+{
+    int seals = fcntl(fd, F_GET_SEALS);
+    struct stat info;
+    return seals >= 0 && (seals & F_SEAL_SHRINK) && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+           static_cast<size_t>(info.st_size) >= bytes;
+}
+
+// Function to send 'length' bytes with 'count' descriptors attached to the first of them (one sendmsg() call).
+// Returns what sendmsg() returns; the caller sends whatever was left over without descriptors.
+inline ssize_t sendWithDescriptors(int sock, const void *data, size_t length, const int *fds, size_t count)
+{
+    iovec iov = {const_cast<void *>(data), length};
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(MAX_PASSED_DESCRIPTORS * sizeof(int))];
+    if (count > 0)
+    {
+        if (count > MAX_PASSED_DESCRIPTORS)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(header), fds, count * sizeof(int));
+    }
+    ssize_t sent;
+    do
+        sent = sendmsg(sock, &message, MSG_NOSIGNAL);
+    while (sent < 0 && errno == EINTR);
+    return sent;
+}
+
+// Function to receive up to 'length' bytes like recv(), appending any descriptors passed with them to 'fds'
+// (close-on-exec). If more arrive than MAX_PASSED_DESCRIPTORS, the kernel drops the rest and this fails with ECOMM.
+inline ssize_t receiveWithDescriptors(int sock, void *data, size_t length, std::vector<int> &fds, int flags = 0)
+{
+    iovec iov = {data, length};
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(MAX_PASSED_DESCRIPTORS * sizeof(int))];
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t received = recvmsg(sock, &message, flags | MSG_CMSG_CLOEXEC);
+    if (received < 0)
+        return received;
+    for (cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+    {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+            continue;
+        size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            fds.push_back(fd);
+        }
+    }
+    if (message.msg_flags & MSG_CTRUNC)
+    {
+        errno = ECOMM;
+        return -1;
+    }
+    return received;
+}
+
+// Function to close and forget passed descriptors
+inline void closeDescriptors(std::vector<int> &fds)
+{
+    for (int fd : fds)
+        close(fd);
+    fds.clear();
+}
+
+#endif // SHARED_MEMORY_H
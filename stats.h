@@ -0,0 +1,215 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <time.h>
+
+#include "buffer_pool.h"
+
+// Lock-free server instrumentation: per-stage latency histograms plus byte, connection and request counters.
+//
+// Recording is a handful of relaxed atomic increments, so it can run on the I/O thread and on the workers in the
+// middle of the request path. Snapshots read the counters without stopping the writers; a snapshot taken while
+// requests are in flight may be off by those requests, which is fine for monitoring.
+
+// Function to read a monotonic clock in nanoseconds
+inline uint64_t nowNanoseconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+}
+
+// Histogram of durations in nanoseconds with log-linear buckets: every power of two is split into 16 equal
+// sub-buckets, so any reported percentile is within 6.25% of the true value, from 1 ns up to centuries.
+class LatencyHistogram
+{
+public:
+    static const int SUB_BUCKET_BITS = 4;                                    // 16 sub-buckets per power of two.
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;     // Enough for any 64-bit value.
+
+    // Records one duration.
+    void record(uint64_t nanoseconds)
+    {
+        counts[indexOf(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+        uint64_t seen = largest.load(std::memory_order_relaxed);
+        while (nanoseconds > seen && !largest.compare_exchange_weak(seen, nanoseconds, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    // Number of recorded durations.
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+
+    // Mean of the recorded durations (0 if there are none).
+    uint64_t mean() const
+    {
+        uint64_t n = count();
+        return n ? sum.load(std::memory_order_relaxed) / n : 0;
+    }
+
+    // Largest recorded duration.
+    uint64_t max() const { return largest.load(std::memory_order_relaxed); }
+
+    // Upper bound of the bucket holding quantile 'q' (0..1) of the recorded durations (0 if there are none).
+    uint64_t percentile(double q) const
+    {
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++)
+            seen += counts[i].load(std::memory_order_relaxed); // Sum the buckets themselves, so the rank always exists.
+        if (seen == 0)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(q * seen + 0.999999); // Nearest-rank method.
+        rank = rank == 0 ? 1 : (rank > seen ? seen : rank);
+        uint64_t cumulative = 0;
+        for (int i = 0; i < BUCKETS; i++)
+        {
+            cumulative += counts[i].load(std::memory_order_relaxed);
+            if (cumulative >= rank)
+            {
+                uint64_t bound = upperBound(i);
+                return bound < max() ? bound : max(); // Never report more than was actually seen.
+            }
+        }
+        return max();
+    }
+
+private:
+    std::atomic<uint64_t> counts[BUCKETS] = {};  // Durations per bucket.
+    std::atomic<uint64_t> total{0};              // Number of durations.
+    std::atomic<uint64_t> sum{0};                // Sum of all durations.
+    std::atomic<uint64_t> largest{0};            // Largest duration.
+
+    // Function to map a value to its bucket: values below 16 are exact, larger ones keep their top 5 bits.
+    static int indexOf(uint64_t value)
+    {
+        if (value < SUB_BUCKETS)
+            return static_cast<int>(value);
+        int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS; // Low bits that are dropped.
+        return ((shift + 1) << SUB_BUCKET_BITS) + static_cast<int>((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // Function to return the largest value that falls into bucket 'index'.
+    static uint64_t upperBound(int index)
+    {
+        if (index < SUB_BUCKETS)
+            return index;
+        int shift = (index >> SUB_BUCKET_BITS) - 1;
+        uint64_t base = uint64_t(SUB_BUCKETS + (index & (SUB_BUCKETS - 1))) << shift;
+        return base + ((1ull << shift) - 1);
+    }
+};
+
+// Stages of a request that are timed separately.
+enum Stage
+{
+    STAGE_ACCEPT,      // accept() plus registering the connection with the event loop.
+    STAGE_RECEIVE,     // First request byte until the whole payload has arrived.
+    STAGE_GRAYSCALE,   // Grayscale conversion, including the wait for a free worker.
+    STAGE_PARTITION,   // Describing the buckets as views into the gray image.
+    STAGE_SEND,        // First response byte until the kernel has taken (and, with zero-copy, released) the response.
+    STAGE_REQUEST,     // First request byte until the response is sent: what the client sees.
+    STAGE_COUNT
+};
+
+// Names of the stages in snapshots, indexed by Stage.
+inline const char *stageName(int stage)
+{
+    static const char *names[STAGE_COUNT] = {"accept", "receive", "grayscale", "partition", "send", "request"};
+    return names[stage];
+}
+
+// Everything the server measures.
+struct ServerStats
+{
+    uint64_t startTime = nowNanoseconds();             // When the server started.
+    LatencyHistogram stages[STAGE_COUNT];              // Durations per stage.
+    std::atomic<uint64_t> bytesReceived{0};            // Request bytes read from clients.
+    std::atomic<uint64_t> bytesSent{0};                // Response bytes written to clients.
+    std::atomic<uint64_t> connectionsAccepted{0};      // Connections accepted since startup.
+    std::atomic<uint64_t> connectionsActive{0};        // Connections currently open.
+    std::atomic<uint64_t> requestsCompleted{0};        // Images answered with STATUS_OK.
+    std::atomic<uint64_t> requestsRejected{0};         // Requests answered with an error status.
+    std::atomic<uint64_t> requestsAborted{0};          // Requests cut short by a disconnect or socket error.
+    std::atomic<uint64_t> cacheHits{0};                // Requests answered from the result cache.
+    std::atomic<uint64_t> cacheMisses{0};              // Requests looked up in the cache but not found.
+    std::atomic<uint64_t> cacheEntries{0};             // Results currently cached.
+    std::atomic<uint64_t> cacheBytes{0};               // Bytes of results currently cached.
+    std::atomic<uint64_t> compressedRequests{0};       // Requests whose pixels arrived compressed.
+    std::atomic<uint64_t> compressedRequestBytes{0};   // Their payload bytes as received.
+    std::atomic<uint64_t> compressedRequestRaw{0};     // Their payload bytes once decoded.
+    std::atomic<uint64_t> compressedResponses{0};      // Responses whose gray bytes were sent compressed.
+    std::atomic<uint64_t> compressedResponseBytes{0};  // Their payload bytes as sent.
+    std::atomic<uint64_t> compressedResponseRaw{0};    // Their gray bytes before compression.
+    std::atomic<uint64_t> sharedMemoryRequests{0};     // Requests answered through memory files (Unix domain socket).
+    std::atomic<uint64_t> sharedMemoryBytes{0};        // Their pixel and gray bytes, which never went through a socket.
+
+    // Function to record how long a stage took, given when it started
+    void recordStage(Stage stage, uint64_t startNanoseconds)
+    {
+        stages[stage].record(nowNanoseconds() - startNanoseconds);
+    }
+
+    // Function to add to a counter
+    static void add(std::atomic<uint64_t> &counter, uint64_t amount = 1)
+    {
+        counter.fetch_add(amount, std::memory_order_relaxed);
+    }
+};
+
+// Function to render a snapshot of the statistics as one line of JSON (durations in microseconds)
+inline std::string formatStatsJson(const ServerStats &stats)
+{
+    char buffer[256];
+    std::string json;
+    snprintf(buffer, sizeof(buffer),
+             "{\"uptime_s\":%.3f,\"connections\":{\"accepted\":%llu,\"active\":%llu},"
+             "\"requests\":{\"completed\":%llu,\"rejected\":%llu,\"aborted\":%llu},",
+             (nowNanoseconds() - stats.startTime) / 1e9,
+             (unsigned long long)stats.connectionsAccepted.load(), (unsigned long long)stats.connectionsActive.load(),
+             (unsigned long long)stats.requestsCompleted.load(), (unsigned long long)stats.requestsRejected.load(),
+             (unsigned long long)stats.requestsAborted.load());
+    json += buffer;
+    snprintf(buffer, sizeof(buffer),
+             "\"cache\":{\"hits\":%llu,\"misses\":%llu,\"entries\":%llu,\"bytes\":%llu},",
+             (unsigned long long)stats.cacheHits.load(), (unsigned long long)stats.cacheMisses.load(),
+             (unsigned long long)stats.cacheEntries.load(), (unsigned long long)stats.cacheBytes.load());
+    json += buffer;
+    snprintf(buffer, sizeof(buffer),
+             "\"compression\":{\"requests\":%llu,\"request_bytes\":%llu,\"request_raw_bytes\":%llu,"
+             "\"responses\":%llu,\"response_bytes\":%llu,\"response_raw_bytes\":%llu},",
+             (unsigned long long)stats.compressedRequests.load(), (unsigned long long)stats.compressedRequestBytes.load(),
+             (unsigned long long)stats.compressedRequestRaw.load(), (unsigned long long)stats.compressedResponses.load(),
+             (unsigned long long)stats.compressedResponseBytes.load(), (unsigned long long)stats.compressedResponseRaw.load());
+    json += buffer;
+    snprintf(buffer, sizeof(buffer), "\"shared_memory\":{\"requests\":%llu,\"bytes\":%llu},",
+             (unsigned long long)stats.sharedMemoryRequests.load(), (unsigned long long)stats.sharedMemoryBytes.load());
+    json += buffer;
+    BufferPool &pool = sharedBufferPool(); // Recycled request buffers.
+    snprintf(buffer, sizeof(buffer), "\"buffers\":{\"mapped\":%llu,\"reused\":%llu,\"cached_bytes\":%llu},",
+             (unsigned long long)pool.mappedBuffers(), (unsigned long long)pool.reusedBuffers(),
+             (unsigned long long)pool.cachedBytes());
+    json += buffer;
+    snprintf(buffer, sizeof(buffer), "\"bytes\":{\"received\":%llu,\"sent\":%llu},\"stages_us\":{",
+             (unsigned long long)stats.bytesReceived.load(), (unsigned long long)stats.bytesSent.load());
+    json += buffer;
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        const LatencyHistogram &h = stats.stages[s];
+        snprintf(buffer, sizeof(buffer),
+                 "%s\"%s\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+                 s ? "," : "", stageName(s), (unsigned long long)h.count(), h.mean() / 1e3, h.percentile(0.5) / 1e3,
+                 h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3, h.max() / 1e3);
+        json += buffer;
+    }
+    json += "}}";
+    return json;
+}
+
+#endif // STATS_H
@@ -0,0 +1,167 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+
+// Work-stealing thread pool used for the compute side of the server.
+//
+// Every worker owns a deque of tasks. A worker takes its own tasks from the back (most recently pushed,
+// still warm in its cache) and, when it runs dry, steals from the front of the other workers' deques.
+// Tasks submitted from outside the pool (the I/O thread) are spread round-robin over the workers;
+// tasks submitted by a worker go to its own deque.
+class ThreadPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    // Starts 'workers' threads. With 'pin' set, worker i is bound to the i-th CPU of 'cpus' (wrapping around).
+    ThreadPool(size_t workers, bool pin, const std::vector<int> &cpus)
+        : queues(workers)
+    {
+        for (size_t i = 0; i < workers; i++)
+            queues[i].reset(new WorkerQueue());
+        for (size_t i = 0; i < workers; i++)
+        {
+            threads.emplace_back([this, i]() { run(i); });
+            if (pin && !cpus.empty())
+                pinThread(threads.back().native_handle(), cpus[i % cpus.size()]);
+        }
+    }
+
+    // Lets the workers finish every queued task, then joins them.
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &t : threads)
+            t.join();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Number of worker threads.
+    size_t size() const { return queues.size(); }
+
+    // Queues a task; callable from any thread.
+    void submit(Task task)
+    {
+        size_t target = currentWorker() >= 0 ? static_cast<size_t>(currentWorker())
+                                              : nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+        {
+            std::lock_guard<std::mutex> guard(queues[target]->lock);
+            queues[target]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> guard(sleepLock); // Pairs with the check in run() so no wake-up is lost.
+            pending++;
+        }
+        wake.notify_one();
+    }
+
+    // Function to bind a thread to one CPU; returns false if the CPU is not available.
+    static bool pinThread(pthread_t thread, int cpu)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+    }
+
+    // Function to list the CPUs this process may run on, in ascending order.
+    static std::vector<int> availableCpus()
+    {
+        std::vector<int> cpus;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &set))
+                    cpus.push_back(cpu);
+        return cpus;
+    }
+
+private:
+    // Task deque owned by one worker.
+    struct WorkerQueue
+    {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues; // One deque per worker.
+    std::vector<std::thread> threads;                 // The workers.
+    std::atomic<size_t> nextQueue{0};                 // Round-robin cursor for external submissions.
+    std::mutex sleepLock;                             // Protects 'pending' changes seen by sleeping workers and 'stopping'.
+    std::condition_variable wake;                     // Signalled when tasks arrive or the pool stops.
+    std::atomic<size_t> pending{0};                   // Tasks queued but not yet taken by a worker.
+    bool stopping = false;                            // Set by the destructor.
+
+    // Index of the worker running on this thread, or -1 for threads outside the pool.
+    static int &currentWorker()
+    {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    // Function to take a task: own deque first (newest task), then steal the oldest task of another worker.
+    bool takeTask(size_t self, Task &task)
+    {
+        {
+            WorkerQueue &own = *queues[self];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.tasks.empty())
+            {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); k++)
+        {
+            WorkerQueue &victim = *queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Main loop of worker 'self'.
+    void run(size_t self)
+    {
+        currentWorker() = static_cast<int>(self);
+        while (true)
+        {
+            Task task;
+            if (takeTask(self, task))
+            {
+                pending.fetch_sub(1, std::memory_order_relaxed);
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(sleepLock);
+            wake.wait(guard, [this]() { return stopping || pending.load(std::memory_order_relaxed) > 0; });
+            if (stopping && pending.load(std::memory_order_relaxed) == 0)
+                return; // Nothing left to do.
+        }
+    }
+};
+
+#endif // THREAD_POOL_H